@@ -0,0 +1,254 @@
+#include "base64.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_X86 1
+#include <immintrin.h>
+#endif
+
+/* 57 input bytes make one line of 76 characters. */
+#define BASE64_LINE_BYTES 57
+#define BASE64_LINE_CHARS 76
+
+static const char base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Encode whole groups of 3 bytes; returns the number of characters written. */
+static int encodeScalar(const unsigned char *in, int n, char *out){
+
+    char *o = out;
+
+    for(int i = 0; i + 3 <= n; i += 3){
+        unsigned int v = (in[i] << 16) | (in[i+1] << 8) | in[i+2];
+        o[0] = base64Alphabet[(v >> 18) & 0x3f];
+        o[1] = base64Alphabet[(v >> 12) & 0x3f];
+        o[2] = base64Alphabet[(v >> 6) & 0x3f];
+        o[3] = base64Alphabet[v & 0x3f];
+        o += 4;
+    }
+
+    return o - out;
+
+}
+
+/* The last 1 or 2 bytes, with padding. */
+static int encodeTail(const unsigned char *in, int n, char *out){
+
+    if(n == 1){
+        out[0] = base64Alphabet[in[0] >> 2];
+        out[1] = base64Alphabet[(in[0] & 0x03) << 4];
+        out[2] = '=';
+        out[3] = '=';
+        return 4;
+    }
+
+    if(n == 2){
+        out[0] = base64Alphabet[in[0] >> 2];
+        out[1] = base64Alphabet[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+        out[2] = base64Alphabet[(in[1] & 0x0f) << 2];
+        out[3] = '=';
+        return 4;
+    }
+
+    return 0;
+
+}
+
+#ifdef BASE64_X86
+
+/*
+ * 12 bytes (in the low 12 bytes of every 16) to 16 6-bit values, and
+ * those to ASCII. After W. Mula, "Base64 encoding with SIMD instructions".
+ */
+__attribute__((target("ssse3")))
+static inline __m128i reshuffle128(__m128i in){
+
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+
+    return _mm_or_si128(t1, t3);
+
+}
+
+/* Offset to add per range: A-Z +65, a-z +71, 0-9 -4, '+' -19, '/' -16. */
+__attribute__((target("ssse3")))
+static inline __m128i translate128(__m128i in){
+
+    const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+
+    __m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+    __m128i mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+    indices = _mm_sub_epi8(indices, mask);
+
+    return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+
+}
+
+/* Whole 12 byte blocks while 16 bytes can be read; returns the bytes consumed. */
+__attribute__((target("ssse3")))
+static int encodeSsse3(const unsigned char *in, int n, char **out){
+
+    int i = 0;
+    for(; i + 16 <= n; i += 12){
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        _mm_storeu_si128((__m128i*)*out, translate128(reshuffle128(v)));
+        *out += 16;
+    }
+
+    return i;
+
+}
+
+__attribute__((target("avx2")))
+static inline __m256i reshuffle256(__m256i in){
+
+    in = _mm256_shuffle_epi8(in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                                 10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+    __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+
+    return _mm256_or_si256(t1, t3);
+
+}
+
+__attribute__((target("avx2")))
+static inline __m256i translate256(__m256i in){
+
+    const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+                                         65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+
+    __m256i indices = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+    __m256i mask = _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25));
+    indices = _mm256_sub_epi8(indices, mask);
+
+    return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, indices));
+
+}
+
+/* 24 byte blocks: 12 bytes in each 128 bit lane. */
+__attribute__((target("avx2")))
+static int encodeAvx2(const unsigned char *in, int n, char **out){
+
+    int i = 0;
+    for(; i + 28 <= n; i += 24){
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + i))),
+                                            _mm_loadu_si128((const __m128i*)(in + i + 12)), 1);
+        _mm256_storeu_si256((__m256i*)*out, translate256(reshuffle256(v)));
+        *out += 32;
+    }
+
+    return i;
+
+}
+
+#endif
+
+enum Base64Implementation { Base64Scalar, Base64Ssse3, Base64Avx2 };
+
+static int base64Detected = -1;
+static bool base64ScalarOnly = false;
+
+static int detectImplementation(){
+
+    if(base64Detected < 0){
+        base64Detected = Base64Scalar;
+#ifdef BASE64_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")){
+            base64Detected = Base64Avx2;
+        }
+        else if(__builtin_cpu_supports("ssse3")){
+            base64Detected = Base64Ssse3;
+        }
+#endif
+    }
+
+    return base64ScalarOnly ? (int)Base64Scalar : base64Detected;
+
+}
+
+int Base64::encodedSize(int n){
+
+    int chars = (n + 2) / 3 * 4;
+    int lines = (chars + BASE64_LINE_CHARS - 1) / BASE64_LINE_CHARS;
+
+    return chars + 2 * lines;
+
+}
+
+/* Encode a line (at most 57 bytes) without the CRLF. SIMD loads stay within the line. */
+static int encodeLine(int impl, const unsigned char *in, int n, char *out){
+
+    char *o = out;
+    int i = 0;
+
+#ifdef BASE64_X86
+    if(impl == Base64Avx2){
+        i = encodeAvx2(in, n, &o);
+    }
+    if(impl != Base64Scalar){
+        i += encodeSsse3(in + i, n - i, &o);
+    }
+#else
+    (void)impl;
+#endif
+
+    int whole = (n - i) / 3 * 3;
+    o += encodeScalar(in + i, whole, o);
+    i += whole;
+    o += encodeTail(in + i, n - i, o);
+
+    return o - out;
+
+}
+
+int Base64::encode(const char *in, int n, char *out){
+
+    int impl = detectImplementation();
+    const unsigned char *u = (const unsigned char*)in;
+    char *o = out;
+
+    for(int i = 0; i < n; i += BASE64_LINE_BYTES){
+        int len = n - i < BASE64_LINE_BYTES ? n - i : BASE64_LINE_BYTES;
+
+        o += encodeLine(impl, u + i, len, o);
+        *o++ = '\r';
+        *o++ = '\n';
+    }
+
+    return o - out;
+
+}
+
+QByteArray Base64::encode(const QByteArray &data){
+
+    QByteArray res;
+    res.resize(encodedSize(data.size()));
+    res.resize(encode(data.constData(), data.size(), res.data()));
+
+    return res;
+
+}
+
+const char *Base64::implementation(){
+
+    switch(detectImplementation()){
+      case Base64Avx2:  return "avx2";
+      case Base64Ssse3: return "ssse3";
+      default:          return "scalar";
+    }
+
+}
+
+void Base64::setScalarOnly(bool scalar){
+
+    base64ScalarOnly = scalar;
+
+}
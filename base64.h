@@ -0,0 +1,31 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <QByteArray>
+
+/*
+ * Base64 encoder for MIME bodies (RFC 2045): lines of 76 characters,
+ * ended by CRLF, written straight into the output buffer.
+ *
+ * Uses AVX2 or SSSE3 when the CPU has it (checked once at runtime),
+ * the portable scalar code otherwise.
+ */
+class Base64
+{
+public:
+    /* Size of the wrapped output of n input bytes. */
+    static int encodedSize(int n);
+
+    /* Encode n bytes into out (encodedSize(n) bytes); returns the size written. */
+    static int encode(const char *in, int n, char *out);
+
+    static QByteArray encode(const QByteArray &data);
+
+    /* Name of the implementation in use: "avx2", "ssse3" or "scalar". */
+    static const char *implementation();
+
+    /* Force the scalar code, e.g. to compare in benchmarks. */
+    static void setScalarOnly(bool scalar);
+};
+
+#endif // BASE64_H
@@ -0,0 +1,195 @@
+#include "batchtimer.h"
+
+#include <QFile>
+#include <QMap>
+#include <QThread>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QCoreApplication>
+
+BatchTimer::BatchTimer(){
+
+    m_clock.start();
+
+}
+
+/* Restart the clock for a new batch. */
+void BatchTimer::start(){
+
+    QMutexLocker lock(&m_mutex);
+    m_spans.clear();
+    m_counters.clear();
+    m_clock.restart();
+
+}
+
+qint64 BatchTimer::elapsed() const{
+
+    return m_clock.nsecsElapsed();
+
+}
+
+void BatchTimer::addSpan(const QString &name, qint64 start, qint64 duration){
+
+    TimerSpan span;
+    span.name = name;
+    span.start = start;
+    span.duration = duration;
+    span.thread = (quint64)(quintptr)QThread::currentThreadId();
+
+    QMutexLocker lock(&m_mutex);
+    m_spans.append(span);
+
+}
+
+/* Chain consecutive phases without nesting them in scopes. */
+void BatchTimer::lap(const char *name, qint64 &start){
+
+    qint64 now = elapsed();
+    addSpan(QString::fromLatin1(name), start, now - start);
+    start = now;
+
+}
+
+QList<TimerSpan> BatchTimer::spans() const{
+
+    QMutexLocker lock(&m_mutex);
+    return m_spans;
+
+}
+
+void BatchTimer::setCounter(const QString &name, qint64 value){
+
+    QMutexLocker lock(&m_mutex);
+    m_counters.insert(name, value);
+
+}
+
+QMap<QString, qint64> BatchTimer::counters() const{
+
+    QMutexLocker lock(&m_mutex);
+    return m_counters;
+
+}
+
+/* Aggregate the spans per phase name. */
+QString BatchTimer::summary() const{
+
+    struct Stats {
+        int count;
+        qint64 total;
+        qint64 min;
+        qint64 max;
+    };
+
+    QMap<QString, Stats> phases;
+    foreach(const TimerSpan &span, spans()){
+        if(!phases.contains(span.name)){
+            Stats s = { 0, 0, span.duration, span.duration };
+            phases.insert(span.name, s);
+        }
+
+        Stats &s = phases[span.name];
+        s.count++;
+        s.total += span.duration;
+        s.min = qMin(s.min, span.duration);
+        s.max = qMax(s.max, span.duration);
+    }
+
+    QString txt = QString("%1 %2 %3 %4 %5 %6\n")
+                      .arg(QString("Phase"), -24)
+                      .arg(QString("Count"), 7)
+                      .arg(QString("Total ms"), 11)
+                      .arg(QString("Avg ms"), 9)
+                      .arg(QString("Min ms"), 9)
+                      .arg(QString("Max ms"), 9);
+
+    QMap<QString, Stats>::const_iterator i;
+    for(i = phases.constBegin(); i != phases.constEnd(); ++i){
+        const Stats &s = i.value();
+        txt += QString("%1 %2 %3 %4 %5 %6\n")
+                   .arg(i.key(), -24)
+                   .arg(s.count, 7)
+                   .arg(s.total / 1e6, 11, 'f', 2)
+                   .arg(s.total / 1e6 / s.count, 9, 'f', 3)
+                   .arg(s.min / 1e6, 9, 'f', 3)
+                   .arg(s.max / 1e6, 9, 'f', 3);
+    }
+
+    QMap<QString, qint64> c = counters();
+    if(!c.isEmpty()){
+        txt += QString("\n%1 %2\n").arg(QString("Counter"), -24).arg(QString("Value"), 11);
+        QMap<QString, qint64>::const_iterator j;
+        for(j = c.constBegin(); j != c.constEnd(); ++j){
+            txt += QString("%1 %2\n").arg(j.key(), -24).arg(j.value(), 11);
+        }
+        txt += QString("\n");
+    }
+
+    txt += QString("Batch wall time: %1 ms\n").arg(elapsed() / 1e6, 0, 'f', 1);
+
+    return txt;
+
+}
+
+/* Chrome trace-event format: one complete ("X") event per span, times in us. */
+bool BatchTimer::exportChromeTrace(const QString &fileName) const{
+
+    QJsonArray events;
+    foreach(const TimerSpan &span, spans()){
+        QJsonObject e;
+        e.insert(QString("name"), span.name);
+        e.insert(QString("cat"), span.name.section(QChar('.'), 0, 0));
+        e.insert(QString("ph"), QString("X"));
+        e.insert(QString("ts"), span.start / 1000.0);
+        e.insert(QString("dur"), span.duration / 1000.0);
+        e.insert(QString("pid"), (qint64)QCoreApplication::applicationPid());
+        e.insert(QString("tid"), (qint64)span.thread);
+        events.append(e);
+    }
+
+    /* Counters as counter ("C") events at the end of the batch. */
+    QMap<QString, qint64> c = counters();
+    QMap<QString, qint64>::const_iterator j;
+    for(j = c.constBegin(); j != c.constEnd(); ++j){
+        QJsonObject args;
+        args.insert(QString("value"), j.value());
+
+        QJsonObject e;
+        e.insert(QString("name"), j.key());
+        e.insert(QString("ph"), QString("C"));
+        e.insert(QString("ts"), elapsed() / 1000.0);
+        e.insert(QString("pid"), (qint64)QCoreApplication::applicationPid());
+        e.insert(QString("args"), args);
+        events.append(e);
+    }
+
+    QJsonObject root;
+    root.insert(QString("traceEvents"), events);
+    root.insert(QString("displayTimeUnit"), QString("ms"));
+
+    QFile f(fileName);
+    if(!f.open(QIODevice::WriteOnly | QIODevice::Truncate)){
+        return false;
+    }
+
+    return f.write(QJsonDocument(root).toJson(QJsonDocument::Compact)) >= 0;
+
+}
+
+ScopedTimer::ScopedTimer(BatchTimer *timer, const char *name) :
+    m_timer(timer), m_name(name), m_start(0)
+{
+    if(m_timer != NULL){
+        m_start = m_timer->elapsed();
+    }
+}
+
+ScopedTimer::~ScopedTimer(){
+
+    if(m_timer != NULL){
+        m_timer->addSpan(QString::fromLatin1(m_name), m_start, m_timer->elapsed() - m_start);
+    }
+
+}
@@ -0,0 +1,80 @@
+#ifndef BATCHTIMER_H
+#define BATCHTIMER_H
+
+#include <QString>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QElapsedTimer>
+
+/* A single timed phase, times in nanoseconds since the start of the batch. */
+struct TimerSpan {
+    QString name;
+    qint64 start;
+    qint64 duration;
+    quint64 thread;
+};
+
+/*
+ * Collects the timed phases of one send batch.
+ *
+ * Spans can be summarized per phase name for the report mail, or
+ * exported as Chrome trace-event JSON (chrome://tracing, Perfetto).
+ */
+class BatchTimer
+{
+public:
+    BatchTimer();
+
+    /* (Re)start the clock and forget all spans. */
+    void start();
+
+    /* Nanoseconds since start(). */
+    qint64 elapsed() const;
+
+    /* Record a span. Thread-safe. */
+    void addSpan(const QString &name, qint64 start, qint64 duration);
+
+    /* Record a span from start until now and set start to now. */
+    void lap(const char *name, qint64 &start);
+
+    QList<TimerSpan> spans() const;
+
+    /* Set a counter of the batch, e.g. allocations. Thread-safe. */
+    void setCounter(const QString &name, qint64 value);
+    QMap<QString, qint64> counters() const;
+
+    /* Per-phase count/total/avg/min/max and the counters as plain text. */
+    QString summary() const;
+
+    /* Write all spans as Chrome trace-event JSON. */
+    bool exportChromeTrace(const QString &fileName) const;
+
+private:
+    QElapsedTimer m_clock;
+    QList<TimerSpan> m_spans;
+    QMap<QString, qint64> m_counters;
+    mutable QMutex m_mutex;
+};
+
+/*
+ * Times the scope it is declared in:
+ *
+ *   ScopedTimer t(m_batchTimer, "render.text");
+ *
+ * Does nothing when timer is NULL, so it can stay in code that
+ * also runs outside of a batch (e.g. the preview).
+ */
+class ScopedTimer
+{
+public:
+    ScopedTimer(BatchTimer *timer, const char *name);
+    ~ScopedTimer();
+
+private:
+    BatchTimer *m_timer;
+    const char *m_name;
+    qint64 m_start;
+};
+
+#endif // BATCHTIMER_H
@@ -0,0 +1,94 @@
+#include "bccdigest.h"
+
+#include <QDateTime>
+
+#include "base64.h"
+
+/* 57 bytes make a 76 character base64 line. */
+#define BCCDIGEST_LINE_BYTES 57
+
+BccDigest::BccDigest(){
+
+    m_count = 0;
+    m_finished = false;
+
+}
+
+bool BccDigest::open(){
+
+    return m_file.open();
+
+}
+
+void BccDigest::append(int row, const QString &header, const QByteArray &text){
+
+    write(QString("\n\n============================== ") + QString::number(row) + QString(" ==============================\n"));
+    write(header);
+    write(text);
+
+    m_count++;
+
+}
+
+/* Text lines end in CRLF, every full 57 bytes become a base64 line. */
+void BccDigest::write(const QString &text){
+
+    write(text.toUtf8());
+
+}
+
+void BccDigest::write(const QByteArray &utf8){
+
+    QByteArray crlf = utf8;
+    crlf.replace("\n", "\r\n");
+    m_pending.append(crlf);
+
+    int full = m_pending.size() - m_pending.size() % BCCDIGEST_LINE_BYTES;
+    QByteArray lines;
+    lines.resize(Base64::encodedSize(full));
+    lines.resize(Base64::encode(m_pending.constData(), full, lines.data()));
+
+    m_file.write(lines);
+    m_pending.remove(0, full);
+
+}
+
+/* The last, partial line. */
+void BccDigest::finish(){
+
+    if(m_finished){
+        return;
+    }
+
+    write(QString("\n============================== END ==============================\n"));
+    if(!m_pending.isEmpty()){
+        m_file.write(Base64::encode(m_pending));
+        m_pending.clear();
+    }
+    m_file.flush();
+
+    m_finished = true;
+
+}
+
+bool BccDigest::send(SmtpSession *session, const QString &senderName, const QString &senderAddress,
+                     const QString &recipient, const QString &subject){
+
+    finish();
+
+    /* Non-ASCII names and subjects as RFC 2047 encoded words. */
+    QByteArray header;
+    header += "From: =?utf-8?B?" + senderName.toUtf8().toBase64() + "?= <" + senderAddress.toUtf8() + ">\r\n";
+    header += "To: <" + recipient.toUtf8() + ">\r\n";
+    header += "Subject: =?utf-8?B?" + subject.toUtf8().toBase64() + "?=\r\n";
+    header += "Date: " + QDateTime::currentDateTime().toString(Qt::RFC2822Date).toLatin1() + "\r\n";
+    header += "MIME-Version: 1.0\r\n";
+    header += "Content-Type: text/plain; charset=utf-8\r\n";
+    header += "Content-Transfer-Encoding: base64\r\n";
+    header += "\r\n";
+
+    m_file.seek(0);
+
+    return session->sendStream(senderAddress, QStringList() << recipient, header, &m_file);
+
+}
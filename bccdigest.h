@@ -0,0 +1,46 @@
+#ifndef BCCDIGEST_H
+#define BCCDIGEST_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QTemporaryFile>
+
+#include "smtpsession.h"
+
+/*
+ * One message with all mails of a batch, for the Bcc addresses.
+ *
+ * Instead of a copy of every mail, every Bcc address gets a single
+ * digest after the batch. The mails are base64 encoded into a temporary
+ * file as they are delivered, and streamed from that file when the
+ * digest is sent, so the batch is never in memory as a whole.
+ */
+class BccDigest
+{
+public:
+    BccDigest();
+
+    bool open();
+
+    /* Add a delivered mail. */
+    void append(int row, const QString &header, const QByteArray &text);
+    int count() const { return m_count; }
+
+    /* Send the digest to one address. */
+    bool send(SmtpSession *session, const QString &senderName, const QString &senderAddress,
+              const QString &recipient, const QString &subject);
+
+private:
+    /* Encode text, or UTF-8 bytes, into base64 lines. */
+    void write(const QString &text);
+    void write(const QByteArray &utf8);
+    void finish();
+
+    QTemporaryFile m_file;
+    QByteArray m_pending;
+    int m_count;
+    bool m_finished;
+};
+
+#endif // BCCDIGEST_H
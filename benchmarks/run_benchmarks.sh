@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# Run the benchmarks headless and save or compare a baseline.
+#
+# Usage:
+#   ./run_benchmarks.sh save    [baseline.csv]   Write a new baseline.
+#   ./run_benchmarks.sh compare [baseline.csv]   Compare against a baseline.
+#
+# Compare exits non-zero when a benchmark is more than THRESHOLD percent
+# (default 10) slower than its baseline value.
+#
+# With TLS_STANDIN=1 a local TLS relay (smtp_tls_standin.py, python3) is
+# started with a self-signed certificate (openssl) for the TLS handshake
+# benchmarks, on port TLS_PORT (default 4650).
+#
+
+MODE=${1:-compare}
+BASELINE=${2:-baseline.csv}
+THRESHOLD=${THRESHOLD:-10}
+BINARY=${BINARY:-./tst_benchmarks}
+RESULT=$(mktemp)
+
+trap 'rm -f "$RESULT"' EXIT
+
+if [ "$TLS_STANDIN" = "1" ]; then
+  TLS_DIR=$(mktemp -d)
+  TLS_PORT=${TLS_PORT:-4650}
+  openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+    -addext "subjectAltName=DNS:localhost,IP:127.0.0.1" \
+    -keyout "$TLS_DIR/key.pem" -out "$TLS_DIR/cert.pem" 2>/dev/null || exit 1
+  python3 "$(dirname "$0")/smtp_tls_standin.py" "$TLS_PORT" "$TLS_DIR/cert.pem" "$TLS_DIR/key.pem" &
+  TLS_PID=$!
+  trap 'rm -f "$RESULT"; kill $TLS_PID; rm -rf "$TLS_DIR"' EXIT
+  sleep 1
+
+  export SMTP_TLS_STANDIN_PORT=$TLS_PORT
+  export SMTP_TLS_CA=$TLS_DIR/cert.pem
+fi
+
+# QtTest csv output: "function","tag","unit",value,iterations,total
+"$BINARY" -platform offscreen -o "$RESULT",csv || exit 1
+
+case "$MODE" in
+  save)
+    cp "$RESULT" "$BASELINE"
+    echo "Baseline written to $BASELINE"
+    ;;
+  compare)
+    if [ ! -f "$BASELINE" ]; then
+      echo "No baseline $BASELINE, run '$0 save' first."
+      exit 1
+    fi
+    awk -F, -v threshold="$THRESHOLD" '
+      NR == FNR { base[$1 "," $2] = $4; next }
+      ($1 "," $2) in base && base[$1 "," $2] > 0 {
+        change = ($4 - base[$1 "," $2]) * 100 / base[$1 "," $2]
+        status = change > threshold ? "REGRESSION" : "ok"
+        if (change > threshold) failed++
+        printf "%-10s %-60s %12g -> %12g %+7.1f%%\n", status, $1 " " $2, base[$1 "," $2], $4, change
+      }
+      END { exit failed > 0 }
+    ' "$BASELINE" "$RESULT"
+    ;;
+  *)
+    echo "Unknown mode $MODE, use save or compare."
+    exit 1
+    ;;
+esac
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+#
+# Minimal SMTP server with implicit TLS, as a stand-in relay for the
+# TLS benchmarks. It accepts everything and keeps one TLS context, so
+# clients can resume their sessions.
+#
+# Usage:
+#   ./smtp_tls_standin.py PORT CERT KEY
+#
+
+import socket
+import ssl
+import sys
+import threading
+
+
+def serve(conn):
+    f = conn.makefile('rwb')
+
+    def reply(line):
+        f.write(line.encode() + b'\r\n')
+        f.flush()
+
+    try:
+        reply('220 standin ESMTP')
+        while True:
+            line = f.readline()
+            if not line:
+                break
+            cmd = line.strip().upper()
+            if cmd.startswith(b'EHLO'):
+                reply('250-standin')
+                reply('250-8BITMIME')
+                reply('250 AUTH PLAIN LOGIN')
+            elif cmd.startswith(b'AUTH PLAIN'):
+                reply('235 ok')
+            elif cmd.startswith(b'AUTH LOGIN'):
+                reply('334 VXNlcm5hbWU6')
+                f.readline()
+                reply('334 UGFzc3dvcmQ6')
+                f.readline()
+                reply('235 ok')
+            elif cmd == b'DATA':
+                reply('354 go ahead')
+                while f.readline() not in (b'.\r\n', b''):
+                    pass
+                reply('250 queued')
+            elif cmd == b'QUIT':
+                reply('221 bye')
+                break
+            else:
+                reply('250 ok')
+    except (OSError, ssl.SSLError):
+        pass
+    finally:
+        conn.close()
+
+
+def main():
+    port, cert, key = int(sys.argv[1]), sys.argv[2], sys.argv[3]
+
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(cert, key)
+
+    server = socket.create_server(('127.0.0.1', port))
+    while True:
+        raw, _ = server.accept()
+        try:
+            conn = context.wrap_socket(raw, server_side=True)
+        except (OSError, ssl.SSLError):
+            raw.close()
+            continue
+        threading.Thread(target=serve, args=(conn,), daemon=True).start()
+
+
+if __name__ == '__main__':
+    main()
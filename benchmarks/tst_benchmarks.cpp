@@ -0,0 +1,803 @@
+#include <QtTest>
+#include <QTableView>
+#include <QTemporaryDir>
+
+#include <QtXlsx>
+#include "xlsxsheetmodel.h"
+
+#include "mainwindow.h"
+#include "base64.h"
+#include "tlssessioncache.h"
+#include "relaypool.h"
+#include "shard.h"
+#include "sqlsource.h"
+#include "csvsource.h"
+#include "xlsxsource.h"
+
+#include <QSqlDatabase>
+#include <QSqlQuery>
+
+#include <mimecontentformatter.h>
+#include <quotedprintable.h>
+
+/*
+ * Microbenchmarks for the template and data access hot paths.
+ *
+ * The benchmarks drive the private methods of MainWindow directly, so the
+ * numbers are not polluted by dialogs or the SMTP connection. Run with
+ * "-platform offscreen" to run without a display, see run_benchmarks.sh.
+ */
+class tst_Benchmarks : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    /* Template rendering. */
+    void getMailText_data();
+    void getMailText();
+    void renderBatch_data();
+    void renderBatch();
+
+    /* Data access. */
+    void getDataCell_data();
+    void getDataCell();
+    void getDataRowCol();
+
+    /* Validators. */
+    void isValidEmail();
+    void isValidHRStudentEmail();
+    void isValidHREmployeeEmail();
+
+    /* Selection boxes. */
+    void updateInfo_data();
+    void updateInfo();
+
+    /* Header with attachments. */
+    void getMailHeader_data();
+    void getMailHeader();
+
+    /* Attachment encoding: SmtpClient (Qt), scalar and SIMD. */
+    void base64_data();
+    void base64();
+
+    /* Body encoding: SmtpClient quoted-printable and BodyEncoder. */
+    void bodyEncoding_data();
+    void bodyEncoding();
+
+    /* TLS handshakes against a local stand-in relay. */
+    void tlsHandshake_data();
+    void tlsHandshake();
+
+    /* Choosing the relay of a message. */
+    void relayPick_data();
+    void relayPick();
+
+    /* Splitting a batch into shards. */
+    void shardOf_data();
+    void shardOf();
+
+    /* A database query as the sheet, all rows or some recipients. */
+    void sqlLoad_data();
+    void sqlLoad();
+
+    /* A CSV file as the sheet, on one thread and in parallel chunks. */
+    void csvLoad_data();
+    void csvLoad();
+
+    /* A workbook of many sheets: QXlsx, or XlsxSource on one thread and in parallel. */
+    void xlsxLoad_data();
+    void xlsxLoad();
+
+private:
+    void useSheet(int rows, int cols);
+    void useTemplate(int columns, int repeat);
+    void useAttachments(int n);
+
+    MainWindow *m_window;
+    QXlsx::Document *m_document;
+    QTemporaryDir *m_tmpDir;
+};
+
+/* Create the window once, without touching the users settings. */
+void tst_Benchmarks::initTestCase(){
+
+    QStandardPaths::setTestModeEnabled(true);
+
+    m_tmpDir = new QTemporaryDir();
+    QVERIFY(m_tmpDir->isValid());
+
+    m_document = NULL;
+    m_window = new MainWindow();
+
+    useSheet(100, 10);
+}
+
+void tst_Benchmarks::cleanupTestCase(){
+
+    delete m_window;
+    delete m_document;
+    delete m_tmpDir;
+
+}
+
+/*
+ * Replace the loaded sheets by a generated sheet of rows x cols.
+ *
+ * Column A contains a student number, column B a name and all
+ * other columns contain grades.
+ */
+void tst_Benchmarks::useSheet(int rows, int cols){
+
+    /* Remove previously loaded sheets. */
+    for(int i = m_window->m_xlsxTab->count() - 1; i > 0; i--){
+        QWidget *w = m_window->m_xlsxTab->widget(i);
+        m_window->m_xlsxTab->removeTab(i);
+        delete w;
+    }
+    delete m_document;
+
+    /* Generate data. */
+    m_document = new QXlsx::Document();
+    for(int row = 1; row <= rows; row++){
+        m_document->write(row, 1, QString::number(1000000 + row));
+        m_document->write(row, 2, QString("Student %1").arg(row));
+        for(int col = 3; col <= cols; col++){
+            m_document->write(row, col, (row * col) % 10 + 0.5);
+        }
+    }
+
+    /* Show it the same way loadSheet() does. */
+    QTableView *view = new QTableView(m_window->m_xlsxTab);
+    view->setModel(new QXlsx::SheetModel(m_document->currentWorksheet(), view));
+    int tabIndex = m_window->m_xlsxTab->addTab(view, QString("bench"));
+    m_window->m_xlsxTab->setCurrentIndex(tabIndex);
+
+    /* Select all rows, column A contains the address. */
+    m_window->m_emailColumnSelect->setCurrentText(QString("A"));
+    m_window->m_emailAppendText->setText(QString("@hr.nl"));
+    m_window->m_firstRowSelect->setCurrentText(QString("1"));
+    m_window->m_lastRowSelect->setCurrentText(QString::number(rows));
+
+}
+
+/* Set a template that refers to `columns` columns, repeated `repeat` times. */
+void tst_Benchmarks::useTemplate(int columns, int repeat){
+
+    QString txt;
+    for(int r = 0; r < repeat; r++){
+        txt += QString("Beste #B#,\n\nJe cijfer voor het vak #B1# is een #C#.\n\n");
+        for(int col = 0; col < columns; col++){
+            QString name = QString(QChar('C' + (col % 20)));
+            txt += QString("#%1#: #%1#/#%1%2#\n").arg(name).arg(1);
+        }
+        txt += QString("\nMet vriendelijke groet,\n\nDo Cent\n");
+    }
+
+    QTextEdit *te = qobject_cast<QTextEdit*>(m_window->m_textTab->currentWidget());
+    QVERIFY(te != NULL);
+    te->setPlainText(txt);
+
+}
+
+/* Add n global attachments. */
+void tst_Benchmarks::useAttachments(int n){
+
+    m_window->m_attachments->clear();
+    for(int i = 0; i < n; i++){
+        QString filePath = m_tmpDir->path() + QString("/attachment%1.pdf").arg(i);
+        QFile f(filePath);
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write(QByteArray(4096, 'x'));
+        f.close();
+        m_window->m_attachments->addItem(QFileInfo(filePath).fileName(), filePath);
+    }
+
+}
+
+void tst_Benchmarks::getMailText_data(){
+
+    QTest::addColumn<int>("columns");
+    QTest::addColumn<int>("repeat");
+
+    QTest::newRow("small") << 3 << 1;
+    QTest::newRow("large") << 20 << 25;
+
+}
+
+void tst_Benchmarks::getMailText(){
+
+    QFETCH(int, columns);
+    QFETCH(int, repeat);
+
+    useSheet(100, 25);
+    useTemplate(columns, repeat);
+
+    QString res;
+    QBENCHMARK {
+        res = m_window->getMailText(50);
+    }
+    QVERIFY(!res.contains(QString("[INV_REF!]")));
+
+}
+
+void tst_Benchmarks::renderBatch_data(){
+
+    QTest::addColumn<bool>("snapshot");
+
+    QTest::newRow("getMailText") << false;
+    QTest::newRow("snapshot") << true;
+
+}
+
+/* All mails of a batch as UTF-8, the snapshot is taken once per batch. */
+void tst_Benchmarks::renderBatch(){
+
+    QFETCH(bool, snapshot);
+
+    int rows = 1000;
+    useSheet(rows, 25);
+    useTemplate(20, 1);
+
+    QByteArray res;
+    QBENCHMARK {
+        if(snapshot){
+            QTableView *view = (QTableView*)m_window->m_xlsxTab->currentWidget();
+            SheetSnapshot sheet(view->model());
+            for(int i = 1; i <= rows; i++){
+                m_window->mailTemplate().render(sheet, i, &res);
+            }
+        }
+        else{
+            for(int i = 1; i <= rows; i++){
+                res = m_window->getMailText(i).toUtf8();
+            }
+        }
+    }
+    QCOMPARE(res, m_window->getMailText(rows).toUtf8());
+
+}
+
+void tst_Benchmarks::getDataCell_data(){
+
+    QTest::addColumn<QString>("cell");
+
+    QTest::newRow("column") << QString("C");
+    QTest::newRow("column-row") << QString("C12");
+    QTest::newRow("lowercase") << QString("c");
+    QTest::newRow("two-letter") << QString("AB");
+    QTest::newRow("four-letter") << QString("ABCD12");
+    QTest::newRow("invalid") << QString("12");
+
+}
+
+void tst_Benchmarks::getDataCell(){
+
+    QFETCH(QString, cell);
+
+    useSheet(100, 10);
+
+    QBENCHMARK {
+        m_window->getData(cell, 50);
+    }
+
+}
+
+void tst_Benchmarks::getDataRowCol(){
+
+    useSheet(100, 10);
+
+    QBENCHMARK {
+        for(int row = 1; row <= 100; row++){
+            m_window->getData(row, 3);
+        }
+    }
+
+}
+
+void tst_Benchmarks::isValidEmail(){
+
+    bool ok = false;
+    QBENCHMARK {
+        ok = m_window->isValidEmail(QString("do.cent+tag@sub.example.com"));
+    }
+    QVERIFY(ok);
+
+}
+
+void tst_Benchmarks::isValidHRStudentEmail(){
+
+    bool ok = false;
+    QBENCHMARK {
+        ok = m_window->isValidHRStudentEmail(QString("1234567@hr.nl"));
+    }
+    QVERIFY(ok);
+
+}
+
+void tst_Benchmarks::isValidHREmployeeEmail(){
+
+    bool ok = false;
+    QBENCHMARK {
+        ok = m_window->isValidHREmployeeEmail(QString("abcde@hr.nl"));
+    }
+    QVERIFY(ok);
+
+}
+
+void tst_Benchmarks::updateInfo_data(){
+
+    QTest::addColumn<int>("rows");
+    QTest::addColumn<bool>("changedOnly");
+
+    QTest::newRow("1k") << 1000 << false;
+    QTest::newRow("10k") << 10000 << false;
+
+    /* Renders and hashes every row; the (test mode) history is empty. */
+    QTest::newRow("1k changed only") << 1000 << true;
+    QTest::newRow("10k changed only") << 10000 << true;
+
+}
+
+void tst_Benchmarks::updateInfo(){
+
+    QFETCH(int, rows);
+    QFETCH(bool, changedOnly);
+
+    useSheet(rows, 5);
+    useTemplate(3, 1);
+    m_window->m_changedOnly->setChecked(changedOnly);
+
+    QBENCHMARK {
+        m_window->updateInfo();
+    }
+    QCOMPARE(m_window->m_previewSelect->count(), rows);
+
+    m_window->m_changedOnly->setChecked(false);
+
+}
+
+void tst_Benchmarks::getMailHeader_data(){
+
+    QTest::addColumn<int>("attachments");
+
+    QTest::newRow("none") << 0;
+    QTest::newRow("10") << 10;
+    QTest::newRow("100") << 100;
+
+}
+
+void tst_Benchmarks::getMailHeader(){
+
+    QFETCH(int, attachments);
+
+    useSheet(100, 5);
+    useAttachments(attachments);
+    m_window->m_emailBcc->setText(QString("collegue@hr.nl;other@extern.com"));
+
+    QBENCHMARK {
+        m_window->getMailHeader(50);
+    }
+
+    m_window->m_attachments->clear();
+
+}
+
+void tst_Benchmarks::base64_data(){
+
+    QTest::addColumn<QString>("encoder");
+    QTest::addColumn<int>("size");
+
+    foreach(QString encoder, QStringList() << QString("qt") << QString("scalar") << QString("simd")){
+        QTest::newRow(qPrintable(encoder + QString(" 64k"))) << encoder << 64 * 1024;
+        QTest::newRow(qPrintable(encoder + QString(" 4M"))) << encoder << 4 * 1024 * 1024;
+    }
+
+}
+
+void tst_Benchmarks::base64(){
+
+    QFETCH(QString, encoder);
+    QFETCH(int, size);
+
+    QByteArray data(size, Qt::Uninitialized);
+    for(int i = 0; i < size; i++){
+        data[i] = (char)qrand();
+    }
+
+    /* What MimePart does: toBase64() and wrap to 76 columns. */
+    MimeContentFormatter formatter(76);
+    QString expected = formatter.format(QString::fromLatin1(data.toBase64())) + QString("\r\n");
+
+    Base64::setScalarOnly(encoder == QString("scalar"));
+
+    QString res;
+    if(encoder == QString("qt")){
+        QBENCHMARK {
+            res = formatter.format(QString::fromLatin1(data.toBase64()));
+        }
+        res += QString("\r\n");
+    }
+    else{
+        QBENCHMARK {
+            res = QString::fromLatin1(Base64::encode(data));
+        }
+    }
+
+    Base64::setScalarOnly(false);
+
+    QCOMPARE(res, expected);
+
+}
+
+void tst_Benchmarks::bodyEncoding_data(){
+
+    QTest::addColumn<QString>("encoder");
+    QTest::addColumn<bool>("eightBit");
+
+    QTest::newRow("qt quoted-printable") << QString("qt") << false;
+    QTest::newRow("fast quoted-printable") << QString("fast") << false;
+    QTest::newRow("fast 8bit") << QString("fast") << true;
+
+}
+
+void tst_Benchmarks::bodyEncoding(){
+
+    QFETCH(QString, encoder);
+    QFETCH(bool, eightBit);
+
+    /* A long Dutch mail with the occasional accent. */
+    QString line = QString::fromUtf8("Beste student, je cijfer voor het tentamen is een 7,5. Zie je reactie op \xc3\xa9\xc3\xa9n van de opgaven.\n");
+    QByteArray body = line.repeated(200).toUtf8();
+
+    MimeContentFormatter formatter(76);
+    BodyEncoder::Encoding encoding;
+
+    if(encoder == QString("qt")){
+        QBENCHMARK {
+            formatter.format(QuotedPrintable::encode(body), true);
+        }
+    }
+    else{
+        QByteArray out;
+        QBENCHMARK {
+            out = BodyEncoder::encode(body, eightBit, &encoding);
+        }
+        QCOMPARE(encoding, eightBit ? BodyEncoder::EightBit : BodyEncoder::QuotedPrintable);
+
+        QByteArray crlf = QByteArray(body).replace("\n", "\r\n");
+        if(eightBit){
+            QCOMPARE(out, crlf);
+            return;
+        }
+
+        /* Lines of at most 76 characters, soft breaks included. */
+        QVERIFY(out.endsWith("\r\n"));
+        foreach(const QByteArray &l, out.split('\n')){
+            QVERIFY(l.isEmpty() || l.endsWith('\r'));
+            QVERIFY2(l.size() - 1 <= 76, l.constData());
+        }
+
+        /* The SmtpClient decoder does not know soft line breaks. */
+        QByteArray decoded = QuotedPrintable::decode(QString::fromLatin1(QByteArray(out).replace("=\r\n", "")));
+        QCOMPARE(decoded, crlf);
+
+        /* Whitespace before a line break, also at the end of a full line. */
+        QByteArray spaces = QByteArray("a \nb\t\n") + QByteArray(74, 'c') + " \n\xc3\xa9\t";
+        out = BodyEncoder::encode(spaces, false, &encoding);
+        QCOMPARE(encoding, BodyEncoder::QuotedPrintable);
+        QVERIFY(out.startsWith("a=20\r\nb=09\r\n"));
+        QVERIFY(out.endsWith("=C3=A9=09"));
+        QVERIFY(!out.contains(" \r\n") && !out.contains("\t\r\n"));
+        foreach(const QByteArray &l, out.split('\n')){
+            QVERIFY2(l.size() - 1 <= 76, l.constData());
+        }
+        decoded = QuotedPrintable::decode(QString::fromLatin1(QByteArray(out).replace("=\r\n", "")));
+        QCOMPARE(decoded, QByteArray(spaces).replace("\n", "\r\n"));
+    }
+
+}
+
+void tst_Benchmarks::tlsHandshake_data(){
+
+    QTest::addColumn<bool>("resume");
+
+    QTest::newRow("full") << false;
+    QTest::newRow("resumed") << true;
+
+}
+
+/* Needs smtp_tls_standin.py with a self-signed certificate, see run_benchmarks.sh. */
+void tst_Benchmarks::tlsHandshake(){
+
+    QFETCH(bool, resume);
+
+    int port = qgetenv("SMTP_TLS_STANDIN_PORT").toInt();
+    QString ca = QString::fromLocal8Bit(qgetenv("SMTP_TLS_CA"));
+    if(port == 0 || ca.isEmpty()){
+        QSKIP("No TLS stand-in, set SMTP_TLS_STANDIN_PORT and SMTP_TLS_CA.");
+    }
+    QSslSocket::addDefaultCaCertificates(ca);
+
+    TlsSessionCache *cache = TlsSessionCache::instance();
+    int resumedBefore = cache->resumedHandshakes();
+    int n = 0;
+
+    QBENCHMARK {
+        if(!resume){
+            cache->remove(QString("localhost"), port);
+        }
+        SmtpSession session(QString("localhost"), port, SmtpClient::SslConnection);
+        QVERIFY(session.connectToHost());
+        n++;
+    }
+
+    /* Only the first connection of a run may need a full handshake. */
+    if(resume){
+        QVERIFY(cache->resumedHandshakes() - resumedBefore >= n - 1);
+    }
+    else{
+        QCOMPARE(cache->resumedHandshakes(), resumedBefore);
+    }
+
+}
+
+void tst_Benchmarks::relayPick_data(){
+
+    QTest::addColumn<int>("relays");
+
+    QTest::newRow("1 relay") << 1;
+    QTest::newRow("3 relays") << 3;
+    QTest::newRow("10 relays") << 10;
+
+}
+
+void tst_Benchmarks::relayPick(){
+
+    QFETCH(int, relays);
+
+    /* Weights 1..n, all equally fast: the mail is spread by weight. */
+    RelayPool pool;
+    for(int i = 0; i < relays; i++){
+        pool.addRelay(QString("relay%1.example.org").arg(i), 25, SmtpClient::TcpConnection, i + 1);
+    }
+
+    QBENCHMARK {
+        for(int m = 0; m < 1000; m++){
+            int r = pool.pick();
+            pool.result(r, SmtpSession::Delivered, 20000);
+        }
+    }
+
+    double ratio = (double)pool.relay(relays - 1).delivered / pool.relay(0).delivered;
+    QVERIFY(qAbs(ratio - relays) < 0.1 * relays);
+
+}
+
+void tst_Benchmarks::shardOf_data(){
+
+    QTest::addColumn<int>("shards");
+
+    QTest::newRow("2 shards") << 2;
+    QTest::newRow("8 shards") << 8;
+
+}
+
+void tst_Benchmarks::shardOf(){
+
+    QFETCH(int, shards);
+
+    QStringList addresses;
+    for(int i = 0; i < 10000; i++){
+        addresses.append(QString("%1@hr.nl").arg(1000000 + i * 7));
+    }
+
+    QVector<int> size(shards + 1, 0);
+
+    QBENCHMARK {
+        size.fill(0);
+        foreach(QString address, addresses){
+            size[Shard::of(address, shards)]++;
+        }
+    }
+
+    /* Every address in exactly one shard, and the shards about equal. */
+    int total = 0;
+    for(int i = 1; i <= shards; i++){
+        QVERIFY(qAbs(size[i] - addresses.count() / shards) < addresses.count() / shards / 10);
+        total += size[i];
+    }
+    QCOMPARE(total, addresses.count());
+    QCOMPARE(Shard::of(QString("Student@HR.nl"), shards), Shard::of(QString("student@hr.nl"), shards));
+
+}
+
+void tst_Benchmarks::sqlLoad_data(){
+
+    QTest::addColumn<int>("rows");
+    QTest::addColumn<int>("recipients");
+
+    QTest::newRow("1000 rows") << 1000 << 0;
+    QTest::newRow("100000 rows") << 100000 << 0;
+    QTest::newRow("100000 rows, 100 recipients") << 100000 << 100;
+    QTest::newRow("100000 rows, 1000 recipients") << 100000 << 1000;
+
+}
+
+void tst_Benchmarks::sqlLoad(){
+
+    QFETCH(int, rows);
+    QFETCH(int, recipients);
+
+    /* A table of grades like the generated sheets, with an index on the student. */
+    QString database = m_tmpDir->path() + QString("/grades-%1.sqlite").arg(rows);
+    if(!QFile::exists(database)){
+        QSqlDatabase db = QSqlDatabase::addDatabase(QString("QSQLITE"), QString("benchmark"));
+        db.setDatabaseName(database);
+        QVERIFY(db.open());
+
+        QSqlQuery q(db);
+        QVERIFY(q.exec(QString("CREATE TABLE grades (student TEXT, name TEXT, grade1 REAL, grade2 REAL, final REAL)")));
+        QVERIFY(q.exec(QString("CREATE INDEX grades_student ON grades (student)")));
+        db.transaction();
+        QVERIFY(q.prepare(QString("INSERT INTO grades VALUES (?, ?, ?, ?, ?)")));
+        for(int i = 0; i < rows; i++){
+            q.addBindValue(QString::number(1000000 + i));
+            q.addBindValue(QString("Student %1").arg(i));
+            q.addBindValue((i % 91) / 10.0 + 1);
+            q.addBindValue((i % 83) / 10.0 + 1);
+            q.addBindValue((i % 97) / 10.0 + 1);
+            QVERIFY(q.exec());
+        }
+        db.commit();
+        db.close();
+        db = QSqlDatabase();
+        QSqlDatabase::removeDatabase(QString("benchmark"));
+    }
+
+    QStringList wanted;
+    for(int i = 0; i < recipients; i++){
+        wanted.append(QString::number(1000000 + (i * 97) % rows));
+    }
+
+    SqlSource source;
+    QString error;
+    QVERIFY(source.open(database, &error));
+
+    SheetSnapshot snapshot;
+    QBENCHMARK {
+        QVERIFY(source.load(QString("SELECT * FROM grades;"), &snapshot, &error,
+                            recipients > 0 ? QString("student") : QString(), wanted));
+    }
+
+    /* The header row, and one row per (wanted) student. */
+    QCOMPARE(snapshot.rowCount(), 1 + (recipients > 0 ? recipients : rows));
+    QCOMPARE(snapshot.columnCount(), 5);
+    QCOMPARE(snapshot.cell(1, 1), QByteArray("student"));
+
+}
+
+void tst_Benchmarks::csvLoad_data(){
+
+    QTest::addColumn<int>("rows");
+    QTest::addColumn<int>("threads");
+
+    QTest::newRow("10000 rows") << 10000 << 1;
+    QTest::newRow("1000000 rows") << 1000000 << 1;
+    QTest::newRow("1000000 rows, parallel") << 1000000 << 0;
+
+}
+
+void tst_Benchmarks::csvLoad(){
+
+    QFETCH(int, rows);
+    QFETCH(int, threads);
+
+    /* Grades like the generated sheets, with a quoted field now and then. */
+    QString fileName = m_tmpDir->path() + QString("/grades-%1.csv").arg(rows);
+    if(!QFile::exists(fileName)){
+        QFile f(fileName);
+        QVERIFY(f.open(QIODevice::WriteOnly));
+        f.write("student,name,grade1,grade2,final,remark\r\n");
+        for(int i = 0; i < rows; i++){
+            f.write(QString("%1,Student %2,%3,%4,%5,%6\r\n").arg(1000000 + i).arg(i)
+                    .arg((i % 91) / 10.0 + 1).arg((i % 83) / 10.0 + 1).arg((i % 97) / 10.0 + 1)
+                    .arg(i % 10 == 0 ? QString("\"late, \"\"resit\"\"\"") : QString("ok")).toUtf8());
+        }
+    }
+
+    SheetSnapshot snapshot;
+    QString error;
+
+    QBENCHMARK {
+        QVERIFY(CsvSource::load(fileName, &snapshot, &error, threads == 0 ? QThread::idealThreadCount() : threads));
+    }
+
+    QCOMPARE(snapshot.rowCount(), rows + 1);
+    QCOMPARE(snapshot.columnCount(), 6);
+    QCOMPARE(snapshot.cell(rows + 1, 1), QByteArray::number(1000000 + rows - 1));
+    QCOMPARE(snapshot.cell(2, 6), QByteArray("late, \"resit\""));
+
+}
+
+void tst_Benchmarks::xlsxLoad_data(){
+
+    QTest::addColumn<QString>("reader");
+    QTest::addColumn<int>("threads");
+
+    QTest::newRow("QXlsx::Document") << QString("qxlsx") << 0;
+    QTest::newRow("XlsxSource, 1 thread") << QString("source") << 1;
+    QTest::newRow("XlsxSource, parallel") << QString("source") << 0;
+
+}
+
+void tst_Benchmarks::xlsxLoad(){
+
+    QFETCH(QString, reader);
+    QFETCH(int, threads);
+
+    /* One sheet per class group, with text, numbers and dates. */
+    const int sheets = 30;
+    const int rows = 500;
+    QString fileName = m_tmpDir->path() + QString("/groups.xlsx");
+    if(!QFile::exists(fileName)){
+        QXlsx::Document doc;
+        for(int s = 1; s <= sheets; s++){
+            /* A new document has an empty first sheet already. */
+            if(s == 1){
+                doc.renameSheet(doc.sheetNames().first(), QString("Group 1"));
+            }
+            else{
+                doc.addSheet(QString("Group %1").arg(s));
+            }
+            for(int row = 1; row <= rows; row++){
+                doc.write(row, 1, QString::number(1000000 + s * rows + row));
+                doc.write(row, 2, QString("Student %1").arg(row));
+                doc.write(row, 3, (row * s) % 10 + 0.5);
+                doc.write(row, 4, QDate(2016, 1, 1).addDays(row % 365));
+            }
+        }
+        QVERIFY(doc.saveAs(fileName));
+    }
+
+    QVector<SheetSnapshot> snapshots(sheets);
+
+    QBENCHMARK {
+        if(reader == QString("qxlsx")){
+            QXlsx::Document doc(fileName);
+            for(int s = 0; s < sheets; s++){
+                QXlsx::SheetModel model(dynamic_cast<QXlsx::Worksheet *>(doc.sheet(doc.sheetNames().at(s))));
+                snapshots[s].load(&model);
+            }
+        }
+        else{
+            XlsxSource source(fileName);
+            QString error;
+            QVERIFY(source.open(&error));
+            source.start(threads == 0 ? QThread::idealThreadCount() : threads);
+            for(int s = 0; s < sheets; s++){
+                source.wait(s);
+                snapshots[s] = source.snapshot(s);
+            }
+        }
+    }
+
+    /* The same cells as SheetModel shows. */
+    QXlsx::Document doc(fileName);
+    QXlsx::SheetModel model(dynamic_cast<QXlsx::Worksheet *>(doc.sheet(doc.sheetNames().last())));
+    SheetSnapshot expected(&model);
+    QCOMPARE(snapshots.last().rowCount(), expected.rowCount());
+    QCOMPARE(snapshots.last().columnCount(), expected.columnCount());
+    for(int row = 1; row <= expected.rowCount(); row++){
+        for(int col = 1; col <= expected.columnCount(); col++){
+            QCOMPARE(snapshots.last().cell(row, col), expected.cell(row, col));
+        }
+    }
+
+}
+
+QTEST_MAIN(tst_Benchmarks)
+
+#include "tst_benchmarks.moc"
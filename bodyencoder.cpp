@@ -0,0 +1,244 @@
+#include "bodyencoder.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* RFC 5322 limit, without the CRLF. */
+#define BODYENCODER_MAX_LINE 998
+
+/* Quoted-printable lines: 75 characters and the '=' of a soft break. */
+#define BODYENCODER_QP_LINE  75
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+static inline bool isPrintable(unsigned char c, bool equals){
+
+    return c >= 0x20 && c < 0x7f && !(equals && c == '=');
+
+}
+
+int BodyEncoder::printableRun(const char *in, int n, bool equals){
+
+    int i = 0;
+
+#if defined(__SSE2__)
+    /* Signed compare: bytes >= 0x80 are negative, so below 0x20 as well. */
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i eq = _mm_set1_epi8(equals ? '=' : 0x7f);
+
+    for(; i + 16 <= n; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, del), _mm_cmpeq_epi8(v, eq)));
+        int mask = _mm_movemask_epi8(bad);
+        if(mask != 0){
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    while(i < n && isPrintable(in[i], equals)){
+        i++;
+    }
+
+    return i;
+
+}
+
+BodyEncoder::Encoding BodyEncoder::choose(const char *in, int n, bool eightBitAllowed){
+
+    bool eightBit = false;
+    int line = 0;
+
+    for(int i = 0; i < n; ){
+        int run = printableRun(in + i, n - i, false);
+        i += run;
+        line += run;
+        if(i >= n){
+            break;
+        }
+
+        unsigned char c = in[i];
+        if(c == '\n' || (c == '\r' && i + 1 < n && in[i+1] == '\n')){
+            i += c == '\r' ? 2 : 1;
+            line = 0;
+            continue;
+        }
+
+        if(c >= 0x80){
+            eightBit = true;
+        }
+        else if(c != '\t'){
+            /* Other control characters are not safe as they are. */
+            return QuotedPrintable;
+        }
+
+        line++;
+        i++;
+
+        if(line > BODYENCODER_MAX_LINE){
+            return QuotedPrintable;
+        }
+    }
+
+    if(line > BODYENCODER_MAX_LINE){
+        return QuotedPrintable;
+    }
+    if(!eightBit){
+        return SevenBit;
+    }
+
+    return eightBitAllowed ? EightBit : QuotedPrintable;
+
+}
+
+int BodyEncoder::canonicalSize(const char *in, int n){
+
+    int size = n;
+    for(int i = 0; i < n; i++){
+        if(in[i] == '\n' && (i == 0 || in[i-1] != '\r')){
+            size++;
+        }
+    }
+
+    return size;
+
+}
+
+int BodyEncoder::canonical(const char *in, int n, char *out){
+
+    char *o = out;
+
+    for(int i = 0; i < n; i++){
+        if(in[i] == '\n' && (i == 0 || in[i-1] != '\r')){
+            *o++ = '\r';
+        }
+        *o++ = in[i];
+    }
+
+    return o - out;
+
+}
+
+/* Worst case: every byte escaped, and a soft break every 25 bytes. */
+int BodyEncoder::quotedPrintableSize(int n){
+
+    return 3 * n + 3 * (n / 25 + 1);
+
+}
+
+int BodyEncoder::quotedPrintable(const char *in, int n, char *out){
+
+    char *o = out;
+    int col = 0;
+
+    for(int i = 0; i < n; ){
+        /* Copy the safe run, with soft line breaks. */
+        int run = printableRun(in + i, n - i, true);
+        while(run > 0){
+            if(col >= BODYENCODER_QP_LINE){
+                *o++ = '='; *o++ = '\r'; *o++ = '\n';
+                col = 0;
+            }
+            int take = BODYENCODER_QP_LINE - col < run ? BODYENCODER_QP_LINE - col : run;
+            for(int k = 0; k < take; k++){
+                o[k] = in[i+k];
+            }
+            o += take;
+            col += take;
+            i += take;
+            run -= take;
+        }
+        if(i >= n){
+            break;
+        }
+
+        unsigned char c = in[i];
+
+        /* Hard line break; whitespace before it must be encoded. */
+        if(c == '\n' || (c == '\r' && i + 1 < n && in[i+1] == '\n')){
+            if(col > 0 && (o[-1] == ' ' || o[-1] == '\t')){
+                char ws = o[-1];
+                o--;
+                if(col + 2 > BODYENCODER_QP_LINE){
+                    *o++ = '='; *o++ = '\r'; *o++ = '\n';
+                }
+                *o++ = '=';
+                *o++ = hexDigits[ws >> 4];
+                *o++ = hexDigits[ws & 0x0f];
+            }
+            *o++ = '\r';
+            *o++ = '\n';
+            col = 0;
+            i += c == '\r' ? 2 : 1;
+            continue;
+        }
+
+        /* Tab as is, everything else as =XX. */
+        int width = c == '\t' ? 1 : 3;
+        if(col + width > BODYENCODER_QP_LINE){
+            *o++ = '='; *o++ = '\r'; *o++ = '\n';
+            col = 0;
+        }
+        if(c == '\t'){
+            *o++ = '\t';
+        }
+        else{
+            *o++ = '=';
+            *o++ = hexDigits[c >> 4];
+            *o++ = hexDigits[c & 0x0f];
+        }
+        col += width;
+        i++;
+    }
+
+    /* Whitespace at the very end as well. */
+    if(col > 0 && (o[-1] == ' ' || o[-1] == '\t')){
+        char ws = o[-1];
+        o--;
+        if(col + 2 > BODYENCODER_QP_LINE){
+            *o++ = '='; *o++ = '\r'; *o++ = '\n';
+        }
+        *o++ = '=';
+        *o++ = hexDigits[ws >> 4];
+        *o++ = hexDigits[ws & 0x0f];
+    }
+
+    return o - out;
+
+}
+
+QByteArray BodyEncoder::encode(const QByteArray &body, bool eightBitAllowed, Encoding *encoding){
+
+    QByteArray res;
+
+    *encoding = choose(body.constData(), body.size(), eightBitAllowed);
+
+    if(*encoding == QuotedPrintable){
+        res.resize(quotedPrintableSize(body.size()));
+        res.resize(quotedPrintable(body.constData(), body.size(), res.data()));
+    }
+    else{
+        res.resize(canonicalSize(body.constData(), body.size()));
+        res.resize(canonical(body.constData(), body.size(), res.data()));
+    }
+
+    return res;
+
+}
+
+void BodyEncoder::append(const QByteArray &body, Encoding encoding, QByteArray *out){
+
+    int start = out->size();
+    if(encoding == QuotedPrintable){
+        out->resize(start + quotedPrintableSize(body.size()));
+        out->resize(start + quotedPrintable(body.constData(), body.size(), out->data() + start));
+    }
+    else{
+        out->resize(start + canonicalSize(body.constData(), body.size()));
+        out->resize(start + canonical(body.constData(), body.size(), out->data() + start));
+    }
+
+}
@@ -0,0 +1,44 @@
+#ifndef BODYENCODER_H
+#define BODYENCODER_H
+
+#include <QByteArray>
+
+/*
+ * Transfer encoding of UTF-8 mail bodies.
+ *
+ * The body is scanned in 16 byte chunks (SSE2) for bytes that are not
+ * printable ASCII. Pure ASCII goes as 7bit, UTF-8 as 8bit when the
+ * server has 8BITMIME, and everything else as quoted-printable, made in
+ * one pass. Line endings are always CRLF.
+ */
+class BodyEncoder
+{
+public:
+    enum Encoding {
+        SevenBit,
+        EightBit,
+        QuotedPrintable
+    };
+
+    /* The cheapest encoding that is safe for this body. */
+    static Encoding choose(const char *in, int n, bool eightBitAllowed);
+
+    /* Body with CRLF line endings, for 7bit and 8bit. */
+    static int canonicalSize(const char *in, int n);
+    static int canonical(const char *in, int n, char *out);
+
+    /* Quoted-printable with soft line breaks (max 76 characters). */
+    static int quotedPrintableSize(int n);
+    static int quotedPrintable(const char *in, int n, char *out);
+
+    /* Encode, returning the encoding used. */
+    static QByteArray encode(const QByteArray &body, bool eightBitAllowed, Encoding *encoding);
+
+    /* Encode with an encoding from choose(), onto the end of `out`. */
+    static void append(const QByteArray &body, Encoding encoding, QByteArray *out);
+
+    /* Length of the run of printable ASCII at the start (and no '=' when `equals`). */
+    static int printableRun(const char *in, int n, bool equals);
+};
+
+#endif // BODYENCODER_H
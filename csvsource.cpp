@@ -0,0 +1,393 @@
+#include "csvsource.h"
+
+#include <cstring>
+
+#include <QFile>
+#include <QFileInfo>
+#include <QtAlgorithms>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CSVSOURCE_SSE2
+#endif
+
+/* Bytes of the first line looked at to find the delimiter. */
+#define CSVSOURCE_SNIFF_BYTES 65536
+
+/* The next delimiter or line end from p, or end. */
+static inline const char *findSpecial(const char *p, const char *end, char delimiter){
+
+#ifdef CSVSOURCE_SSE2
+    const __m128i d = _mm_set1_epi8(delimiter);
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+
+    while(end - p >= 16){
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, d), _mm_cmpeq_epi8(v, lf)), _mm_cmpeq_epi8(v, cr));
+        int mask = _mm_movemask_epi8(hit);
+        if(mask != 0){
+            return p + qCountTrailingZeroBits((quint32)mask);
+        }
+        p += 16;
+    }
+#endif
+
+    while(p < end && *p != delimiter && *p != '\n' && *p != '\r'){
+        p++;
+    }
+
+    return p;
+
+}
+
+/* Copy a field with "" for a quote, returns the bytes written. */
+static inline int unescape(const char *p, int size, char *out){
+
+    const char *end = p + size;
+    char *o = out;
+
+    while(p < end){
+        const char *q = (const char *)memchr(p, '"', end - p);
+        if(q == NULL){
+            q = end - 1;
+        }
+        memcpy(o, p, q + 1 - p);
+        o += q + 1 - p;
+        p = q + 2;
+    }
+
+    return o - out;
+
+}
+
+bool CsvSource::handles(const QString &fileName){
+
+    QString suffix = QFileInfo(fileName).suffix().toLower();
+
+    return suffix == QString("csv") || suffix == QString("tsv") || suffix == QString("txt");
+
+}
+
+/* The most common of ',', ';' and tab outside quotes in the first line. */
+char CsvSource::detectDelimiter(const char *data, qint64 size){
+
+    const char *end = data + qMin(size, (qint64)CSVSOURCE_SNIFF_BYTES);
+    int comma = 0, semicolon = 0, tab = 0;
+    bool quoted = false;
+
+    for(const char *p = data; p < end; p++){
+        if(*p == '"'){
+            quoted = !quoted;
+        }
+        else if(quoted){
+            continue;
+        }
+        else if(*p == '\n' || *p == '\r'){
+            break;
+        }
+        else if(*p == ','){
+            comma++;
+        }
+        else if(*p == ';'){
+            semicolon++;
+        }
+        else if(*p == '\t'){
+            tab++;
+        }
+    }
+
+    if(tab > comma && tab >= semicolon){
+        return '\t';
+    }
+    if(semicolon > comma){
+        return ';';
+    }
+
+    return ',';
+
+}
+
+bool CsvSource::load(const QString &fileName, SheetSnapshot *out, QString *error, int threads){
+
+    out->clear();
+
+    QFile f(fileName);
+    if(!f.open(QIODevice::ReadOnly)){
+        *error = QString("Cannot open ") + fileName + QString(": ") + f.errorString();
+        return false;
+    }
+
+    qint64 size = f.size();
+    if(size == 0){
+        return true;
+    }
+
+    if(threads <= 0){
+        threads = size >= CSVSOURCE_PARALLEL_BYTES ? QThread::idealThreadCount() : 1;
+    }
+
+    /* Mapped when possible, read when not (e.g. on some network drives). */
+    QByteArray contents;
+    const char *data = (const char *)f.map(0, size);
+    if(data == NULL){
+        contents = f.readAll();
+        data = contents.constData();
+        size = contents.size();
+    }
+
+    char delimiter = QFileInfo(fileName).suffix().toLower() == QString("tsv") ? '\t' : detectDelimiter(data, size);
+    parse(data, size, delimiter, out, threads);
+
+    if(contents.isEmpty()){
+        f.unmap((uchar *)data);
+    }
+
+    return true;
+
+}
+
+void CsvSource::parse(const char *data, qint64 size, char delimiter, SheetSnapshot *out, int threads){
+
+    /* UTF-8 byte order mark. */
+    if(size >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0){
+        data += 3;
+        size -= 3;
+    }
+
+    const char *end = data + size;
+    int n = qMax(1, (int)qMin((qint64)threads, size / 4096 + 1));
+
+    QVector<Chunk*> chunks;
+    for(int i = 0; i < n; i++){
+        Chunk *c = new Chunk();
+        c->begin = data + (size * i) / n;
+        c->end = data + (size * (i + 1)) / n;
+        c->delimiter = delimiter;
+        chunks.append(c);
+    }
+
+    /*
+     * Move the start of every chunk to the first line end (LF, CRLF or
+     * CR) after it that is not inside quotes: inside quotes means an odd
+     * number of quotes before it.
+     */
+    if(n > 1){
+        runChunks(chunks, Chunk::Count);
+
+        qint64 quotes = 0;
+        for(int i = 1; i < n; i++){
+            quotes += chunks.at(i - 1)->quotes;
+
+            bool quoted = (quotes & 1) != 0;
+            const char *p = chunks.at(i)->begin;
+            while(p < end){
+                char c = *p++;
+                if(c == '"'){
+                    quoted = !quoted;
+                }
+                else if((c == '\n' || c == '\r') && !quoted){
+                    if(c == '\r' && p < end && *p == '\n'){
+                        p++;
+                    }
+                    break;
+                }
+            }
+
+            chunks[i]->begin = qMax(p, chunks.at(i - 1)->begin);
+            chunks[i - 1]->end = chunks.at(i)->begin;
+        }
+        chunks[n - 1]->end = end;
+    }
+
+    runChunks(chunks, Chunk::Parse);
+
+    /* Now the size is known: the snapshot at once, filled in per chunk. */
+    int rows = 0;
+    int columns = 0;
+    int bytes = 0;
+    foreach(Chunk *c, chunks){
+        rows += c->rowEnds.count();
+        columns = qMax(columns, c->columns);
+        bytes += c->bytes;
+    }
+
+    out->reset(columns);
+    out->resizePacked(rows, bytes);
+
+    int cell = 0;
+    int base = 0;
+    foreach(Chunk *c, chunks){
+        c->targetData = out->packedData();
+        c->targetOffsets = out->packedOffsets() + cell;
+        c->targetBase = base;
+        c->targetColumns = columns;
+        cell += c->rowEnds.count() * columns;
+        base += c->bytes;
+    }
+
+    runChunks(chunks, Chunk::Copy);
+
+    qDeleteAll(chunks);
+
+}
+
+void CsvSource::runChunks(const QVector<Chunk*> &chunks, Chunk::Phase phase){
+
+    foreach(Chunk *c, chunks){
+        c->phase = phase;
+    }
+
+    if(chunks.count() == 1){
+        chunks.first()->run();
+        return;
+    }
+
+    foreach(Chunk *c, chunks){
+        c->start();
+    }
+    foreach(Chunk *c, chunks){
+        c->wait();
+    }
+
+}
+
+void CsvSource::countChunk(Chunk *chunk){
+
+    qint64 quotes = 0;
+    const char *p = chunk->begin;
+
+    while((p = (const char *)memchr(p, '"', chunk->end - p)) != NULL){
+        quotes++;
+        p++;
+    }
+
+    chunk->quotes = quotes;
+
+}
+
+/*
+ * Split a chunk into fields. Every field starts right after a delimiter
+ * or a line end; p is always at the start of a field at the top of the
+ * loop.
+ */
+void CsvSource::parseChunk(Chunk *chunk){
+
+    const char *p = chunk->begin;
+    const char *end = chunk->end;
+    char delimiter = chunk->delimiter;
+    int rowStart = 0;
+
+    chunk->columns = 0;
+    chunk->bytes = 0;
+
+    while(p < end){
+        Field f;
+        f.escaped = false;
+
+        if(*p == '"'){
+            /* Quoted: up to the quote that is not followed by another one. */
+            int quotes = 0;
+            f.data = ++p;
+            for(;;){
+                const char *q = (const char *)memchr(p, '"', end - p);
+                if(q == NULL){
+                    p = end;
+                    break;
+                }
+                if(q + 1 < end && q[1] == '"'){
+                    f.escaped = true;
+                    quotes++;
+                    p = q + 2;
+                    continue;
+                }
+                p = q;
+                break;
+            }
+            f.size = p - f.data;
+            chunk->bytes -= quotes;
+
+            /* Anything between the closing quote and the delimiter is dropped. */
+            p = findSpecial(p < end ? p + 1 : p, end, delimiter);
+        }
+        else{
+            f.data = p;
+            p = findSpecial(p, end, delimiter);
+            f.size = p - f.data;
+        }
+        chunk->fields.append(f);
+        chunk->bytes += f.size;
+
+        if(p < end && *p == delimiter){
+            p++;
+            if(p < end){
+                continue;
+            }
+
+            /* A delimiter at the very end: one more, empty field. */
+            f.data = p;
+            f.size = 0;
+            f.escaped = false;
+            chunk->fields.append(f);
+        }
+        else if(p < end){
+            p += (*p == '\r' && p + 1 < end && p[1] == '\n') ? 2 : 1;
+        }
+
+        /* End of a row; an empty line is no row. */
+        int fields = chunk->fields.count() - rowStart;
+        if(fields == 1 && chunk->fields.last().size == 0){
+            chunk->fields.removeLast();
+            continue;
+        }
+        chunk->rowEnds.append(chunk->fields.count());
+        chunk->columns = qMax(chunk->columns, fields);
+        rowStart = chunk->fields.count();
+    }
+
+}
+
+/* The fields of a chunk into its rows of the packed snapshot; short rows get empty cells. */
+void CsvSource::copyChunk(const Chunk *chunk){
+
+    const Field *f = chunk->fields.constData();
+    char *data = chunk->targetData;
+    int *offset = chunk->targetOffsets;
+    int pos = chunk->targetBase;
+    int start = 0;
+
+    foreach(int rowEnd, chunk->rowEnds){
+        int col = 0;
+        for(int i = start; i < rowEnd; i++, f++, col++){
+            *offset++ = pos;
+            if(f->escaped){
+                pos += unescape(f->data, f->size, data + pos);
+            }
+            else{
+                memcpy(data + pos, f->data, f->size);
+                pos += f->size;
+            }
+        }
+        for(; col < chunk->targetColumns; col++){
+            *offset++ = pos;
+        }
+        start = rowEnd;
+    }
+
+}
+
+CsvSource::Chunk::Chunk() :
+    QThread(), phase(Parse), begin(NULL), end(NULL), delimiter(','),
+    quotes(0), columns(0), bytes(0), targetData(NULL), targetOffsets(NULL), targetBase(0), targetColumns(0)
+{
+}
+
+void CsvSource::Chunk::run(){
+
+    switch(phase){
+      case Count: countChunk(this); break;
+      case Parse: parseChunk(this); break;
+      case Copy:  copyChunk(this);  break;
+    }
+
+}
@@ -0,0 +1,104 @@
+#ifndef CSVSOURCE_H
+#define CSVSOURCE_H
+
+#include <QString>
+#include <QVector>
+#include <QThread>
+
+#include "sheetsnapshot.h"
+
+/* Files from this size are split into chunks that are parsed in parallel. */
+#define CSVSOURCE_PARALLEL_BYTES (16 * 1024 * 1024)
+
+/*
+ * Reads a CSV or TSV file into a snapshot, as an alternative to a sheet
+ * of a workbook.
+ *
+ * The file is memory-mapped and never copied as a whole: fields are
+ * located in the mapping and only their bytes are copied into a packed
+ * snapshot, which holds UTF-8 like the file (a BOM is skipped). The
+ * delimiter, quote and line ends are found 16 bytes at a time with SSE2
+ * where available, the closing quote of a quoted field with memchr().
+ *
+ * Quoting follows RFC 4180: a field in double quotes may contain the
+ * delimiter, line ends and "" for a quote. Lines end in LF, CRLF or CR.
+ * Empty lines are skipped, short rows are padded with empty cells.
+ *
+ * A large file is parsed in chunks on several threads. The chunks start
+ * at a line end that is not inside quotes; whether a position is inside
+ * quotes follows from the number of quotes before it, which the threads
+ * count first.
+ */
+class CsvSource
+{
+public:
+    /* Is this a file for CsvSource (.csv, .tsv, .txt)? */
+    static bool handles(const QString &fileName);
+
+    /*
+     * Read `fileName` into `out`. The delimiter is a tab for .tsv, else
+     * the one of ',', ';' and tab that is most common in the first line.
+     * `threads` 0 uses all cores for a large file, 1 reads on this thread.
+     */
+    static bool load(const QString &fileName, SheetSnapshot *out, QString *error, int threads = 0);
+
+    /* The same, for data in memory. */
+    static void parse(const char *data, qint64 size, char delimiter, SheetSnapshot *out, int threads = 1);
+
+    static char detectDelimiter(const char *data, qint64 size);
+
+private:
+    /* A field in the data; `escaped` when it contains "" for a quote. */
+    struct Field {
+        const char *data;
+        int size;
+        bool escaped;
+    };
+
+    /* One chunk of the data, handled on a thread of its own. */
+    class Chunk : public QThread
+    {
+    public:
+        enum Phase {
+            Count,
+            Parse,
+            Copy
+        };
+
+        Chunk();
+
+        Phase phase;
+        const char *begin;
+        const char *end;
+        char delimiter;
+
+        /* Count: the quotes in [begin, end). */
+        qint64 quotes;
+
+        /* Parse: the fields, the field after which every row ends, the widest row and the bytes of the values. */
+        QVector<Field> fields;
+        QVector<int> rowEnds;
+        int columns;
+        int bytes;
+
+        /* Copy: the rows into the packed snapshot, from cell `targetOffsets` and byte `targetBase` on. */
+        char *targetData;
+        int *targetOffsets;
+        int targetBase;
+        int targetColumns;
+
+    protected:
+        void run();
+
+        friend class CsvSource;
+    };
+
+    static void countChunk(Chunk *chunk);
+    static void parseChunk(Chunk *chunk);
+    static void copyChunk(const Chunk *chunk);
+
+    /* Run `phase` on all chunks, in parallel when there are several. */
+    static void runChunks(const QVector<Chunk*> &chunks, Chunk::Phase phase);
+};
+
+#endif // CSVSOURCE_H
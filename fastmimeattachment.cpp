@@ -0,0 +1,60 @@
+#include "fastmimeattachment.h"
+
+#include "base64.h"
+#include "mailwriter.h"
+
+FastMimeAttachment::FastMimeAttachment(QFile *file) :
+    MimeAttachment(file)
+{
+    m_encodedReady = false;
+}
+
+const QByteArray &FastMimeAttachment::encoded(){
+
+    if(!m_encodedReady){
+        if(file->open(QIODevice::ReadOnly)){
+            m_encoded = Base64::encode(file->readAll());
+            file->close();
+        }
+        m_encodedReady = true;
+    }
+
+    return m_encoded;
+
+}
+
+void FastMimeAttachment::write(QByteArray *out){
+
+    QByteArray name = MailWriter::encodeWord(cName);
+
+    out->append("Content-Type: ");
+    out->append(cType.toLatin1());
+    out->append("; name=\"");
+    out->append(name);
+    out->append("\"\r\nContent-Disposition: attachment; filename=\"");
+    out->append(name);
+    out->append("\"\r\nContent-Transfer-Encoding: base64\r\n\r\n");
+
+    /* The encoded lines end with CRLF already. */
+    out->append(encoded());
+    if(m_encoded.isEmpty()){
+        out->append("\r\n");
+    }
+
+}
+
+void FastMimeAttachment::prepare(){
+
+    encoded();
+
+    /* Let MimePart write the headers, without content to encode. */
+    content.clear();
+    MimePart::prepare();
+
+    /* It ends with the CRLF after the content; the encoded lines have their own. */
+    if(!m_encoded.isEmpty()){
+        mimeString.chop(2);
+        mimeString.append(QString::fromLatin1(m_encoded));
+    }
+
+}
@@ -0,0 +1,35 @@
+#ifndef FASTMIMEATTACHMENT_H
+#define FASTMIMEATTACHMENT_H
+
+#include <QFile>
+#include <QByteArray>
+
+#include <mimeattachment.h>
+
+/*
+ * File attachment that is encoded only once.
+ *
+ * MimeAttachment reads and encodes its file every time a message is
+ * serialized, and the global attachments are part of every message.
+ * This one keeps the encoded file and uses the SIMD base64 encoder.
+ */
+class FastMimeAttachment : public MimeAttachment
+{
+public:
+    FastMimeAttachment(QFile *file);
+
+    /* Headers and encoded file onto the end of `out`. */
+    void write(QByteArray *out);
+
+protected:
+    void prepare();
+
+private:
+    /* Read and encode the file, the first time only. */
+    const QByteArray &encoded();
+
+    QByteArray m_encoded;
+    bool m_encodedReady;
+};
+
+#endif // FASTMIMEATTACHMENT_H
@@ -0,0 +1,79 @@
+#include "fastmimetext.h"
+
+FastMimeText::FastMimeText(const QString &text) :
+    MimeText(text)
+{
+    m_eightBitAllowed = false;
+    m_encoding = BodyEncoder::SevenBit;
+    m_hasBody = false;
+}
+
+void FastMimeText::setBody(const QByteArray &utf8){
+
+    m_body = utf8;
+    m_hasBody = true;
+
+}
+
+QByteArray FastMimeText::body() const{
+
+    return m_hasBody ? m_body : text.toUtf8();
+
+}
+
+void FastMimeText::write(QByteArray *out){
+
+    QByteArray utf8 = body();
+    m_encoding = BodyEncoder::choose(utf8.constData(), utf8.size(), m_eightBitAllowed);
+
+    out->append("Content-Type: ");
+    out->append(cType.toLatin1());
+    if(!cCharset.isEmpty()){
+        out->append("; charset=");
+        out->append(cCharset.toLatin1());
+    }
+    out->append("\r\n");
+
+    switch(m_encoding){
+      case BodyEncoder::SevenBit:
+        out->append("Content-Transfer-Encoding: 7bit\r\n\r\n");
+        break;
+      case BodyEncoder::EightBit:
+        out->append("Content-Transfer-Encoding: 8bit\r\n\r\n");
+        break;
+      default:
+        out->append("Content-Transfer-Encoding: quoted-printable\r\n\r\n");
+        break;
+    }
+
+    BodyEncoder::append(utf8, m_encoding, out);
+    out->append("\r\n");
+
+}
+
+void FastMimeText::prepare(){
+
+    QByteArray body = BodyEncoder::encode(this->body(), m_eightBitAllowed, &m_encoding);
+
+    switch(m_encoding){
+      case BodyEncoder::SevenBit:
+        cEncoding = _7Bit;
+        break;
+      case BodyEncoder::EightBit:
+        cEncoding = _8Bit;
+        break;
+      default:
+        cEncoding = MimePart::QuotedPrintable;
+        break;
+    }
+
+    /* Let MimePart write the headers, the body is encoded already. */
+    content.clear();
+    MimePart::prepare();
+
+    /* Replace the CRLF after the empty content by the body. */
+    mimeString.chop(2);
+    mimeString.append(QString::fromUtf8(body));
+    mimeString.append("\r\n");
+
+}
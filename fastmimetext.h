@@ -0,0 +1,43 @@
+#ifndef FASTMIMETEXT_H
+#define FASTMIMETEXT_H
+
+#include <QByteArray>
+
+#include <mimetext.h>
+
+#include "bodyencoder.h"
+
+/*
+ * Text part with the cheapest safe transfer encoding.
+ *
+ * 7bit for ASCII, 8bit for UTF-8 when the server announced 8BITMIME,
+ * quoted-printable otherwise (see BodyEncoder).
+ */
+class FastMimeText : public MimeText
+{
+public:
+    FastMimeText(const QString &text = QString());
+
+    /* Set before sending: does the server accept 8bit bodies? */
+    void setEightBitAllowed(bool allowed) { m_eightBitAllowed = allowed; }
+
+    BodyEncoder::Encoding encoding() const { return m_encoding; }
+
+    /* The text as UTF-8, e.g. rendered by MailTemplate. Used instead of setText(). */
+    void setBody(const QByteArray &utf8);
+    QByteArray body() const;
+
+    /* Headers and encoded body onto the end of `out`, without a QString in between. */
+    void write(QByteArray *out);
+
+protected:
+    void prepare();
+
+private:
+    bool m_eightBitAllowed;
+    BodyEncoder::Encoding m_encoding;
+    QByteArray m_body;
+    bool m_hasBody;
+};
+
+#endif // FASTMIMETEXT_H
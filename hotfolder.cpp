@@ -0,0 +1,276 @@
+#include "hotfolder.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+HotFolder::HotFolder(MailDaemon *daemon, const QString &path, QObject *parent) :
+    QObject(parent), m_daemon(daemon)
+{
+    m_path = QDir(path).absolutePath();
+    m_clock.start();
+
+    m_poll.setInterval(HOTFOLDER_POLL_MS);
+    connect(&m_poll, SIGNAL(timeout()), this, SLOT(scan()));
+    connect(&m_watcher, SIGNAL(directoryChanged(QString)), this, SLOT(scan()));
+    connect(&m_watcher, SIGNAL(fileChanged(QString)), this, SLOT(scan()));
+}
+
+/* Parsers that are still running finish first, the daemon outlives them. */
+HotFolder::~HotFolder(){
+
+    foreach(Pending p, m_pending){
+        if(p.parser != NULL){
+            p.parser->wait();
+            delete p.parser;
+        }
+    }
+
+}
+
+bool HotFolder::start(QString *error){
+
+    if(!QFileInfo(m_path).isDir()){
+        *error = QString("The folder ") + m_path + QString(" does not exist.");
+        return false;
+    }
+
+    if(!m_watcher.addPath(m_path)){
+        *error = QString("Cannot watch the folder ") + m_path + QString(".");
+        return false;
+    }
+
+    /* What was dropped while the daemon was not running. */
+    scan();
+
+    return true;
+
+}
+
+/*
+ * Look at all job files: new or changed ones wait until they are stable,
+ * then their sheet is parsed. Runs on every change in the folder or of a
+ * watched file, and every HOTFOLDER_POLL_MS while files are pending.
+ */
+void HotFolder::scan(){
+
+    QDir dir(m_path);
+    QStringList seen;
+
+    foreach(QString name, dir.entryList(QStringList() << QString("*.json"), QDir::Files)){
+        QString jobFile = dir.absoluteFilePath(name);
+        QVariantMap job;
+        QString signature;
+        QString error;
+        bool complete = readJob(jobFile, &job, &signature, &error);
+        seen.append(jobFile);
+
+        /* Queued (or refused) before, and nothing changed since. */
+        if(marker(jobFile + QString(".queued")) == signature || marker(jobFile + QString(".error")) == signature){
+            m_pending.remove(jobFile);
+            continue;
+        }
+
+        /* Changes of the workbook in place are only seen by watching the file. */
+        QString workbook = job.value(QString("workbook")).toString();
+        if(!workbook.isEmpty() && QFileInfo(workbook).isFile() && !m_watcher.files().contains(workbook)){
+            m_watcher.addPath(workbook);
+        }
+
+        QHash<QString, Pending>::iterator it = m_pending.find(jobFile);
+        if(it == m_pending.end()){
+            Pending p;
+            p.signature = signature;
+            p.dropped = QDateTime::currentDateTime();
+            p.changed = m_clock.elapsed();
+            p.parser = NULL;
+            m_pending.insert(jobFile, p);
+            continue;
+        }
+
+        Pending &p = it.value();
+        if(p.parser != NULL){
+            continue;
+        }
+        if(p.signature != signature){
+            p.signature = signature;
+            p.changed = m_clock.elapsed();
+            continue;
+        }
+        if(m_clock.elapsed() - p.changed < HOTFOLDER_STABLE_MS){
+            continue;
+        }
+
+        /* Stable, but not a job: refused until one of the files changes. */
+        if(!complete){
+            writeMarker(jobFile + QString(".error"), signature, error);
+            m_pending.erase(it);
+            continue;
+        }
+
+        /* Still open for writing elsewhere (e.g. locked on Windows)? */
+        QFile f(workbook);
+        if(!f.open(QIODevice::ReadOnly)){
+            continue;
+        }
+        f.close();
+
+        p.parser = new Parser(m_daemon, jobFile, job);
+        connect(p.parser, SIGNAL(finished()), this, SLOT(parsed()));
+        p.parser->start();
+    }
+
+    /* Job files that were removed before they were queued. */
+    foreach(QString jobFile, m_pending.keys()){
+        if(!seen.contains(jobFile) && m_pending.value(jobFile).parser == NULL){
+            m_pending.remove(jobFile);
+        }
+    }
+
+    if(m_pending.isEmpty()){
+        m_poll.stop();
+    }
+    else if(!m_poll.isActive()){
+        m_poll.start();
+    }
+
+}
+
+/* The sheet of a job is in the cache: queue the job. */
+void HotFolder::parsed(){
+
+    Parser *parser = static_cast<Parser*>(sender());
+    QHash<QString, Pending>::iterator it = m_pending.find(parser->jobFile);
+    if(it == m_pending.end()){
+        parser->deleteLater();
+        return;
+    }
+
+    /* The files changed while parsing: wait until they are stable again. */
+    QVariantMap job;
+    QString signature;
+    QString error;
+    readJob(parser->jobFile, &job, &signature, &error);
+    it.value().parser = NULL;
+    parser->deleteLater();
+
+    if(signature != it.value().signature){
+        it.value().signature = signature;
+        it.value().changed = m_clock.elapsed();
+    }
+    else if(!parser->error.isEmpty()){
+        writeMarker(parser->jobFile + QString(".error"), signature, parser->error);
+        m_pending.erase(it);
+    }
+    else{
+        int id = m_daemon->submit(parser->job, it.value().dropped);
+        writeMarker(parser->jobFile + QString(".queued"), signature, QString("job ") + QString::number(id));
+        m_pending.erase(it);
+    }
+
+}
+
+/*
+ * Read a job file. The signature is the size and date of the job file,
+ * the workbook and the template file, as far as they exist.
+ */
+bool HotFolder::readJob(const QString &jobFile, QVariantMap *job, QString *signature, QString *error) const{
+
+    QDir dir(m_path);
+    QFileInfo jobInfo(jobFile);
+    QStringList files;
+    files.append(jobFile);
+
+    QFile f(jobFile);
+    QJsonParseError parseError;
+    QJsonDocument doc = f.open(QIODevice::ReadOnly) ? QJsonDocument::fromJson(f.readAll(), &parseError) : QJsonDocument();
+    bool ok = doc.isObject();
+    if(!ok){
+        *error = QString("Not a JSON object: ") + parseError.errorString();
+    }
+    *job = doc.object().toVariantMap();
+
+    /* The workbook with the same name, unless the job says otherwise. */
+    QString workbook = job->value(QString("workbook")).toString();
+    if(workbook.isEmpty()){
+        workbook = jobInfo.completeBaseName() + QString(".xlsx");
+        foreach(QString suffix, QStringList() << QString(".csv") << QString(".tsv")){
+            if(!dir.exists(workbook) && dir.exists(jobInfo.completeBaseName() + suffix)){
+                workbook = jobInfo.completeBaseName() + suffix;
+            }
+        }
+    }
+    workbook = QFileInfo(dir, workbook).absoluteFilePath();
+    job->insert(QString("workbook"), workbook);
+    files.append(workbook);
+    if(ok && !QFileInfo(workbook).isFile()){
+        ok = false;
+        *error = QString("The workbook ") + workbook + QString(" does not exist.");
+    }
+
+    QString templateFile = job->value(QString("templateFile")).toString();
+    if(!templateFile.isEmpty()){
+        templateFile = QFileInfo(dir, templateFile).absoluteFilePath();
+        files.append(templateFile);
+
+        QFile t(templateFile);
+        if(t.open(QIODevice::ReadOnly)){
+            job->insert(QString("template"), QString::fromUtf8(t.readAll()));
+        }
+        else if(ok){
+            ok = false;
+            *error = QString("Cannot read the template ") + templateFile + QString(".");
+        }
+    }
+
+    if(ok && job->value(QString("template")).toString().isEmpty()){
+        ok = false;
+        *error = QString("The job has no template.");
+    }
+
+    signature->clear();
+    foreach(QString file, files){
+        QFileInfo fi(file);
+        *signature += QString::number(fi.exists() ? fi.size() : -1) + QString("@") +
+                      QString::number(fi.exists() ? fi.lastModified().toMSecsSinceEpoch() : 0) + QString(";");
+    }
+
+    return ok;
+
+}
+
+/* The signature in a marker file, empty when there is none. */
+QString HotFolder::marker(const QString &fileName){
+
+    QFile f(fileName);
+    if(!f.open(QIODevice::ReadOnly)){
+        return QString();
+    }
+
+    return QString::fromUtf8(f.readLine()).trimmed();
+
+}
+
+void HotFolder::writeMarker(const QString &fileName, const QString &signature, const QString &text){
+
+    QFile f(fileName);
+    if(f.open(QIODevice::WriteOnly | QIODevice::Truncate)){
+        QTextStream out(&f);
+        out << signature << "\n" << text << "\n";
+    }
+
+}
+
+HotFolder::Parser::Parser(MailDaemon *daemon, const QString &jobFile, const QVariantMap &job) :
+    QThread(), jobFile(jobFile), job(job), m_daemon(daemon)
+{
+}
+
+void HotFolder::Parser::run(){
+
+    m_daemon->sheet(job.value(QString("workbook")).toString(), job.value(QString("sheet")).toString(), &error);
+
+}
@@ -0,0 +1,93 @@
+#ifndef HOTFOLDER_H
+#define HOTFOLDER_H
+
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+#include <QHash>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QVariantMap>
+#include <QFileSystemWatcher>
+
+#include "maildaemon.h"
+
+/* How often files that are still being written are looked at. */
+#define HOTFOLDER_POLL_MS   1000
+
+/* A file is complete when its size and date did not change this long. */
+#define HOTFOLDER_STABLE_MS 3000
+
+/*
+ * Watches a folder for workbooks to send (studentmailer --daemon --watch).
+ *
+ * A batch is dropped as a workbook with a job file next to it, e.g.
+ * grades.xlsx (or .csv, .tsv) and grades.json. The job file is a job as
+ * submitted to the daemon (see MailJob); "workbook" defaults to the file
+ * with the same name and may be relative to the folder, the template may be
+ * given as a file with "templateFile".
+ *
+ * When the files did not change for HOTFOLDER_STABLE_MS, the sheet is
+ * parsed on a thread of its own into the cache of the daemon and the
+ * job is queued. grades.json.queued records the job and the files it
+ * was made from; the batch is queued again when the workbook, the job
+ * file or the template changes. A job that cannot be read or parsed
+ * gets grades.json.error instead.
+ *
+ * The time the files were first noticed goes with the job, so the
+ * daemon reports the latency from the drop to the first mail.
+ */
+class HotFolder : public QObject
+{
+    Q_OBJECT
+
+public:
+    HotFolder(MailDaemon *daemon, const QString &path, QObject *parent = 0);
+    ~HotFolder();
+
+    bool start(QString *error);
+
+private slots:
+    void scan();
+    void parsed();
+
+private:
+    /* Parses the sheet of a job into the cache of the daemon. */
+    class Parser : public QThread
+    {
+    public:
+        Parser(MailDaemon *daemon, const QString &jobFile, const QVariantMap &job);
+
+        QString jobFile;
+        QVariantMap job;
+        QString error;
+
+    protected:
+        void run();
+
+    private:
+        MailDaemon *m_daemon;
+    };
+
+    struct Pending {
+        QString signature;
+        QDateTime dropped;
+        qint64 changed;
+        Parser *parser;
+    };
+
+    /* The job of a job file, with absolute paths; false while incomplete. */
+    bool readJob(const QString &jobFile, QVariantMap *job, QString *signature, QString *error) const;
+
+    static QString marker(const QString &fileName);
+    static void writeMarker(const QString &fileName, const QString &signature, const QString &text);
+
+    MailDaemon *m_daemon;
+    QString m_path;
+    QFileSystemWatcher m_watcher;
+    QTimer m_poll;
+    QElapsedTimer m_clock;
+    QHash<QString, Pending> m_pending;
+};
+
+#endif // HOTFOLDER_H
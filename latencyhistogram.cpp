@@ -0,0 +1,121 @@
+#include "latencyhistogram.h"
+
+#include <QtMath>
+
+/* 4 buckets per power of two, up to 2^32 us (over an hour). */
+#define HISTOGRAM_SUBBUCKETS 4
+#define HISTOGRAM_BUCKETS    (32 * HISTOGRAM_SUBBUCKETS)
+
+LatencyHistogram::LatencyHistogram() :
+    m_buckets(HISTOGRAM_BUCKETS, 0)
+{
+    clear();
+}
+
+void LatencyHistogram::clear(){
+
+    m_buckets.fill(0);
+    m_count = 0;
+    m_sum = 0;
+    m_min = 0;
+    m_max = 0;
+
+}
+
+int LatencyHistogram::bucketOf(qint64 usecs){
+
+    if(usecs < 1){
+        return 0;
+    }
+
+    int b = (int)(HISTOGRAM_SUBBUCKETS * log2((double)usecs));
+
+    return qBound(0, b, HISTOGRAM_BUCKETS - 1);
+
+}
+
+qint64 LatencyHistogram::bucketLimit(int bucket){
+
+    return (qint64)ceil(pow(2.0, (double)(bucket + 1) / HISTOGRAM_SUBBUCKETS));
+
+}
+
+void LatencyHistogram::add(qint64 usecs){
+
+    if(m_count == 0 || usecs < m_min){
+        m_min = usecs;
+    }
+    if(m_count == 0 || usecs > m_max){
+        m_max = usecs;
+    }
+
+    m_buckets[bucketOf(usecs)]++;
+    m_count++;
+    m_sum += usecs;
+
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other){
+
+    if(other.m_count == 0){
+        return;
+    }
+
+    if(m_count == 0 || other.m_min < m_min){
+        m_min = other.m_min;
+    }
+    if(m_count == 0 || other.m_max > m_max){
+        m_max = other.m_max;
+    }
+
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++){
+        m_buckets[i] += other.m_buckets[i];
+    }
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+
+}
+
+double LatencyHistogram::mean() const{
+
+    return m_count > 0 ? (double)m_sum / m_count : 0.0;
+
+}
+
+qint64 LatencyHistogram::percentile(double p) const{
+
+    if(m_count == 0){
+        return 0;
+    }
+
+    /* Rank of the sample we are looking for. */
+    qint64 rank = (qint64)ceil(p / 100.0 * m_count);
+    if(rank < 1){
+        rank = 1;
+    }
+
+    qint64 seen = 0;
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++){
+        seen += m_buckets[i];
+        if(seen >= rank){
+            /* Never report more than the real maximum. */
+            return qMin(bucketLimit(i), m_max);
+        }
+    }
+
+    return m_max;
+
+}
+
+QString LatencyHistogram::summary() const{
+
+    return QString("%1 %2 %3 %4 %5 %6 %7")
+               .arg(m_count, 7)
+               .arg(m_min / 1000.0, 9, 'f', 2)
+               .arg(mean() / 1000.0, 9, 'f', 2)
+               .arg(percentile(50) / 1000.0, 9, 'f', 2)
+               .arg(percentile(90) / 1000.0, 9, 'f', 2)
+               .arg(percentile(99) / 1000.0, 9, 'f', 2)
+               .arg(m_max / 1000.0, 9, 'f', 2);
+
+}
@@ -0,0 +1,45 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <QString>
+#include <QVector>
+
+/*
+ * Log-scale latency histogram.
+ *
+ * Values are in microseconds. Every power of two is split into four
+ * buckets, so percentiles are exact within ~19%. Min, max and mean are
+ * exact.
+ */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void add(qint64 usecs);
+    void merge(const LatencyHistogram &other);
+    void clear();
+
+    int count() const { return m_count; }
+    qint64 min() const { return m_min; }
+    qint64 max() const { return m_max; }
+    double mean() const;
+
+    /* Upper bound of the bucket containing percentile p (0-100). */
+    qint64 percentile(double p) const;
+
+    /* One line: count, min, mean, p50, p90, p99, max in ms. */
+    QString summary() const;
+
+private:
+    static int bucketOf(qint64 usecs);
+    static qint64 bucketLimit(int bucket);
+
+    QVector<int> m_buckets;
+    int m_count;
+    qint64 m_sum;
+    qint64 m_min;
+    qint64 m_max;
+};
+
+#endif // LATENCYHISTOGRAM_H
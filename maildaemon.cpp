@@ -0,0 +1,397 @@
+#include "maildaemon.h"
+#include "maildaemonworker.h"
+
+#include <QCoreApplication>
+#include <QLocalSocket>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QFileInfo>
+#include <QSettings>
+
+#include "csvsource.h"
+#include "xlsxsource.h"
+#include "sendhistory.h"
+
+/* How long a client waits for the daemon. */
+#define MAILDAEMON_CLIENT_TIMEOUT_MS 5000
+
+MailDaemon::MailDaemon(int workers, QObject *parent) :
+    QObject(parent)
+{
+    m_nextId = 1;
+    m_stopping = false;
+
+    /* The settings of the application; the login only from the environment. */
+    QSettings s;
+    m_defaults.insert(QString("senderName"), s.value(QString("senderName")));
+    m_defaults.insert(QString("senderEmail"), s.value(QString("senderEmail")));
+    m_defaults.insert(QString("emailAppend"), s.value(QString("emailAppend")));
+    m_defaults.insert(QString("relays"), s.value(QString("SMTPserver")).toString() + QString(" ") + s.value(QString("SMTPrelays")).toString());
+    m_defaults.insert(QString("smtpPort"), s.value(QString("SMTPport"), 465));
+    m_defaults.insert(QString("smtpType"), s.value(QString("SMTPtype"), QString("SSL")));
+    m_defaults.insert(QString("maxMessages"), s.value(QString("SMTPmaxMessages"), 0));
+    m_defaults.insert(QString("maxKBytes"), s.value(QString("SMTPmaxKBytes"), 0));
+    m_defaults.insert(QString("user"), QString::fromLocal8Bit(qgetenv("STUDENTMAILER_SMTP_USER")));
+    m_defaults.insert(QString("password"), QString::fromLocal8Bit(qgetenv("STUDENTMAILER_SMTP_PASSWORD")));
+
+    connect(&m_server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+
+    for(int i = 0; i < qMax(1, workers); i++){
+        MailDaemonWorker *w = new MailDaemonWorker(this);
+        m_workers.append(w);
+        w->start();
+    }
+}
+
+/* Running jobs stop after their current mail. */
+MailDaemon::~MailDaemon(){
+
+    {
+        QMutexLocker lock(&m_mutex);
+        m_stopping = true;
+        foreach(MailJob *job, m_jobs){
+            job->cancel();
+        }
+        m_wake.wakeAll();
+    }
+
+    foreach(MailDaemonWorker *w, m_workers){
+        w->wait();
+        delete w;
+    }
+
+    qDeleteAll(m_jobs);
+
+}
+
+QString MailDaemon::defaultName(){
+
+    QString user = QString::fromLocal8Bit(qgetenv("USER"));
+    if(user.isEmpty()){
+        user = QString::fromLocal8Bit(qgetenv("USERNAME"));
+    }
+
+    return QCoreApplication::applicationName().toLower() + QString("-") + user;
+
+}
+
+bool MailDaemon::listen(const QString &name){
+
+    /* A socket left by a daemon that crashed is removed, a running daemon is not. */
+    QLocalSocket probe;
+    probe.connectToServer(name);
+    if(probe.waitForConnected(MAILDAEMON_CLIENT_TIMEOUT_MS / 10)){
+        return false;
+    }
+    QLocalServer::removeServer(name);
+
+    m_server.setSocketOptions(QLocalServer::UserAccessOption);
+
+    return m_server.listen(name);
+
+}
+
+void MailDaemon::newConnection(){
+
+    while(QLocalSocket *client = m_server.nextPendingConnection()){
+        connect(client, SIGNAL(readyRead()), this, SLOT(readClient()));
+        connect(client, SIGNAL(disconnected()), client, SLOT(deleteLater()));
+    }
+
+}
+
+void MailDaemon::readClient(){
+
+    QLocalSocket *client = qobject_cast<QLocalSocket*>(sender());
+    if(client == NULL){
+        return;
+    }
+
+    while(client->canReadLine()){
+        QJsonParseError error;
+        QJsonDocument doc = QJsonDocument::fromJson(client->readLine(), &error);
+
+        QVariantMap reply;
+        if(error.error != QJsonParseError::NoError || !doc.isObject()){
+            reply.insert(QString("ok"), false);
+            reply.insert(QString("error"), QString("Invalid request: ") + error.errorString());
+        }
+        else{
+            reply = handle(doc.object().toVariantMap());
+        }
+
+        client->write(QJsonDocument(QJsonObject::fromVariantMap(reply)).toJson(QJsonDocument::Compact));
+        client->write("\n");
+    }
+
+}
+
+QVariantMap MailDaemon::handle(const QVariantMap &request){
+
+    QVariantMap reply;
+    QString cmd = request.value(QString("cmd")).toString();
+    bool ok = true;
+
+    if(cmd == QString("submit")){
+        QVariantMap batch = request.value(QString("job")).toMap();
+        if(batch.value(QString("workbook")).toString().isEmpty() || batch.value(QString("template")).toString().isEmpty()){
+            ok = false;
+            reply.insert(QString("error"), QString("A job needs at least a workbook and a template."));
+        }
+        else{
+            reply.insert(QString("id"), submit(batch));
+        }
+    }
+    else if(cmd == QString("status")){
+        if(request.contains(QString("id"))){
+            QVariantMap job = status(request.value(QString("id")).toInt());
+            ok = !job.isEmpty();
+            reply.insert(ok ? QString("job") : QString("error"), ok ? QVariant(job) : QVariant(QString("No such job.")));
+        }
+        else{
+            reply.insert(QString("jobs"), status());
+
+            LatencyHistogram drop = dropLatency();
+            if(drop.count() > 0){
+                reply.insert(QString("dropToFirstMail"), drop.summary());
+            }
+        }
+    }
+    else if(cmd == QString("cancel")){
+        ok = cancel(request.value(QString("id")).toInt());
+        if(!ok){
+            reply.insert(QString("error"), QString("No such job, or already finished."));
+        }
+    }
+    else{
+        ok = false;
+        reply.insert(QString("error"), QString("Unknown command \"") + cmd + QString("\"."));
+    }
+
+    reply.insert(QString("ok"), ok);
+
+    return reply;
+
+}
+
+int MailDaemon::submit(const QVariantMap &batch, const QDateTime &dropped){
+
+    QMutexLocker lock(&m_mutex);
+
+    /* Forget the oldest finished jobs. */
+    QList<int> finished;
+    foreach(MailJob *job, m_jobs){
+        if(job->isFinished()){
+            finished.append(job->id());
+        }
+    }
+    for(int i = 0; i < finished.count() - MAILDAEMON_KEEP_JOBS; i++){
+        delete m_jobs.take(finished.at(i));
+    }
+
+    MailJob *job = new MailJob(m_nextId++, batch);
+    if(dropped.isValid()){
+        job->setDropped(dropped);
+    }
+    m_jobs.insert(job->id(), job);
+    m_queue.append(job);
+    m_wake.wakeOne();
+
+    return job->id();
+
+}
+
+bool MailDaemon::cancel(int id){
+
+    QMutexLocker lock(&m_mutex);
+
+    MailJob *job = m_jobs.value(id);
+    if(job == NULL || job->isFinished()){
+        return false;
+    }
+
+    /* A queued job never starts, a running one stops after its current mail. */
+    if(m_queue.removeOne(job)){
+        job->finish(MailJob::Cancelled);
+    }
+    job->cancel();
+
+    return true;
+
+}
+
+QVariantMap MailDaemon::status(int id) const{
+
+    QMutexLocker lock(&m_mutex);
+
+    MailJob *job = m_jobs.value(id);
+
+    return job != NULL ? job->status() : QVariantMap();
+
+}
+
+QVariantList MailDaemon::status() const{
+
+    QMutexLocker lock(&m_mutex);
+
+    QVariantList res;
+    foreach(MailJob *job, m_jobs){
+        res.append(job->status());
+    }
+
+    return res;
+
+}
+
+LatencyHistogram MailDaemon::dropLatency() const{
+
+    QMutexLocker lock(&m_mutex);
+
+    LatencyHistogram h;
+    foreach(MailJob *job, m_jobs){
+        qint64 ms = job->dropToFirstMail();
+        if(ms >= 0){
+            h.add(ms * 1000);
+        }
+    }
+
+    return h;
+
+}
+
+MailJob *MailDaemon::take(){
+
+    QMutexLocker lock(&m_mutex);
+
+    while(m_queue.isEmpty() && !m_stopping){
+        m_wake.wait(&m_mutex);
+    }
+
+    if(m_stopping){
+        return NULL;
+    }
+
+    return m_queue.takeFirst();
+
+}
+
+QSharedPointer<const SheetSnapshot> MailDaemon::sheet(const QString &workbook, const QString &sheetName, QString *error){
+
+    QFileInfo fi(workbook);
+    if(!fi.isFile()){
+        *error = QString("The workbook ") + workbook + QString(" does not exist.");
+        return QSharedPointer<const SheetSnapshot>();
+    }
+
+    QString key = fi.absoluteFilePath() + QString("\n") + sheetName;
+    {
+        QMutexLocker lock(&m_cacheMutex);
+        QHash<QString, CachedSheet>::iterator it = m_sheets.find(key);
+        if(it != m_sheets.end() && it.value().modified == fi.lastModified()){
+            it.value().used = QDateTime::currentDateTime();
+            return it.value().snapshot;
+        }
+    }
+
+    /* Parsed without the lock, so the other workers keep going. */
+    CachedSheet cached;
+    cached.modified = fi.lastModified();
+    cached.used = QDateTime::currentDateTime();
+
+    if(CsvSource::handles(workbook)){
+        SheetSnapshot *snapshot = new SheetSnapshot();
+        if(!CsvSource::load(fi.absoluteFilePath(), snapshot, error)){
+            delete snapshot;
+            return QSharedPointer<const SheetSnapshot>();
+        }
+        cached.snapshot = QSharedPointer<const SheetSnapshot>(snapshot);
+    }
+    else{
+        /* Only the sheet of the job is parsed, not the whole workbook. */
+        SheetSnapshot *snapshot = new SheetSnapshot();
+        if(!XlsxSource::load(fi.absoluteFilePath(), sheetName, snapshot, error)){
+            delete snapshot;
+            return QSharedPointer<const SheetSnapshot>();
+        }
+        cached.snapshot = QSharedPointer<const SheetSnapshot>(snapshot);
+    }
+
+    QMutexLocker lock(&m_cacheMutex);
+
+    /* Make room: the sheet that was not used for the longest time goes. */
+    if(!m_sheets.contains(key) && m_sheets.count() >= MAILDAEMON_CACHE_SHEETS){
+        QHash<QString, CachedSheet>::iterator oldest = m_sheets.begin();
+        for(QHash<QString, CachedSheet>::iterator it = m_sheets.begin(); it != m_sheets.end(); ++it){
+            if(it.value().used < oldest.value().used){
+                oldest = it;
+            }
+        }
+        m_sheets.erase(oldest);
+    }
+    m_sheets.insert(key, cached);
+
+    return cached.snapshot;
+
+}
+
+QSharedPointer<const MailTemplate> MailDaemon::mailTemplate(const QString &text){
+
+    QMutexLocker lock(&m_cacheMutex);
+
+    QSharedPointer<const MailTemplate> t = m_templates.value(text);
+    if(t.isNull()){
+        MailTemplate *compiled = new MailTemplate();
+        compiled->compile(text);
+        t = QSharedPointer<const MailTemplate>(compiled);
+
+        if(m_templates.count() >= MAILDAEMON_CACHE_TEMPLATES){
+            m_templates.clear();
+        }
+        m_templates.insert(text, t);
+    }
+
+    return t;
+
+}
+
+bool MailDaemon::request(const QString &name, const QVariantMap &request, QVariantMap *reply, QString *error){
+
+    QLocalSocket socket;
+    socket.connectToServer(name);
+    if(!socket.waitForConnected(MAILDAEMON_CLIENT_TIMEOUT_MS)){
+        *error = QString("No daemon at ") + name + QString(": ") + socket.errorString();
+        return false;
+    }
+
+    socket.write(QJsonDocument(QJsonObject::fromVariantMap(request)).toJson(QJsonDocument::Compact));
+    socket.write("\n");
+
+    while(!socket.canReadLine()){
+        if(!socket.waitForReadyRead(MAILDAEMON_CLIENT_TIMEOUT_MS)){
+            *error = QString("No reply from the daemon: ") + socket.errorString();
+            return false;
+        }
+    }
+
+    *reply = QJsonDocument::fromJson(socket.readLine()).object().toVariantMap();
+
+    return true;
+
+}
+
+void MailDaemon::recordDelivered(const QString &courseCode, const QString &subject, const QHash<QString, QByteArray> &delivered){
+
+    if(delivered.isEmpty()){
+        return;
+    }
+
+    QMutexLocker lock(&m_historyMutex);
+
+    SendHistory history;
+    history.load(courseCode, subject);
+    for(QHash<QString, QByteArray>::const_iterator it = delivered.constBegin(); it != delivered.constEnd(); ++it){
+        history.insert(it.key(), it.value());
+    }
+    history.save();
+
+}
@@ -0,0 +1,127 @@
+#ifndef MAILDAEMON_H
+#define MAILDAEMON_H
+
+#include <QObject>
+#include <QLocalServer>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QHash>
+#include <QMap>
+#include <QList>
+#include <QDateTime>
+#include <QSharedPointer>
+#include <QVariantMap>
+
+#include "mailjob.h"
+#include "mailtemplate.h"
+#include "sheetsnapshot.h"
+#include "latencyhistogram.h"
+
+/* Jobs that run at the same time, each with its own SMTP sessions. */
+#define MAILDAEMON_WORKERS        2
+
+/* Finished jobs whose status is kept for the clients. */
+#define MAILDAEMON_KEEP_JOBS      100
+
+/* Parsed sheets and compiled templates that are kept. */
+#define MAILDAEMON_CACHE_SHEETS   16
+#define MAILDAEMON_CACHE_TEMPLATES 64
+
+class MailDaemonWorker;
+
+/*
+ * The mail merge as a long-running process (studentmailer --daemon).
+ *
+ * Clients connect to a QLocalServer, only accessible by the same user,
+ * and send one JSON object per line; every request gets one JSON line
+ * back:
+ *
+ *   {"cmd":"submit","job":{...}}   {"ok":true,"id":1}
+ *   {"cmd":"status"}               {"ok":true,"jobs":[{...}, ...],"dropToFirstMail":"..."}
+ *   {"cmd":"status","id":1}        {"ok":true,"job":{...}}
+ *   {"cmd":"cancel","id":1}        {"ok":true}
+ *
+ * A job is a batch record like the ones in the outbox journals, see
+ * MailJob. Jobs are queued and run by MAILDAEMON_WORKERS workers at
+ * the same time. The parsed sheets and compiled templates are cached
+ * here and shared read-only by the workers; every worker keeps its
+ * SMTP sessions logged in between jobs.
+ */
+class MailDaemon : public QObject
+{
+    Q_OBJECT
+
+public:
+    MailDaemon(int workers = MAILDAEMON_WORKERS, QObject *parent = 0);
+    ~MailDaemon();
+
+    bool listen(const QString &name);
+    QString errorString() const { return m_server.errorString(); }
+
+    /* Queue a job, returns its id; `dropped` for a job from a hot folder. */
+    int submit(const QVariantMap &batch, const QDateTime &dropped = QDateTime());
+    bool cancel(int id);
+    QVariantMap status(int id) const;
+    QVariantList status() const;
+
+    /* Drop to first mail of the jobs from hot folders, see HotFolder. */
+    LatencyHistogram dropLatency() const;
+
+    /*
+     * For the workers: the next job, waiting until there is one; NULL
+     * when the daemon stops.
+     */
+    MailJob *take();
+
+    /* The values of a sheet, parsed again only when the file changed. */
+    QSharedPointer<const SheetSnapshot> sheet(const QString &workbook, const QString &sheetName, QString *error);
+
+    /* A compiled template, compiled once for every text. */
+    QSharedPointer<const MailTemplate> mailTemplate(const QString &text);
+
+    /* Remember the mails a job delivered, for the "changed only" selection of the window. */
+    void recordDelivered(const QString &courseCode, const QString &subject, const QHash<QString, QByteArray> &delivered);
+
+    /* Sender and SMTP settings of the application, the defaults of a job. */
+    QVariantMap defaults() const { return m_defaults; }
+
+    /* The socket name when none is given. */
+    static QString defaultName();
+
+    /* Client side: send one request and wait for the reply. */
+    static bool request(const QString &name, const QVariantMap &request, QVariantMap *reply, QString *error);
+
+private slots:
+    void newConnection();
+    void readClient();
+
+private:
+    QVariantMap handle(const QVariantMap &request);
+
+    QLocalServer m_server;
+    QList<MailDaemonWorker*> m_workers;
+    QVariantMap m_defaults;
+
+    /* Queue and jobs, shared with the workers. */
+    mutable QMutex m_mutex;
+    QWaitCondition m_wake;
+    QList<MailJob*> m_queue;
+    QMap<int, MailJob*> m_jobs;
+    int m_nextId;
+    bool m_stopping;
+
+    /* Caches, shared with the workers. */
+    struct CachedSheet {
+        QDateTime modified;
+        QDateTime used;
+        QSharedPointer<const SheetSnapshot> snapshot;
+    };
+    QMutex m_cacheMutex;
+    QHash<QString, CachedSheet> m_sheets;
+    QHash<QString, QSharedPointer<const MailTemplate> > m_templates;
+
+    /* Jobs of the same course and subject would drop each other's mails from the history. */
+    QMutex m_historyMutex;
+};
+
+#endif // MAILDAEMON_H
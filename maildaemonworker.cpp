@@ -0,0 +1,424 @@
+#include "maildaemonworker.h"
+#include "maildaemon.h"
+#include "mailtemplate.h"
+#include "mailwriter.h"
+#include "mimearena.h"
+#include "fastmimetext.h"
+#include "fastmimeattachment.h"
+#include "outboxjournal.h"
+#include "reportwriter.h"
+#include "ratelimiter.h"
+#include "sendhistory.h"
+#include "shard.h"
+#include "sqlsource.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QVector>
+#include <QRegExp>
+#include <QMultiMap>
+#include <QDateTime>
+#include <QElapsedTimer>
+
+MailDaemonWorker::MailDaemonWorker(MailDaemon *daemon) :
+    QThread(), m_daemon(daemon)
+{
+}
+
+void MailDaemonWorker::run(){
+
+    /* qrand() is per thread: seed it here, or every worker jitters its retries alike. */
+    qsrand((uint)QDateTime::currentMSecsSinceEpoch() ^ (uint)(quintptr)QThread::currentThreadId());
+
+    while(MailJob *job = m_daemon->take()){
+
+        /* The settings of the application, overruled by the job. */
+        QVariantMap batch = m_daemon->defaults();
+        QVariantMap values = job->batch();
+        for(QVariantMap::const_iterator it = values.constBegin(); it != values.constEnd(); ++it){
+            batch.insert(it.key(), it.value());
+        }
+
+        runJob(job, batch);
+    }
+
+    /* The sessions were made on this thread, and end on it. */
+    m_relays.clear();
+
+}
+
+bool MailDaemonWorker::isValidEmail(const QString &address){
+
+    return QRegExp("[A-Z0-9._%+-]+@[A-Z0-9.-]+\\.[A-Z0-9-]{2,63}", Qt::CaseInsensitive).exactMatch(address);
+
+}
+
+bool MailDaemonWorker::connectRelays(const QVariantMap &batch, QString *error){
+
+    QString spec = batch.value(QString("relays")).toString();
+    QString user = batch.value(QString("user")).toString();
+    QString key = spec + QString("\n") + user;
+
+    if(user.isEmpty()){
+        *error = QString("No SMTP login, set STUDENTMAILER_SMTP_USER and STUDENTMAILER_SMTP_PASSWORD.");
+        return false;
+    }
+
+    /* Other relays or another login: start over. */
+    if(key != m_relayKey || m_relays.count() == 0){
+        m_relays.clear();
+        m_relayKey = key;
+
+        QString type = batch.value(QString("smtpType")).toString().toLower();
+        SmtpClient::ConnectionType defaultType = type == QString("tcp") ? SmtpClient::TcpConnection :
+                                                 type == QString("tls") ? SmtpClient::TlsConnection : SmtpClient::SslConnection;
+
+        if(!m_relays.addRelays(spec, batch.value(QString("smtpPort")).toInt(), defaultType) || m_relays.count() == 0){
+            m_relays.clear();
+            *error = QString("Invalid SMTP relays \"") + spec.trimmed() + QString("\".");
+            return false;
+        }
+        m_relays.setCredentials(user, batch.value(QString("password")).toString());
+    }
+
+    /* Every job may use 8bit bodies again, if all relays take them. */
+    m_relays.require(QStringList());
+
+    int connected = 0;
+    for(int i = 0; i < m_relays.count(); i++){
+        if((m_relays.session(i) != NULL && m_relays.isUp(i)) || m_relays.connect(i)){
+            connected++;
+        }
+    }
+
+    if(connected == 0){
+        m_relays.clear();
+        *error = QString("Could not connect and log in to any SMTP relay.");
+        return false;
+    }
+
+    return true;
+
+}
+
+void MailDaemonWorker::runJob(MailJob *job, const QVariantMap &batch){
+
+    /* Check sender. */
+    QString fromEmail = batch.value(QString("senderEmail")).toString();
+    if(!isValidEmail(fromEmail)){
+        job->finish(MailJob::Failed, QString("Sender email address is invalid!"));
+        return;
+    }
+    QString fromName = batch.value(QString("senderName")).toString();
+    EmailAddress sender(fromEmail, fromName.isEmpty() ? fromEmail : fromName);
+
+    /* Check course code and subject. */
+    QString coursecode = batch.value(QString("courseCode")).toString();
+    if(coursecode.length() < 2){
+        job->finish(MailJob::Failed, QString("Course code cannot be less than 2 characters!"));
+        return;
+    }
+    if(batch.value(QString("subject")).toString().length() < 2){
+        job->finish(MailJob::Failed, QString("Subject cannot be less than 2 characters!"));
+        return;
+    }
+    QString subject = QString("[") + coursecode + QString("] ") + batch.value(QString("subject")).toString();
+
+    /* Bcc addresses, always in the envelope: the daemon sends no digest. */
+    QStringList bcc_addresses = batch.value(QString("emailBcc")).toString().split(";", QString::SkipEmptyParts);
+    foreach(QString bcc, bcc_addresses){
+        if(!isValidEmail(bcc)){
+            job->finish(MailJob::Failed, QString("The bcc email address ") + bcc + QString(" is invalid!"));
+            return;
+        }
+    }
+
+    /*
+     * Sheet and template, from the caches of the daemon. The result of a
+     * query is read again for every job, the database may have changed.
+     */
+    QString error;
+    QSharedPointer<const SheetSnapshot> sheet;
+    if(batch.contains(QString("query"))){
+        SqlSource source;
+        SheetSnapshot *snapshot = new SheetSnapshot();
+        if(source.open(batch.value(QString("workbook")).toString(), &error) &&
+           source.load(batch.value(QString("query")).toString(), snapshot, &error,
+                       batch.value(QString("filterColumn")).toString(), batch.value(QString("recipients")).toStringList())){
+            sheet = QSharedPointer<const SheetSnapshot>(snapshot);
+        }
+        else{
+            delete snapshot;
+        }
+    }
+    else{
+        sheet = m_daemon->sheet(batch.value(QString("workbook")).toString(), batch.value(QString("sheet")).toString(), &error);
+    }
+    if(sheet.isNull()){
+        job->finish(MailJob::Failed, error);
+        return;
+    }
+    QSharedPointer<const MailTemplate> mailTemplate = m_daemon->mailTemplate(batch.value(QString("template")).toString());
+
+    int emailRow, emailCol;
+    if(!MailTemplate::parseCell(batch.value(QString("emailColumn")).toString(), &emailRow, &emailCol)){
+        job->finish(MailJob::Failed, QString("Invalid email column \"") + batch.value(QString("emailColumn")).toString() + QString("\"."));
+        return;
+    }
+    QString emailAppend = batch.value(QString("emailAppend")).toString();
+
+    int attachmentRow = 0, attachmentCol = 0;
+    QString attachmentColumn = batch.value(QString("attachmentColumn")).toString();
+    bool individualAttachment = !attachmentColumn.isEmpty() && attachmentColumn != QString("<none>");
+    if(individualAttachment && !MailTemplate::parseCell(attachmentColumn, &attachmentRow, &attachmentCol)){
+        job->finish(MailJob::Failed, QString("Invalid attachment column \"") + attachmentColumn + QString("\"."));
+        return;
+    }
+
+    Shard shard;
+    if(!shard.parse(batch.value(QString("shard"), QString("1/1")).toString())){
+        job->finish(MailJob::Failed, QString("Invalid shard \"") + batch.value(QString("shard")).toString() + QString("\"."));
+        return;
+    }
+
+    /* The rows: as given, or the range of the sheet, and only those of the shard. */
+    QList<int> rows;
+    if(batch.contains(QString("rows"))){
+        foreach(QVariant row, batch.value(QString("rows")).toList()){
+            rows.append(row.toInt());
+        }
+    }
+    else{
+        int first = batch.value(QString("firstRow"), 1).toInt();
+        int last = batch.value(QString("lastRow"), sheet->rowCount()).toInt();
+        for(int i = qMax(1, first); i <= qMin(last, sheet->rowCount()); i++){
+            QString address = QString::fromUtf8(sheet->cell(emailRow != 0 ? emailRow : i, emailCol));
+            if(!address.isEmpty() && shard.contains(address + emailAppend)){
+                rows.append(i);
+            }
+        }
+    }
+
+    /* The MIME objects of the job. */
+    MimeArena arena;
+    int nMails = rows.count();
+    QVector<QString> addresses(nMails);
+    QVector<QList<MimePart*> > parts(nMails);
+    QVector<FastMimeText*> texts(nMails);
+    QVector<QByteArray> hashes(nMails);
+
+    QList<MimeAttachment*> attachments;
+    QStringList attachmentFiles = batch.value(QString("attachments")).toStringList();
+    foreach(QString fileName, attachmentFiles){
+        if(!QFile::exists(fileName)){
+            job->finish(MailJob::Failed, QString("Attachment ") + fileName + QString(" can not be loaded!"));
+            return;
+        }
+        attachments.append(arena.create<FastMimeAttachment>(arena.create<QFile>(fileName)));
+    }
+
+    /* Check and render the mails. */
+    QByteArray mailText;
+    for(int i = 0; i < nMails; i++){
+        int rowIndex = rows.at(i);
+
+        QString recv_mail = QString::fromUtf8(sheet->cell(emailRow != 0 ? emailRow : rowIndex, emailCol)) + emailAppend;
+        if(!isValidEmail(recv_mail)){
+            job->finish(MailJob::Failed, QString("The email address ") + recv_mail + QString(" on line ") +
+                        QString::number(rowIndex) + QString(" is invalid!"));
+            return;
+        }
+        addresses[i] = recv_mail;
+
+        mailTemplate->render(*sheet, rowIndex, &mailText);
+        if(mailText.contains("[INV_REF!]")){
+            job->finish(MailJob::Failed, QString("There are invalid references in the mailtext of email ") +
+                        QString::number(rowIndex) + QString("!"));
+            return;
+        }
+
+        texts[i] = arena.create<FastMimeText>();
+        texts[i]->setBody(mailText);
+        parts[i].append(texts[i]);
+        foreach(MimeAttachment *att, attachments){
+            parts[i].append(att);
+        }
+
+        QStringList files = attachmentFiles;
+        if(individualAttachment){
+            QString fileName = batch.value(QString("attachmentDirectory")).toString() + QDir::separator() +
+                               QString::fromUtf8(sheet->cell(attachmentRow != 0 ? attachmentRow : rowIndex, attachmentCol)) +
+                               batch.value(QString("attachmentAppend")).toString();
+            if(!QFile::exists(fileName)){
+                job->finish(MailJob::Failed, QString("Attachment ") + fileName + QString(" can not be loaded!"));
+                return;
+            }
+            parts[i].append(arena.create<FastMimeAttachment>(arena.create<QFile>(fileName)));
+            files.append(fileName);
+        }
+        hashes[i] = SendHistory::mailHash(mailText, files);
+    }
+
+    if(job->isCancelled()){
+        job->finish(MailJob::Cancelled);
+        return;
+    }
+
+    /* Log in, or keep the sessions of the previous job. */
+    if(!connectRelays(batch, &error)){
+        job->finish(MailJob::Failed, error);
+        return;
+    }
+
+    /* Send UTF-8 as is when all relays accept 8bit bodies; a relay that comes back must too. */
+    bool eightBit = m_relays.supports(QString("8BITMIME"));
+    m_relays.require(eightBit ? QStringList() << QString("8BITMIME") : QStringList());
+    for(int i = 0; i < nMails; i++){
+        texts[i]->setEightBitAllowed(eightBit);
+    }
+
+    /* Journal the job like a batch of the window, without the login. */
+    OutboxJournal journal;
+    {
+        QVariantMap record = batch;
+        QVariantList rowList;
+        foreach(int row, rows){
+            rowList.append(row);
+        }
+        record.insert(QString("rows"), rowList);
+        record.insert(QString("bccDigest"), false);
+        record.remove(QString("user"));
+        record.remove(QString("password"));
+        if(shard.isAll()){
+            record.remove(QString("shard"));
+        }
+        journal.begin(record);
+    }
+    job->start(nMails, journal.fileName());
+
+    ReportWriter reportFile;
+    reportFile.open(QString("report-") + QString(coursecode).replace(QRegExp("[^A-Za-z0-9_-]"), QString("_")) +
+                    QString("-") + QDateTime::currentDateTime().toString(QString("yyyyMMdd-hhmmss")));
+
+    MailWriter writer;
+    writer.setCommon(sender, subject);
+    QByteArray payload;
+
+    RateLimiter limiter;
+    limiter.configure(batch.value(QString("maxMessages")).toDouble(), batch.value(QString("maxKBytes")).toDouble() * 1024);
+    QElapsedTimer clock;
+    clock.start();
+    m_relays.resetStatistics();
+
+    bool connectionLost = false;
+    bool cancelled = false;
+
+    /*
+     * Deferred mails wait in a retry queue, by the time they are due, so
+     * the other mails of the job are sent meanwhile. The worker only
+     * waits when the retries are all that is left.
+     */
+    QMultiMap<qint64, int> retries;
+    QVector<int> attempts(nMails, 0);
+    QHash<QString, QByteArray> delivered;
+    int next = 0;
+
+    while(next < nMails || !retries.isEmpty()){
+        int i;
+        if(!retries.isEmpty() && (next == nMails || retries.begin().key() <= clock.elapsed())){
+            qint64 due = retries.begin().key();
+            while(clock.elapsed() < due && !job->isCancelled()){
+                msleep((unsigned long)qMin(due - clock.elapsed(), (qint64)MAILDAEMONWORKER_POLL_MS));
+            }
+            i = retries.begin().value();
+            retries.erase(retries.begin());
+        }
+        else{
+            i = next++;
+        }
+
+        int rowIndex = rows.at(i);
+        QString header = QString("From: ") + fromName + QString(" <") + fromEmail + QString(">\n") +
+                         QString("To: <") + addresses[i] + QString(">\n") +
+                         QString("Subject: ") + subject + QString("\n\n");
+
+        cancelled = cancelled || job->isCancelled();
+
+        /* Not sent: the rest after a lost session or a cancel. */
+        if(connectionLost || cancelled){
+            journal.record(rowIndex, addresses[i], hashes[i], OutboxJournal::Failed);
+            reportFile.append(rowIndex, header, texts[i]->body());
+            job->count(OutboxJournal::Failed);
+            continue;
+        }
+
+        journal.record(rowIndex, addresses[i], hashes[i], OutboxJournal::Sending);
+        writer.writeMail(MailWriter::address(addresses[i]), parts[i], &payload);
+
+        qint64 wait = limiter.delay(payload.size(), clock.elapsed(), 1 + bcc_addresses.count());
+        if(wait > 0){
+            msleep((unsigned long)wait);
+        }
+
+        int relay = -1;
+        SmtpSession::SendResult result = m_relays.send(sender.getAddress(), QStringList() << addresses[i] << bcc_addresses, payload, &relay);
+        SmtpSession *session = m_relays.lastSession();
+        attempts[i]++;
+
+        if(result == SmtpSession::Delivered){
+            limiter.consume(payload.size(), clock.elapsed(), 1 + bcc_addresses.count());
+            if(session != NULL){
+                limiter.delivered(session->lastDataLatency(), clock.elapsed());
+            }
+        }
+        else{
+            limiter.consume(0, clock.elapsed(), 1 + bcc_addresses.count());
+        }
+
+        /* Deferred: queue it again after a backoff that doubles with every attempt, +-25% jitter. */
+        if(result == SmtpSession::TransientFailure && attempts[i] <= MAILDAEMONWORKER_RETRY_ATTEMPTS && !job->isCancelled()){
+            limiter.throttled(clock.elapsed());
+            journal.record(rowIndex, addresses[i], hashes[i], OutboxJournal::Deferred);
+
+            qint64 backoff = (qint64)MAILDAEMONWORKER_RETRY_BACKOFF_MS << (attempts[i] - 1);
+            backoff += (backoff * ((qrand() % 51) - 25)) / 100;
+            retries.insert(clock.elapsed() + backoff, i);
+            continue;
+        }
+
+        QString relayName = relay >= 0 ? m_relays.name(relay) : QString();
+        OutboxJournal::Status status = result == SmtpSession::Delivered ? OutboxJournal::Delivered : OutboxJournal::Failed;
+        connectionLost = result == SmtpSession::SessionLost;
+        if(status == OutboxJournal::Delivered){
+            delivered.insert(addresses[i], hashes[i]);
+        }
+
+        journal.record(rowIndex, addresses[i], hashes[i], status, relayName);
+        reportFile.append(rowIndex, header, texts[i]->body(), relayName);
+        job->count(status);
+    }
+
+    /* Remember what was delivered, like the window does, for its next "changed only" selection. */
+    m_daemon->recordDelivered(coursecode, batch.value(QString("subject")).toString(), delivered);
+
+    journal.finish(connectionLost ? QString("connection lost") : cancelled ? QString("cancelled") : QString("done"));
+
+    /* The report stays next to the journal, there is nobody to mail it to. */
+    if(reportFile.finish() && !journal.fileName().isEmpty()){
+        QFileInfo fi(journal.fileName());
+        QFile::copy(reportFile.fileName(), fi.path() + QString("/") + fi.completeBaseName() + QString(".txt.gz"));
+    }
+
+    if(connectionLost){
+        m_relays.clear();
+        job->finish(MailJob::Failed, QString("The SMTP connection was lost and could not be restored."));
+    }
+    else if(cancelled){
+        job->finish(MailJob::Cancelled);
+    }
+    else{
+        job->finish(MailJob::Done, m_relays.count() > 1 ? m_relays.summary() : QString());
+    }
+
+}
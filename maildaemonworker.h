@@ -0,0 +1,51 @@
+#ifndef MAILDAEMONWORKER_H
+#define MAILDAEMONWORKER_H
+
+#include <QThread>
+#include <QString>
+#include <QVariantMap>
+
+#include "mailjob.h"
+#include "relaypool.h"
+
+/* Deferred (4xx) mails of a job are tried this often, with exponential backoff. */
+#define MAILDAEMONWORKER_RETRY_ATTEMPTS   4
+#define MAILDAEMONWORKER_RETRY_BACKOFF_MS 5000
+
+/* How often a cancel is checked while waiting for a retry. */
+#define MAILDAEMONWORKER_POLL_MS          100
+
+class MailDaemon;
+
+/*
+ * Runs the jobs of a MailDaemon, one at a time.
+ *
+ * A job goes through the same steps as a batch sent from the window:
+ * check the parameters, render every mail from the (cached) sheet and
+ * template, send them through the relays and keep the outbox journal
+ * and the report. The SMTP sessions stay logged in between jobs, as
+ * long as the relays and the login do not change.
+ */
+class MailDaemonWorker : public QThread
+{
+public:
+    MailDaemonWorker(MailDaemon *daemon);
+
+protected:
+    void run();
+
+private:
+    /* Run one job, the job is finished when it returns. */
+    void runJob(MailJob *job, const QVariantMap &batch);
+
+    /* Log in to the relays of `batch`, reusing the sessions when possible. */
+    bool connectRelays(const QVariantMap &batch, QString *error);
+
+    static bool isValidEmail(const QString &address);
+
+    MailDaemon *m_daemon;
+    RelayPool m_relays;
+    QString m_relayKey;
+};
+
+#endif // MAILDAEMONWORKER_H
@@ -0,0 +1,146 @@
+#include "mailjob.h"
+
+MailJob::MailJob(int id, const QVariantMap &batch) :
+    m_id(id), m_batch(batch)
+{
+    m_state = Queued;
+    m_cancelled = false;
+    m_total = 0;
+    m_delivered = 0;
+    m_deferred = 0;
+    m_failed = 0;
+    m_queued = QDateTime::currentDateTime();
+}
+
+QString MailJob::stateName(State state){
+
+    switch(state){
+      case Queued:    return QString("queued");
+      case Running:   return QString("running");
+      case Done:      return QString("done");
+      case Cancelled: return QString("cancelled");
+      default:        return QString("failed");
+    }
+
+}
+
+QVariantMap MailJob::status() const{
+
+    QMutexLocker lock(&m_mutex);
+
+    QVariantMap s;
+    s.insert(QString("id"), m_id);
+    s.insert(QString("state"), stateName(m_state));
+    s.insert(QString("workbook"), m_batch.value(QString("workbook")));
+    s.insert(QString("sheet"), m_batch.value(QString("sheet")));
+    s.insert(QString("subject"), m_batch.value(QString("subject")));
+    s.insert(QString("total"), m_total);
+    s.insert(QString("delivered"), m_delivered);
+    s.insert(QString("deferred"), m_deferred);
+    s.insert(QString("failed"), m_failed);
+    s.insert(QString("queued"), m_queued.toString(Qt::ISODate));
+
+    if(!m_message.isEmpty()){
+        s.insert(QString("message"), m_message);
+    }
+    if(!m_journal.isEmpty()){
+        s.insert(QString("journal"), m_journal);
+    }
+    if(m_started.isValid()){
+        s.insert(QString("started"), m_started.toString(Qt::ISODate));
+    }
+    if(m_finished.isValid()){
+        s.insert(QString("finished"), m_finished.toString(Qt::ISODate));
+    }
+    if(m_dropped.isValid()){
+        s.insert(QString("dropped"), m_dropped.toString(Qt::ISODate));
+    }
+    if(m_firstMail.isValid()){
+        s.insert(QString("firstMail"), m_firstMail.toString(Qt::ISODate));
+        if(m_dropped.isValid()){
+            s.insert(QString("dropToFirstMailMs"), m_dropped.msecsTo(m_firstMail));
+        }
+    }
+
+    return s;
+
+}
+
+MailJob::State MailJob::state() const{
+
+    QMutexLocker lock(&m_mutex);
+    return m_state;
+
+}
+
+bool MailJob::isFinished() const{
+
+    QMutexLocker lock(&m_mutex);
+    return m_state == Done || m_state == Failed || m_state == Cancelled;
+
+}
+
+void MailJob::start(int total, const QString &journal){
+
+    QMutexLocker lock(&m_mutex);
+    m_state = Running;
+    m_total = total;
+    m_journal = journal;
+    m_started = QDateTime::currentDateTime();
+
+}
+
+/* The final status of one mail. */
+void MailJob::count(OutboxJournal::Status status){
+
+    QMutexLocker lock(&m_mutex);
+
+    if(status == OutboxJournal::Delivered && !m_firstMail.isValid()){
+        m_firstMail = QDateTime::currentDateTime();
+    }
+
+    switch(status){
+      case OutboxJournal::Delivered: m_delivered++; break;
+      case OutboxJournal::Deferred:  m_deferred++;  break;
+      case OutboxJournal::Failed:    m_failed++;    break;
+      default:                       break;
+    }
+
+}
+
+void MailJob::finish(State state, const QString &message){
+
+    QMutexLocker lock(&m_mutex);
+    m_state = state;
+    m_message = message;
+    m_finished = QDateTime::currentDateTime();
+
+}
+
+void MailJob::setDropped(const QDateTime &dropped){
+
+    QMutexLocker lock(&m_mutex);
+    m_dropped = dropped;
+
+}
+
+qint64 MailJob::dropToFirstMail() const{
+
+    QMutexLocker lock(&m_mutex);
+    return m_dropped.isValid() && m_firstMail.isValid() ? m_dropped.msecsTo(m_firstMail) : -1;
+
+}
+
+void MailJob::cancel(){
+
+    QMutexLocker lock(&m_mutex);
+    m_cancelled = true;
+
+}
+
+bool MailJob::isCancelled() const{
+
+    QMutexLocker lock(&m_mutex);
+    return m_cancelled;
+
+}
@@ -0,0 +1,81 @@
+#ifndef MAILJOB_H
+#define MAILJOB_H
+
+#include <QMutex>
+#include <QString>
+#include <QDateTime>
+#include <QVariantMap>
+
+#include "outboxjournal.h"
+
+/*
+ * A batch queued in the daemon, see MailDaemon.
+ *
+ * The batch is described like the batch record of an OutboxJournal
+ * (workbook, sheet, template, subject, courseCode, emailColumn, rows, ...)
+ * with the sender and SMTP settings of the application as defaults.
+ * The status is updated by the worker that runs the job and read by the
+ * clients, so every access is locked.
+ */
+class MailJob
+{
+public:
+    enum State {
+        Queued,
+        Running,
+        Done,
+        Failed,
+        Cancelled
+    };
+
+    MailJob(int id, const QVariantMap &batch);
+
+    int id() const { return m_id; }
+    const QVariantMap &batch() const { return m_batch; }
+
+    /* Everything a client may ask about the job. */
+    QVariantMap status() const;
+    State state() const;
+    bool isFinished() const;
+
+    /* Progress, set by the worker. */
+    void start(int total, const QString &journal);
+    void count(OutboxJournal::Status status);
+    void finish(State state, const QString &message = QString());
+
+    /* A job from a hot folder: when its files were noticed, see HotFolder. */
+    void setDropped(const QDateTime &dropped);
+
+    /* Milliseconds from the drop to the first mail delivered, -1 if none. */
+    qint64 dropToFirstMail() const;
+
+    /* Stop after the mail that is being sent. */
+    void cancel();
+    bool isCancelled() const;
+
+    static QString stateName(State state);
+
+private:
+    mutable QMutex m_mutex;
+
+    int m_id;
+    QVariantMap m_batch;
+
+    State m_state;
+    QString m_message;
+    QString m_journal;
+    bool m_cancelled;
+
+    int m_total;
+    int m_delivered;
+    int m_deferred;
+    int m_failed;
+
+    QDateTime m_queued;
+    QDateTime m_started;
+    QDateTime m_finished;
+    QDateTime m_dropped;
+    QDateTime m_firstMail;
+};
+
+#endif // MAILJOB_H
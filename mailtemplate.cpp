@@ -0,0 +1,127 @@
+#include "mailtemplate.h"
+
+#include <QRegExp>
+
+MailTemplate::MailTemplate(){
+
+    m_static = true;
+    m_literalLength = 0;
+    m_literalBytes = 0;
+
+}
+
+/* Split the text in literal parts and cell references. */
+void MailTemplate::compile(const QString &text){
+
+    m_source = text;
+    m_segments.clear();
+    m_static = true;
+    m_literalLength = 0;
+    m_literalBytes = 0;
+
+    /* Regexp to find all alphanumeric values between ## */
+    QRegExp re("#([A-Z,a-z,0-9]*)#");
+
+    int lastpos = 0;
+    int pos = 0;
+    while((pos = re.indexIn(text, pos)) != -1){
+        /* Part between last match and new match as-is. */
+        if(pos > lastpos){
+            TemplateSegment literal = { TemplateSegment::Literal, text.mid(lastpos, pos-lastpos), 0, 0, QByteArray() };
+            literal.utf8 = literal.text.toUtf8();
+            m_segments.append(literal);
+            m_literalLength += literal.text.length();
+            m_literalBytes += literal.utf8.size();
+        }
+
+        /* The cell. */
+        TemplateSegment cell = { TemplateSegment::Cell, re.cap(1), 0, 0, QByteArray() };
+        if(!parseCell(cell.text, &cell.row, &cell.col)){
+            cell.type = TemplateSegment::Invalid;
+            cell.utf8 = QByteArray("[INV_REF!]");
+        }
+        if(cell.type == TemplateSegment::Cell && cell.row == 0){
+            m_static = false;
+        }
+        m_segments.append(cell);
+
+        /* Keep positions between matches. */
+        pos += re.matchedLength();
+        lastpos = pos;
+    }
+
+    /* The remaining part of the text. */
+    if(lastpos < text.length()){
+        TemplateSegment literal = { TemplateSegment::Literal, text.mid(lastpos), 0, 0, QByteArray() };
+        literal.utf8 = literal.text.toUtf8();
+        m_segments.append(literal);
+        m_literalLength += literal.text.length();
+        m_literalBytes += literal.utf8.size();
+    }
+
+}
+
+/* Only bytes are copied: the literals and the values are UTF-8 already. */
+void MailTemplate::render(const SheetSnapshot &sheet, int offset, QByteArray *out) const{
+
+    /*
+     * reserve() keeps the memory when the buffer is emptied. When the
+     * last result is still in use elsewhere, start a new buffer instead
+     * of copying it.
+     */
+    if(!out->isDetached()){
+        *out = QByteArray();
+    }
+    out->reserve(qMax(out->capacity(), m_literalBytes + 16 * m_segments.count()));
+    out->resize(0);
+
+    foreach(const TemplateSegment &seg, m_segments){
+        if(seg.type == TemplateSegment::Cell){
+            sheet.appendCell(seg.row == 0 ? offset : seg.row, seg.col, out);
+        }
+        else{
+            out->append(seg.utf8);
+        }
+    }
+
+}
+
+/*
+ * Same as searching "([A-Z,a-z]+)([0-9]*)": the first run of letters and
+ * the digits directly after it.
+ *
+ * Columns are [a-z] and are parsed as a base-26 number where A is 1.
+ */
+bool MailTemplate::parseCell(const QString &cell, int *row, int *col){
+
+    const QChar *c = cell.constData();
+    const QChar *end = c + cell.length();
+
+    /* Find the letters. */
+    while(c < end && !(c->isLetter() && c->unicode() < 128) && *c != QChar(',')){
+        c++;
+    }
+
+    int letters = 0;
+    *col = 0;
+    for(; c < end && ((c->isLetter() && c->unicode() < 128) || *c == QChar(',')); c++){
+        if(*c == QChar(',')){
+            return false;
+        }
+        *col = *col * 26 + (c->toUpper().unicode() - 'A' + 1);
+        letters++;
+    }
+
+    if(letters < 1 || letters > 4){
+        return false;
+    }
+
+    /* Digits, if any, are a static row. */
+    *row = 0;
+    for(; c < end && c->unicode() >= '0' && c->unicode() <= '9'; c++){
+        *row = *row * 10 + (c->unicode() - '0');
+    }
+
+    return true;
+
+}
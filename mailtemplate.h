@@ -0,0 +1,67 @@
+#ifndef MAILTEMPLATE_H
+#define MAILTEMPLATE_H
+
+#include <QList>
+#include <QString>
+#include <QByteArray>
+
+#include "sheetsnapshot.h"
+
+/*
+ * Part of a compiled template: either literal text, or a reference to
+ * a cell. Row 0 means the row of the mail that is rendered. The text of
+ * literals (and of invalid references) is kept as UTF-8 as well.
+ */
+struct TemplateSegment {
+    enum Type { Literal, Cell, Invalid };
+
+    Type type;
+    QString text;
+    int row;
+    int col;
+    QByteArray utf8;
+};
+
+/*
+ * A mail template compiled into segments.
+ *
+ * The text is parsed once for #A#, #A1# etc., so rendering a mail
+ * only has to look up the values of the cells.
+ */
+class MailTemplate
+{
+public:
+    MailTemplate();
+
+    void compile(const QString &text);
+
+    const QString &source() const { return m_source; }
+    const QList<TemplateSegment> &segments() const { return m_segments; }
+
+    /* True when no segment depends on the row, i.e. every mail is the same. */
+    bool isStatic() const { return m_static; }
+
+    /* Length of all literal text, to reserve the result. */
+    int literalLength() const { return m_literalLength; }
+
+    /*
+     * Render the mail of row `offset` as UTF-8 into `out`. The buffer is
+     * overwritten, its memory is reused from the previous mail.
+     */
+    void render(const SheetSnapshot &sheet, int offset, QByteArray *out) const;
+
+    /*
+     * Parse "A", "AB12", ... into a column (1-based) and row (0 when
+     * not given). Columns up to four letters (XFD is the Excel maximum).
+     */
+    static bool parseCell(const QString &cell, int *row, int *col);
+
+private:
+    QString m_source;
+    QList<TemplateSegment> m_segments;
+    bool m_static;
+    int m_literalLength;
+    int m_literalBytes;
+};
+
+#endif // MAILTEMPLATE_H
@@ -0,0 +1,207 @@
+#include "mailwriter.h"
+
+#include <QDateTime>
+
+#include "fastmimetext.h"
+#include "fastmimeattachment.h"
+
+/* Room for the headers, reserved when the buffer is used first. */
+#define MAILWRITER_HEADER_SIZE 1024
+
+MailWriter::MailWriter(){
+
+    m_dateSecs = -1;
+    m_sequence = 0;
+
+}
+
+/* Everything from From up to and including the empty line after the headers. */
+void MailWriter::setCommon(const EmailAddress &sender, const QString &subject, const QList<EmailAddress*> &cc){
+
+    QByteArray b = boundary();
+
+    m_common.clear();
+    m_common.append("From: ");
+    m_common.append(address(sender));
+    m_common.append("\r\n");
+
+    if(!cc.isEmpty()){
+        m_common.append("Cc: ");
+        for(int i = 0; i < cc.count(); i++){
+            if(i > 0){
+                m_common.append(",\r\n ");
+            }
+            m_common.append(address(*cc.at(i)));
+        }
+        m_common.append("\r\n");
+    }
+
+    m_common.append("Subject: ");
+    m_common.append(encodeWord(subject));
+    m_common.append("\r\nMIME-Version: 1.0\r\nContent-Type: multipart/mixed; boundary=\"");
+    m_common.append(b);
+    m_common.append("\"\r\n\r\n");
+
+    m_delimiter = "--" + b + "\r\n";
+    m_closeDelimiter = "--" + b + "--\r\n";
+
+    /* Message-IDs: <time.sequence.random@domain of the sender>. */
+    QString domain = sender.getAddress().section(QChar('@'), -1);
+    m_idSuffix = "." + QByteArray::number(qrand(), 16) + "@" + domain.toUtf8() + ">";
+    m_sequence = 0;
+
+}
+
+void MailWriter::writeMail(const QByteArray &to, const QList<MimePart*> &parts, QByteArray *out){
+
+    /*
+     * reserve() keeps the memory when the buffer is emptied. When the
+     * last result is still in use elsewhere, start a new buffer instead
+     * of copying it.
+     */
+    if(!out->isDetached()){
+        *out = QByteArray();
+    }
+    out->reserve(qMax(out->capacity(), MAILWRITER_HEADER_SIZE));
+    out->resize(0);
+
+    out->append("To: ");
+    out->append(to);
+    out->append("\r\nDate: ");
+    out->append(date());
+    out->append("\r\nMessage-ID: <");
+    out->append(QByteArray::number(m_dateSecs, 16));
+    out->append('.');
+    out->append(QByteArray::number(++m_sequence));
+    out->append(m_idSuffix);
+    out->append("\r\n");
+    out->append(m_common);
+
+    /* The parts, the same layout as MimeMultiPart. */
+    foreach(MimePart *part, parts){
+        out->append(m_delimiter);
+        writePart(part, out);
+    }
+    out->append(m_closeDelimiter);
+
+}
+
+const QByteArray &MailWriter::date(){
+
+    QDateTime now = QDateTime::currentDateTime();
+    qint64 secs = now.toMSecsSinceEpoch() / 1000;
+
+    if(secs != m_dateSecs){
+        m_date = now.toString(Qt::RFC2822Date).toLatin1();
+        m_dateSecs = secs;
+    }
+
+    return m_date;
+
+}
+
+void MailWriter::write(MimeMessage &message, QByteArray *out, const QString &to){
+
+    MailWriter writer;
+    writer.setCommon(message.getSender(), message.getSubject(), message.getRecipients(MimeMessage::Cc));
+
+    QByteArray rcpts;
+    if(!to.isEmpty()){
+        rcpts = to.toUtf8();
+    }
+    else{
+        const QList<EmailAddress*> &list = message.getRecipients(MimeMessage::To);
+        for(int i = 0; i < list.count(); i++){
+            if(i > 0){
+                rcpts.append(",\r\n ");
+            }
+            rcpts.append(address(*list.at(i)));
+        }
+    }
+
+    writer.writeMail(rcpts, message.getParts(), out);
+
+}
+
+void MailWriter::writePart(MimePart *part, QByteArray *out){
+
+    FastMimeText *text = dynamic_cast<FastMimeText*>(part);
+    if(text != NULL){
+        text->write(out);
+        return;
+    }
+
+    FastMimeAttachment *attachment = dynamic_cast<FastMimeAttachment*>(part);
+    if(attachment != NULL){
+        attachment->write(out);
+        return;
+    }
+
+    out->append(part->toString().toUtf8());
+
+}
+
+QByteArray MailWriter::encodeWord(const QString &text){
+
+    QByteArray utf8 = text.toUtf8();
+
+    for(int i = 0; i < utf8.size(); i++){
+        unsigned char c = utf8.at(i);
+        if(c >= 0x80 || c < 0x20){
+            return "=?utf-8?B?" + utf8.toBase64() + "?=";
+        }
+    }
+
+    return utf8;
+
+}
+
+QByteArray MailWriter::address(const EmailAddress &address){
+
+    QByteArray res;
+    QString name = address.getName();
+
+    if(!name.isEmpty()){
+        QByteArray word = encodeWord(name);
+
+        /* ASCII names are quoted, they may contain a comma or a dot. */
+        if(word.startsWith("=?")){
+            res = word;
+        }
+        else{
+            res = "\"" + word.replace('\\', "\\\\").replace('"', "\\\"") + "\"";
+        }
+        res += " ";
+    }
+
+    res += "<" + address.getAddress().toUtf8() + ">";
+
+    return res;
+
+}
+
+QByteArray MailWriter::address(const QString &address){
+
+    return "<" + address.toUtf8() + ">";
+
+}
+
+QByteArray MailWriter::addressList(const QStringList &addresses){
+
+    QByteArray res;
+    for(int i = 0; i < addresses.count(); i++){
+        if(i > 0){
+            res.append(",\r\n ");
+        }
+        res.append(address(addresses.at(i)));
+    }
+
+    return res;
+
+}
+
+QByteArray MailWriter::boundary(){
+
+    return "=_" + QByteArray::number(QDateTime::currentMSecsSinceEpoch(), 16) + "_" + QByteArray::number(qrand(), 16);
+
+}
@@ -0,0 +1,74 @@
+#ifndef MAILWRITER_H
+#define MAILWRITER_H
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+
+#include <mimemessage.h>
+
+/*
+ * Serializes mails straight to the bytes that go on the wire.
+ *
+ * MimeMessage::toString() builds the message as a QString, which is
+ * converted to UTF-8 again to send it. Here the headers and the parts
+ * are written as bytes into one buffer that is reused for every mail;
+ * FastMimeText and FastMimeAttachment write their encoded content
+ * directly, other parts still go through MimePart::toString().
+ *
+ * The headers that are the same for every mail of a batch (From,
+ * Subject, MIME-Version and the multipart boundary) are encoded once by
+ * setCommon(). Only To, Date and Message-ID are written per mail.
+ */
+class MailWriter
+{
+public:
+    MailWriter();
+
+    /* Encode the headers shared by all mails. */
+    void setCommon(const EmailAddress &sender, const QString &subject, const QList<EmailAddress*> &cc = QList<EmailAddress*>());
+    const QByteArray &common() const { return m_common; }
+
+    /*
+     * One mail to `to` (an encoded address list, see address()) with the
+     * common headers, into `out`, overwriting it.
+     */
+    void writeMail(const QByteArray &to, const QList<MimePart*> &parts, QByteArray *out);
+
+    /*
+     * Serialize `message` into `out`, overwriting it. When `to` is not
+     * empty it replaces the To header of the message.
+     */
+    static void write(MimeMessage &message, QByteArray *out, const QString &to = QString());
+
+    /* One part, with its headers, onto the end of `out`. */
+    static void writePart(MimePart *part, QByteArray *out);
+
+    /* Non-ASCII text as an RFC 2047 encoded word, ASCII as is. */
+    static QByteArray encodeWord(const QString &text);
+
+    /* "Name <address>", or "<address>" without a name. */
+    static QByteArray address(const EmailAddress &address);
+    static QByteArray address(const QString &address);
+
+    /* Addresses for one header, folded after every comma. */
+    static QByteArray addressList(const QStringList &addresses);
+
+    /* A boundary that cannot occur in base64 or quoted-printable content. */
+    static QByteArray boundary();
+
+private:
+    /* The Date header only changes once per second. */
+    const QByteArray &date();
+
+    QByteArray m_common;
+    QByteArray m_delimiter;
+    QByteArray m_closeDelimiter;
+    QByteArray m_idSuffix;
+    QByteArray m_date;
+    qint64 m_dateSecs;
+    int m_sequence;
+};
+
+#endif // MAILWRITER_H
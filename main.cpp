@@ -1,10 +1,181 @@
 #include "mainwindow.h"
+#include "shard.h"
+#include "shardmerge.h"
+#include "maildaemon.h"
+#include "hotfolder.h"
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QTextStream>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QFile>
+#include <QScopedPointer>
 
 int main(int argc, char *argv[])
 {
+    /* Read the options first: merging runs without a display. */
+    QStringList args;
+    for(int i = 0; i < argc; i++){
+        args.append(QString::fromLocal8Bit(argv[i]));
+    }
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QString(APPLICATION_NAME));
+    QCommandLineOption helpOption = parser.addHelpOption();
+    QCommandLineOption shardOption(QString("shard"),
+                                   QString("Send only shard <i/N> of the mails, so N processes or machines "
+                                           "can send the same workbook and template together."),
+                                   QString("i/N"));
+    QCommandLineOption mergeOption(QString("merge"),
+                                   QString("Merge the journals of the shards of a batch into "
+                                           "<output>.journal, <output>.txt.gz and <output>.txt."),
+                                   QString("output"));
+    QCommandLineOption daemonOption(QString("daemon"),
+                                    QString("Run without a window, sending the jobs submitted to the socket."));
+    QCommandLineOption workersOption(QString("workers"),
+                                     QString("With --daemon: the number of jobs sent at the same time."),
+                                     QString("n"), QString::number(MAILDAEMON_WORKERS));
+    QCommandLineOption watchOption(QString("watch"),
+                                   QString("With --daemon: queue the workbooks dropped in <folder>, "
+                                           "each with a job file of the same name (grades.xlsx, grades.json)."),
+                                   QString("folder"));
+    QCommandLineOption socketOption(QString("socket"),
+                                    QString("The socket of the daemon."),
+                                    QString("name"));
+    QCommandLineOption submitOption(QString("submit"),
+                                    QString("Queue the job in <job.json> in the daemon."),
+                                    QString("job.json"));
+    QCommandLineOption statusOption(QString("status"),
+                                    QString("Show the jobs of the daemon, or only job <id> (0 is all)."),
+                                    QString("id"));
+    QCommandLineOption cancelOption(QString("cancel"),
+                                    QString("Cancel job <id> of the daemon."),
+                                    QString("id"));
+    parser.addOption(shardOption);
+    parser.addOption(mergeOption);
+    parser.addOption(daemonOption);
+    parser.addOption(workersOption);
+    parser.addOption(watchOption);
+    parser.addOption(socketOption);
+    parser.addOption(submitOption);
+    parser.addOption(statusOption);
+    parser.addOption(cancelOption);
+    parser.addPositionalArgument(QString("journals"), QString("With --merge: the journals of the shards."), QString("[journals...]"));
+
+    /*
+     * Qt's own options (-style, -platform, -reverse...) are only known to,
+     * and removed by, QApplication: the window reads the options again
+     * once it exists, the other modes must be valid as they are.
+     */
+    QTextStream err(stderr);
+    bool parsed = parser.parse(args);
+    bool window = !parser.isSet(mergeOption) && !parser.isSet(daemonOption) && !parser.isSet(watchOption) &&
+                  !parser.isSet(submitOption) && !parser.isSet(statusOption) && !parser.isSet(cancelOption);
+    if(!parsed && !window){
+        err << parser.errorText() << endl;
+        return 1;
+    }
+
+    if(parser.isSet(mergeOption)){
+        QCoreApplication a(argc, argv);
+        a.setOrganizationName(APPLICATION_COMPANY_ABBR);
+        a.setApplicationName(APPLICATION_NAME_ABBR);
+
+        QString summary;
+        bool ok = ShardMerge::merge(parser.positionalArguments(), parser.value(mergeOption), &summary);
+        QTextStream(stdout) << summary;
+
+        return ok ? 0 : 1;
+    }
+
+    if(parser.isSet(daemonOption) || parser.isSet(watchOption)){
+        QCoreApplication a(argc, argv);
+        a.setOrganizationName(APPLICATION_COMPANY_ABBR);
+        a.setApplicationName(APPLICATION_NAME_ABBR);
+
+        QString name = parser.isSet(socketOption) ? parser.value(socketOption) : MailDaemon::defaultName();
+        MailDaemon daemon(parser.value(workersOption).toInt());
+        if(!daemon.listen(name)){
+            err << "Cannot listen on " << name << ": " << daemon.errorString() << endl;
+            return 1;
+        }
+
+        /* Destroyed before the daemon, whose caches its parsers use. */
+        QScopedPointer<HotFolder> hotFolder;
+        if(parser.isSet(watchOption)){
+            QString error;
+            hotFolder.reset(new HotFolder(&daemon, parser.value(watchOption)));
+            if(!hotFolder->start(&error)){
+                err << error << endl;
+                return 1;
+            }
+        }
+
+        return a.exec();
+    }
+
+    /* Client of a running daemon: one request, the reply as JSON on stdout. */
+    if(parser.isSet(submitOption) || parser.isSet(statusOption) || parser.isSet(cancelOption)){
+        QCoreApplication a(argc, argv);
+        a.setOrganizationName(APPLICATION_COMPANY_ABBR);
+        a.setApplicationName(APPLICATION_NAME_ABBR);
+
+        QVariantMap request;
+        if(parser.isSet(submitOption)){
+            QFile f(parser.value(submitOption));
+            QJsonDocument job = f.open(QIODevice::ReadOnly) ? QJsonDocument::fromJson(f.readAll()) : QJsonDocument();
+            if(!job.isObject()){
+                err << "Cannot read the job " << parser.value(submitOption) << endl;
+                return 1;
+            }
+            request.insert(QString("cmd"), QString("submit"));
+            request.insert(QString("job"), job.object().toVariantMap());
+        }
+        else if(parser.isSet(cancelOption)){
+            request.insert(QString("cmd"), QString("cancel"));
+            request.insert(QString("id"), parser.value(cancelOption).toInt());
+        }
+        else{
+            request.insert(QString("cmd"), QString("status"));
+            if(parser.value(statusOption).toInt() > 0){
+                request.insert(QString("id"), parser.value(statusOption).toInt());
+            }
+        }
+
+        QString name = parser.isSet(socketOption) ? parser.value(socketOption) : MailDaemon::defaultName();
+        QVariantMap reply;
+        QString error;
+        if(!MailDaemon::request(name, request, &reply, &error)){
+            err << error << endl;
+            return 1;
+        }
+        QTextStream(stdout) << QJsonDocument(QJsonObject::fromVariantMap(reply)).toJson(QJsonDocument::Indented);
+
+        return reply.value(QString("ok")).toBool() ? 0 : 1;
+    }
+
     QApplication a(argc, argv);
+    a.setOrganizationName(APPLICATION_COMPANY_ABBR);
+    a.setApplicationName(APPLICATION_NAME_ABBR);
+    a.setApplicationVersion(APPLICATION_VERSION);
+
+    if(!parser.parse(a.arguments())){
+        err << parser.errorText() << endl;
+        return 1;
+    }
+
+    if(parser.isSet(helpOption)){
+        parser.showHelp();
+    }
+
+    Shard shard;
+    if(parser.isSet(shardOption) && !shard.parse(parser.value(shardOption))){
+        err << "Invalid shard " << parser.value(shardOption) << ", expected i/N with 1 <= i <= N." << endl;
+        return 1;
+    }
+
     MainWindow w;
+    w.setShard(shard);
     w.show();
 
     return a.exec();
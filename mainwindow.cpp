@@ -21,11 +21,21 @@
 #include <QRegExp>
 #include <QStringRef>
 
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTimer>
+#include <QThread>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+
 #include <mimetext.h>
 #include <mimeattachment.h>
 
-#include <QtXlsx>
-#include "xlsxsheetmodel.h"
+#include "snapshotmodel.h"
+#include "sqlsource.h"
+#include "csvsource.h"
+#include "xlsxsource.h"
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent)
@@ -36,6 +46,15 @@ MainWindow::MainWindow(QWidget *parent) :
     /* Make sure the SMTP connection pointer is NULL. */
     m_SMTPConnection = NULL;
 
+    /* No batch is running. */
+    m_batchTimer = NULL;
+
+    /* Compile the template when it is first used. */
+    m_mailTemplateDirty = true;
+
+    /* qrand() starts from the same seed in every thread: a different retry jitter every run. */
+    qsrand((uint)QDateTime::currentMSecsSinceEpoch() ^ (uint)(quintptr)QThread::currentThreadId());
+
     /* Dockwidgets options. */
     setDockNestingEnabled(true);
     setAnimated(true);
@@ -67,6 +86,9 @@ MainWindow::MainWindow(QWidget *parent) :
     loadSettings();
     updateSheet();
 
+    /* Once the window is shown, check for an interrupted batch. */
+    QTimer::singleShot(0, this, SLOT(resumeInterruptedBatch()));
+
 }
 
 /*
@@ -76,6 +98,24 @@ MainWindow::MainWindow(QWidget *parent) :
  */
 MainWindow::~MainWindow(){
 
+    /* Stop the connections that are still being set up. */
+    m_relays.clear();
+
+}
+
+/* The selection only keeps the recipients of the shard. */
+void MainWindow::setShard(const Shard &shard){
+
+    m_shard = shard;
+
+    QString title = tr("Qt XLSX Email Generator [Hogeschool Rotterdam]");
+    if(!m_shard.isAll()){
+        title += tr(" - shard ") + m_shard.toString();
+    }
+    this->setWindowTitle(title);
+
+    updateInfo();
+
 }
 
 /*
@@ -227,6 +267,17 @@ void MainWindow::createSettingsWidget(){
                                         "parameters on exit. When not checked,\n"
                                         "these values are automatically saved."));
     m_saveOnExitCheckBox->setChecked(false);
+    m_exportTrace = new QCheckBox(tr("Export timing trace"), m_settingsWidget);
+    m_exportTrace->setToolTip(tr("Save the timing of every phase of a batch as\n"
+                                 "a Chrome trace-event file (chrome://tracing).\n"
+                                 "The location is shown when the batch is done."));
+    m_exportTrace->setChecked(false);
+    m_bccDigest = new QCheckBox(tr("Bcc digest"), m_settingsWidget);
+    m_bccDigest->setToolTip(tr("Send the Bcc addresses one digest with all\n"
+                               "mails after the batch, instead of a copy\n"
+                               "of every mail."));
+    m_bccDigest->setChecked(false);
+    connect(m_bccDigest, SIGNAL(stateChanged(int)), this, SLOT(updateText()));
 
     m_toggleSettingsAnimation = new QPropertyAnimation(m_settingsWidget, "maximumWidth");
     m_toggleSettingsAnimation->setDuration(500);
@@ -256,6 +307,8 @@ void MainWindow::createSettingsWidget(){
     settingsLayout->addWidget(m_runtimeValidate, 0, 2);
     settingsLayout->addWidget(m_validateHR, 1, 2);
     settingsLayout->addWidget(m_saveOnExitCheckBox, 2, 2);
+    settingsLayout->addWidget(m_exportTrace, 2, 1);
+    settingsLayout->addWidget(m_bccDigest, 3, 2);
 
 }
 
@@ -276,11 +329,50 @@ void MainWindow::createSMTPWidget(){
     m_SMTPport = new QLineEdit(tr(""), m_SMTPWidget);
     m_SMTPport->setValidator(new QIntValidator(1, 65535, m_SMTPport));
 
+    /* Relays next to the server above, which is the first one. */
+    m_SMTPrelays = new QLineEdit(tr(""), m_SMTPWidget);
+    m_SMTPrelays->setPlaceholderText(tr("none"));
+    m_SMTPrelays->setToolTip(tr("More SMTP servers to spread the mails over, e.g.\n"
+                                "  smtp2.hr.nl*2, backup.hr.nl:587/tls*0\n\n"
+                                "host[:port][/ssl|tls|tcp][*weight], the port and type\n"
+                                "default to the ones above. A server gets mail in\n"
+                                "proportion to its weight (also allowed for the server\n"
+                                "above), less when it is slow or failing. Weight 0 is\n"
+                                "a backup, used only when the others are down.\n\n"
+                                "All servers use the same login."));
+
     m_SMTPtype = new QComboBox(m_SMTPWidget);
     m_SMTPtype->addItem(tr("SSL"), SmtpClient::SslConnection);
     m_SMTPtype->addItem(tr("TLS"), SmtpClient::TlsConnection);
     m_SMTPtype->addItem(tr("TCP"), SmtpClient::TcpConnection);
 
+    /* Rate limits of the relay. */
+    m_SMTPmaxMessages = new QLineEdit(tr("0"), m_SMTPWidget);
+    m_SMTPmaxMessages->setValidator(new QIntValidator(0, 100000, m_SMTPmaxMessages));
+    m_SMTPmaxMessages->setToolTip(tr("Maximum number of mails per minute\n"
+                                     "the SMTP server accepts (0 = no limit).\n\n"
+                                     "Sending slows down automatically when the\n"
+                                     "server starts deferring mails or slows down."));
+    m_SMTPmaxKBytes = new QLineEdit(tr("0"), m_SMTPWidget);
+    m_SMTPmaxKBytes->setValidator(new QIntValidator(0, 10000000, m_SMTPmaxKBytes));
+    m_SMTPmaxKBytes->setToolTip(tr("Maximum number of kB per minute\n"
+                                   "the SMTP server accepts (0 = no limit)."));
+
+    /* Identical mails share one transaction, up to this many recipients; off by default. */
+    m_SMTPmaxRecipients = new QLineEdit(tr("1"), m_SMTPWidget);
+    m_SMTPmaxRecipients->setValidator(new QIntValidator(1, 1000, m_SMTPmaxRecipients));
+    m_SMTPmaxRecipients->setToolTip(tr("Mails with exactly the same text and attachments\n"
+                                       "are sent once, to up to this many recipients\n"
+                                       "(1 = every mail on its own).\n\n"
+                                       "The To header of such a mail lists all its\n"
+                                       "recipients, so they see each other."));
+
+    QHBoxLayout *rateLayout = new QHBoxLayout();
+    rateLayout->addWidget(m_SMTPmaxMessages);
+    rateLayout->addWidget(new QLabel(tr("mails"), m_SMTPWidget));
+    rateLayout->addWidget(m_SMTPmaxKBytes);
+    rateLayout->addWidget(new QLabel(tr("kB"), m_SMTPWidget));
+
     QPushButton *SMTPConnectButton = new QPushButton(tr("SMTP Connect"), m_SMTPWidget);
     SMTPConnectButton->setToolTip(tr("Connect to the SMTP server now."));
     connect(SMTPConnectButton, SIGNAL(clicked()), this, SLOT(SMTPconnect()));
@@ -300,8 +392,14 @@ void MainWindow::createSMTPWidget(){
     smtpSettingsLayout->addWidget(m_SMTPserver, 0, 2);
     smtpSettingsLayout->addWidget(new QLabel(tr("SMTP port:"), m_SMTPWidget), 1, 1);
     smtpSettingsLayout->addWidget(m_SMTPport, 1, 2);
-    smtpSettingsLayout->addWidget(m_SMTPtype, 2, 1);
-    smtpSettingsLayout->addWidget(SMTPConnectButton, 2, 2);
+    smtpSettingsLayout->addWidget(new QLabel(tr("More relays:"), m_SMTPWidget), 2, 1);
+    smtpSettingsLayout->addWidget(m_SMTPrelays, 2, 2);
+    smtpSettingsLayout->addWidget(m_SMTPtype, 3, 1);
+    smtpSettingsLayout->addWidget(SMTPConnectButton, 3, 2);
+    smtpSettingsLayout->addWidget(new QLabel(tr("Max/min:"), m_SMTPWidget), 4, 1);
+    smtpSettingsLayout->addLayout(rateLayout, 4, 2);
+    smtpSettingsLayout->addWidget(new QLabel(tr("Rcpt/mail:"), m_SMTPWidget), 5, 1);
+    smtpSettingsLayout->addWidget(m_SMTPmaxRecipients, 5, 2);
 
     m_SMTPWidget->setLayout(smtpSettingsLayout);
 
@@ -344,6 +442,7 @@ void MainWindow::createEditorWidget(){
 
     /* Connect signals for close, update and rename. */
     connect(m_textTab, SIGNAL(tabCloseRequested(int)), this, SLOT(closeTab(int)));
+    connect(m_textTab, SIGNAL(currentChanged(int)), this, SLOT(invalidateMailTemplate()));
     connect(m_textTab, SIGNAL(currentChanged(int)), this, SLOT(updateText()));
     connect(m_textTab, SIGNAL(tabBarDoubleClicked(int)), this, SLOT(renameTab(int)));
 
@@ -502,13 +601,13 @@ void MainWindow::createPreviewWidget(){
     createMailSelectWidget();
 
     /* The button to send the mails. */
-    QPushButton *sendMailsButton = new QPushButton(tr("Send mails"), m_mailSelectWidget);
-    sendMailsButton->setToolTip(tr("Pressing this button will check if everything is OK.\n\n"
+    m_sendMailsButton = new QPushButton(tr("Send mails"), m_mailSelectWidget);
+    m_sendMailsButton->setToolTip(tr("Pressing this button will check if everything is OK.\n\n"
                                    "If not OK, it will display an error message.\n\n"
                                    "If OK, it will connect to the SMTP server if there \n"
                                    "is no connection yet and tries to send the e-mails.\n\n"
                                    "Finally, a message will be displayed with the result."));
-    connect(sendMailsButton, SIGNAL(clicked()), this, SLOT(sendMails()));
+    connect(m_sendMailsButton, SIGNAL(clicked()), this, SLOT(sendMails()));
 
     /* Set it all in the layouts. */
     previewSelectionLayout->addWidget(new QLabel(tr("Preview:"), m_previewDW));
@@ -517,7 +616,7 @@ void MainWindow::createPreviewWidget(){
     previewSelectionLayout->addWidget(m_nMailsDisplay);
     previewBoxLayout->addLayout(previewSelectionLayout);
     previewBoxLayout->addWidget(m_previewText);
-    previewBoxLayout->addWidget(sendMailsButton);
+    previewBoxLayout->addWidget(m_sendMailsButton);
 
     previewWidgetLayout->addWidget(m_mailSelectWidget);
     previewWidgetLayout->addWidget(m_mailSelectWidgetToggleButton);
@@ -573,6 +672,25 @@ void MainWindow::createMailSelectWidget(){
                                      "email address, this field should be empty."));
     connect(m_emailAppendText, SIGNAL(textChanged(QString)), this, SLOT(updateText()));
 
+    /* Only rows whose mail differs from the one delivered last time. */
+    m_changedOnly = new QCheckBox(tr("Changed only"), m_mailSelectWidget);
+    m_changedOnly->setToolTip(tr("Only select the rows where the mail is different\n"
+                                 "from the mail delivered before with the same\n"
+                                 "course code and subject.\n\n"
+                                 "Text and attachments are compared."));
+    connect(m_changedOnly, SIGNAL(toggled(bool)), this, SLOT(updateInfo()));
+
+    /* The selection depends on the rendered mails, so on everything that goes into them. */
+    m_changedOnlyTimer = new QTimer(this);
+    m_changedOnlyTimer->setSingleShot(true);
+    m_changedOnlyTimer->setInterval(MAINWINDOW_CHANGED_ONLY_DELAY_MS);
+    connect(m_changedOnlyTimer, SIGNAL(timeout()), this, SLOT(updateInfo()));
+    connect(m_emailSubject, SIGNAL(textChanged(QString)), this, SLOT(invalidateChangedOnly()));
+    connect(m_courseCode, SIGNAL(textChanged(QString)), this, SLOT(invalidateChangedOnly()));
+    connect(m_emailAppendText, SIGNAL(textChanged(QString)), this, SLOT(invalidateChangedOnly()));
+    connect(m_emailColumnSelect, SIGNAL(currentTextChanged(QString)), this, SLOT(invalidateChangedOnly()));
+    connect(m_textTab, SIGNAL(currentChanged(int)), this, SLOT(invalidateChangedOnly()));
+
     /* Define animation for adjusting the maximumWidth of the widget. */
     m_toggleMailSelectAnimation = new QPropertyAnimation(m_mailSelectWidget, "maximumWidth");
     m_toggleMailSelectAnimation->setDuration(500);
@@ -603,11 +721,12 @@ void MainWindow::createMailSelectWidget(){
     mailSelectLayout->addWidget(m_emailColumnSelect, 3, 1);
     mailSelectLayout->addWidget(new QLabel(tr("and append:"), m_mailSelectWidget), 4, 0);
     mailSelectLayout->addWidget(m_emailAppendText, 4, 1);
-    mailSelectLayout->addWidget(line1, 5, 0, 1, 2);
-    mailSelectLayout->setRowStretch(6, 40);
-    mailSelectLayout->addWidget(m_attachmentWidgetToggleButton, 7, 0, 1, 2);
-    mailSelectLayout->addWidget(m_attachmentWidget, 8, 0, 1, 2);
-    mailSelectLayout->setRowMinimumHeight(8, 0);
+    mailSelectLayout->addWidget(m_changedOnly, 5, 0, 1, 2);
+    mailSelectLayout->addWidget(line1, 6, 0, 1, 2);
+    mailSelectLayout->setRowStretch(7, 40);
+    mailSelectLayout->addWidget(m_attachmentWidgetToggleButton, 8, 0, 1, 2);
+    mailSelectLayout->addWidget(m_attachmentWidget, 9, 0, 1, 2);
+    mailSelectLayout->setRowMinimumHeight(9, 0);
 
     /* Set layout. */
     m_mailSelectWidget->setLayout(mailSelectLayout);
@@ -694,9 +813,18 @@ void MainWindow::createXlsxViewerWidget(){
                                         "in addition to those already loaded.\n"
                                         "The last sheet loaded will be active."));
     connect(m_loadXlsxFileButton, SIGNAL(clicked()), this, SLOT(loadSheet()));
+    /* Button to add the result of a database query as a tab. */
+    m_loadDatabaseButton = new QToolButton(m_xlsxTab);
+    m_loadDatabaseButton->setText(tr("Load database"));
+    m_loadDatabaseButton->setToolTip(tr("Select an SQLite database from your computer\n"
+                                        "and a query. The result is loaded as a sheet,\n"
+                                        "with the names of the columns in row 1."));
+    connect(m_loadDatabaseButton, SIGNAL(clicked()), this, SLOT(loadDatabase()));
+
     m_xlsxTab->addTab(new QWidget(m_xlsxTab), tr(""));
     m_xlsxTab->setTabEnabled(0, false);
     m_xlsxTab->tabBar()->setTabButton(0, QTabBar::RightSide, m_loadXlsxFileButton);
+    m_xlsxTab->tabBar()->setTabButton(0, QTabBar::LeftSide, m_loadDatabaseButton);
 
     xlsxWidgetLayout->addWidget(m_xlsxTab);
 
@@ -749,6 +877,8 @@ void MainWindow::createToolBar(){
 /* Return textversion of mail header. */
 QString MainWindow::getMailHeader(int offset){
 
+    ScopedTimer t(m_batchTimer, "render.header");
+
     QString txt;
     QStringList bcc_addresses = m_emailBcc->text().split(";");
 
@@ -756,10 +886,10 @@ QString MainWindow::getMailHeader(int offset){
     txt += tr("From: ") + m_senderName->text() + tr(" <") + m_senderEmail->text() +  tr(">\n");
     txt += tr("To: <") + getData(m_emailColumnSelect->currentText(), offset) + m_emailAppendText->text() + tr(">\n");
 
-    /* BCC. */
+    /* BCC, or only in the digest after the batch. */
     foreach(QString bcc, bcc_addresses){
         if(!bcc.isEmpty()){
-            txt += tr("Bcc: <") + bcc + tr(">\n");
+            txt += (m_bccDigest->isChecked() ? tr("Bcc digest: <") : tr("Bcc: <")) + bcc + tr(">\n");
         }
     }
 
@@ -807,107 +937,96 @@ QString MainWindow::getMailHeader(int offset){
 /* Parses the text from the editor to fill with values from the spreadsheet. */
 QString MainWindow::getMailText(int offset){
 
-    /* Get text from editor */
-    QString txt = tr("");
-    QTextEdit *te = qobject_cast<QTextEdit*>(m_textTab->currentWidget());
-    if(te != NULL){
-        txt = te->toPlainText();
-    }
+    ScopedTimer t(m_batchTimer, "render.text");
 
-    /* Regexp to find all alphanumeric values between ## */
-    QRegExp re("#([A-Z,a-z,0-9]*)#");
+    /* The template is parsed once, only the values are looked up per mail. */
+    const MailTemplate &tpl = mailTemplate();
 
     /* Result text. */
     QString res;
+    res.reserve(tpl.literalLength() + 16 * tpl.segments().count());
 
-    /* Match all values to be extracted from spreadsheet. */
-    int lastpos = 0;
-    int pos = 0;
-    while((pos = re.indexIn(txt, pos)) != -1){
-        /* Add part between last match and new match as-is. */
-        res.append(txt.mid(lastpos, pos-lastpos));
+    foreach(const TemplateSegment &seg, tpl.segments()){
+        switch(seg.type){
+          case TemplateSegment::Literal:
+            res.append(seg.text);
+            break;
+          case TemplateSegment::Cell:
+            /* Rows can be static or dynamic. */
+            res.append(getData(seg.row == 0 ? offset : seg.row, seg.col));
+            break;
+          default:
+            res.append(QString("[INV_REF!]"));
+            break;
+        }
+    }
 
-        /* extract the matched text. */
-        QString cell = re.cap(1);
+    /* Return the parsed text. */
+    return res;
+}
 
-        /* Get data. */
-        res.append(getData(cell, offset));
+/* Compile the template of the current editor tab again if it changed. */
+const MailTemplate &MainWindow::mailTemplate(){
 
-        /* Keep positions between matches. */
-        pos += re.matchedLength();
-        lastpos = pos;
+    if(m_mailTemplateDirty){
+        QTextEdit *te = qobject_cast<QTextEdit*>(m_textTab->currentWidget());
+        m_mailTemplate.compile(te != NULL ? te->toPlainText() : tr(""));
+        m_mailTemplateDirty = false;
     }
 
-    /* Add the remaining part of the text. */
-    res.append(txt.mid(lastpos, txt.length()-lastpos));
+    return m_mailTemplate;
 
-    /* Return the parsed text. */
-    return res;
 }
 
-/* Parse cell and get data from spreadsheet. */
-QString MainWindow::getData(QString cell, int offset)
-{
-    /* Extract column and row. */
-    QRegExp regex("([A-Z,a-z]+)([0-9]*)");
+void MainWindow::invalidateMailTemplate(){
 
-    if(regex.indexIn(cell, 0) != -1){
+    m_mailTemplateDirty = true;
 
-        /* Column. Convert to uppercase. */
-        QString colText = regex.cap(1).toUpper();
+}
 
-        /* Row. */
-        QString rowText = regex.cap(2);
+void MainWindow::invalidateChangedOnly(){
 
-        /* Rows can be static or dynamic. */
-        int row = 0;
-        if(rowText.isEmpty()){
-            row = offset;
-        }
-        else{
-            row = rowText.toInt();
-        }
+    if(m_changedOnly->isChecked()){
+        m_changedOnlyTimer->start();
+    }
 
-        /*
-         * Columns are [a-z] and should be parsed to an integer.
-         *
-         * The integer value is the ascii value minus the ascii value
-         * of character 'A' + 1. The position adds a power of 26.
-         *
-         * Currently we can parse columns up to length 4.
-         *
-         * TODO: find a more generic algorithm.
-         */
-        int col = 0;
-        switch(colText.length()){
-          case 4:
-            col = (qPow(26, 3) * (colText.data()[0].toLatin1() - 'A' + 1)) +
-                  (qPow(26, 2) * (colText.data()[1].toLatin1() - 'A' + 1)) +
-                  (qPow(26, 1) * (colText.data()[2].toLatin1() - 'A' + 1)) +
-                  (qPow(26, 0) * (colText.data()[3].toLatin1() - 'A' + 1));
-            break;
-          case 3:
-            col = (qPow(26, 2) * (colText.data()[0].toLatin1() - 'A' + 1)) +
-                  (qPow(26, 1) * (colText.data()[1].toLatin1() - 'A' + 1)) +
-                  (qPow(26, 0) * (colText.data()[2].toLatin1() - 'A' + 1));
-            break;
-          case 2:
-            col = (qPow(26, 1) * (colText.data()[0].toLatin1() - 'A' + 1)) +
-                  (qPow(26, 0) * (colText.data()[1].toLatin1() - 'A' + 1));
-            break;
-          case 1:
-            col = colText.data()[0].toLatin1() - 'A' + 1;
-            break;
-          default:
-            return QString("[INV_REF!]");
-        }
+}
+
+/*
+ * Mail text and attachments (name, size and date) of a row. The subject
+ * is not included, the history is kept per subject.
+ */
+QByteArray MainWindow::mailHash(int offset, const QByteArray &mailText){
 
-        /* Get the data at row, col. */
-        return getData(row, col);
+    QStringList files;
+    for(int i = 0; i < m_attachments->count(); i++){
+        files.append(m_attachments->itemData(i).toString());
+    }
+    if(m_attachmentColSelect->currentText() != tr("<none>")){
+        files.append(m_attachmentDirectory + QDir::separator() + getData(m_attachmentColSelect->currentText(), offset) + m_attachmentAppend->text());
     }
 
-    /* Return invalid if we cannot parse this cell properly. */
-    return QString("[INV_REF!]");
+    return SendHistory::mailHash(mailText, files);
+
+}
+
+/* Parse cell and get data from spreadsheet. */
+QString MainWindow::getData(QString cell, int offset)
+{
+    /* Extract column and row. */
+    int row, col;
+    if(!MailTemplate::parseCell(cell, &row, &col)){
+        /* Return invalid if we cannot parse this cell properly. */
+        return QString("[INV_REF!]");
+    }
+
+    /* Rows can be static or dynamic. */
+    if(row == 0){
+        row = offset;
+    }
+
+    /* Get the data at row, col. */
+    return getData(row, col);
 }
 
 /* Extracts the data from the spreadsheet at row,col */
@@ -928,18 +1047,55 @@ QString MainWindow::getData(int row, int col){
     return(d->model()->data(d->model()->index(row-1, col-1)).toString());
 }
 
+/* Keep the UI responsive while waiting, e.g. between reconnect attempts. */
+void MainWindow::waitFor(int msecs){
+
+    QEventLoop loop;
+    QTimer::singleShot(msecs, &loop, SLOT(quit()));
+    loop.exec(QEventLoop::ExcludeUserInputEvents);
+
+}
+
+/* Messages/s, bytes/s, ETA and tail latencies of the running batch. */
+QString MainWindow::sendStatistics(int sent, int total, qint64 elapsedMs){
+
+    if(m_SMTPConnection == NULL || sent == 0 || elapsedMs <= 0){
+        return tr("");
+    }
+
+    double seconds = elapsedMs / 1000.0;
+    double rate = sent / seconds;
+    int eta = (int)((total - sent) / rate);
+
+    /* Over all relays, not only the one used last. */
+    LatencyHistogram data = m_relays.histogram(SmtpSession::EndOfData);
+    LatencyHistogram rcpt = m_relays.histogram(SmtpSession::RcptTo);
+
+    return QString::number(rate, 'f', 1) + tr(" messages/s, ") +
+           QString::number(m_relays.bytesSent() / 1024.0 / seconds, 'f', 1) + tr(" kB/s, ETA ") +
+           QString(tr("%1:%2")).arg(eta / 60).arg(eta % 60, 2, 10, QChar('0')) + tr("\n") +
+           tr("DATA p50/p95/p99: ") + QString::number(data.percentile(50) / 1000.0, 'f', 0) + tr("/") +
+                                      QString::number(data.percentile(95) / 1000.0, 'f', 0) + tr("/") +
+                                      QString::number(data.percentile(99) / 1000.0, 'f', 0) + tr(" ms, ") +
+           tr("RCPT p99: ") + QString::number(rcpt.percentile(99) / 1000.0, 'f', 0) + tr(" ms");
+
+}
+
 /* Validate email address. */
 bool MainWindow::isValidEmail(QString address){
+    ScopedTimer t(m_batchTimer, "validate.email");
     return QRegExp("[A-Z0-9._%+-]+@[A-Z0-9.-]+\\.[A-Z0-9-]{2,63}", Qt::CaseInsensitive).exactMatch(address);
 }
 
 /* Validate HR student email address. */
 bool MainWindow::isValidHRStudentEmail(QString address){
+    ScopedTimer t(m_batchTimer, "validate.email");
     return QRegExp("\\d{7}@hr.nl", Qt::CaseInsensitive).exactMatch(address);
 }
 
 /* Validate HR employee email address. */
 bool MainWindow::isValidHREmployeeEmail(QString address){
+    ScopedTimer t(m_batchTimer, "validate.email");
     return QRegExp("[a-z]{5}@hr.nl", Qt::CaseInsensitive).exactMatch(address);
 }
 
@@ -957,6 +1113,8 @@ void MainWindow::saveSettings(){
     s->setValue(tr("saveOnExit"), m_saveOnExitCheckBox->isChecked());
     s->setValue(tr("validateHR"), m_validateHR->isChecked());
     s->setValue(tr("runtimeValidate"), m_runtimeValidate->isChecked());
+    s->setValue(tr("exportTrace"), m_exportTrace->isChecked());
+    s->setValue(tr("bccDigest"), m_bccDigest->isChecked());
 
     /* Email parameters. */
     s->setValue(tr("senderName"), m_senderName->text());
@@ -967,7 +1125,11 @@ void MainWindow::saveSettings(){
     s->setValue(tr("courseCode"), m_courseCode->text());
     s->setValue(tr("SMTPserver"), m_SMTPserver->text());
     s->setValue(tr("SMTPport"), m_SMTPport->text());
+    s->setValue(tr("SMTPrelays"), m_SMTPrelays->text());
     s->setValue(tr("SMTPtype"), m_SMTPtype->currentText());
+    s->setValue(tr("SMTPmaxMessages"), m_SMTPmaxMessages->text());
+    s->setValue(tr("SMTPmaxKBytes"), m_SMTPmaxKBytes->text());
+    s->setValue(tr("SMTPmaxRecipients"), m_SMTPmaxRecipients->text());
 
     /* Texts. */
     s->beginWriteArray(tr("mailTexts"));
@@ -998,6 +1160,8 @@ void MainWindow::loadSettings(){
     m_saveOnExitCheckBox->setChecked(s->value(tr("saveOnExit"), QVariant(false)).toBool());
     m_validateHR->setChecked(s->value(tr("validateHR"), QVariant(true)).toBool());
     m_runtimeValidate->setChecked(s->value(tr("runtimeValidate"), QVariant(true)).toBool());
+    m_exportTrace->setChecked(s->value(tr("exportTrace"), QVariant(false)).toBool());
+    m_bccDigest->setChecked(s->value(tr("bccDigest"), QVariant(false)).toBool());
 
     /* Email parameters. */
     m_senderName->setText(s->value(tr("senderName"), tr("")).toString());
@@ -1008,7 +1172,11 @@ void MainWindow::loadSettings(){
     m_courseCode->setText(s->value(tr("courseCode"), tr("")).toString());
     m_SMTPserver->setText(s->value(tr("SMTPserver"), tr("smtp.hr.nl")).toString());
     m_SMTPport->setText(s->value(tr("SMTPport"), tr("465")).toString());
+    m_SMTPrelays->setText(s->value(tr("SMTPrelays"), tr("")).toString());
     m_SMTPtype->setCurrentText(s->value(tr("SMTPtype"), tr("SSL")).toString());
+    m_SMTPmaxMessages->setText(s->value(tr("SMTPmaxMessages"), tr("0")).toString());
+    m_SMTPmaxKBytes->setText(s->value(tr("SMTPmaxKBytes"), tr("0")).toString());
+    m_SMTPmaxRecipients->setText(s->value(tr("SMTPmaxRecipients"), tr("1")).toString());
 
     /* Texts. */
     int num = s->beginReadArray(tr("mailTexts"));
@@ -1290,41 +1458,260 @@ void MainWindow::selectAttachmentDirectory(){
 void MainWindow::loadSheet(){
 
     /* Ask for the file. */
-    QString filePath = QFileDialog::getOpenFileName(0, "Open xlsx file", QString(), "*.xlsx");
+    QString filePath = QFileDialog::getOpenFileName(0, "Open xlsx file", QString(), "Sheets (*.xlsx *.csv *.tsv *.txt)");
     if(filePath.isEmpty()){
         return;
     }
 
-    /* Open the document. */
-    QXlsx::Document *xlsx = new QXlsx::Document(filePath, m_xlsxTab);
+    loadWorkbook(filePath);
 
-    /* Add add sheets (tabs) to the viewer. */
-    foreach(QString sheetName, xlsx->sheetNames()){
+}
 
-        /* Load sheet */
-        QXlsx::Worksheet *sheet = dynamic_cast<QXlsx::Worksheet *>(xlsx->sheet(sheetName));
-        if(sheet){
+void MainWindow::loadDatabase(){
 
-            /* Create a tableview for this sheet. */
-            QTableView *view = new QTableView(m_xlsxTab);
-            view->setToolTip(tr("This is the data (read-only) from the selected sheet\n"
-                                "that will be used to generate the e-mail from."));
+    /* Ask for the file. */
+    QString database = QFileDialog::getOpenFileName(0, tr("Open SQLite database"), QString(), tr("*.sqlite *.sqlite3 *.db"));
+    if(database.isEmpty()){
+        return;
+    }
 
-            /* Set to read-only. */
-            view->setEditTriggers(QAbstractItemView::NoEditTriggers);
-            view->setModel(new QXlsx::SheetModel(sheet, view));
+    SqlSource source;
+    QString error;
+    if(!source.open(database, &error)){
+        QMessageBox::warning(this, tr("Error:"), error);
+        return;
+    }
 
-            /* Handle merged cells. */
-            foreach (QXlsx::CellRange range, sheet->mergedCells()){
-                view->setSpan(range.firstRow()-1, range.firstColumn()-1, range.rowCount(), range.columnCount());
-            }
+    /* Ask for the query, all of the first table to start with. */
+    QStringList tables = source.tables();
+    bool ok;
+    QString query = QInputDialog::getMultiLineText(this, tr("Query"), tr("The query for the mails, one mail per row:"),
+                                                   tables.isEmpty() ? tr("") : tr("SELECT * FROM \"") + tables.first() + tr("\""), &ok);
+    if(!ok || query.trimmed().isEmpty()){
+        return;
+    }
+
+    QStringList columns = source.columns(query, &error);
+    if(columns.isEmpty()){
+        QMessageBox::warning(this, tr("Error:"), tr("The query failed: ") + error);
+        return;
+    }
 
-            /* Add sheet as a tab to viewer. */
-            int tabIndex = m_xlsxTab->addTab(view, sheetName);
-            m_xlsxTab->setCurrentIndex(tabIndex);
+    /* Only some recipients: filtered by the database, not after loading. */
+    QString all = tr("<all rows>");
+    QString filterColumn = QInputDialog::getItem(this, tr("Recipients"), tr("Only the rows where this column is one of the recipients:"),
+                                                 QStringList(all) + columns, 0, false, &ok);
+    if(!ok){
+        return;
+    }
+
+    QStringList recipients;
+    if(filterColumn != all){
+        QString values = QInputDialog::getMultiLineText(this, tr("Recipients"),
+                                                        tr("The values of ") + filterColumn + tr(", one per line or separated by ';':"),
+                                                        tr(""), &ok);
+        if(!ok){
+            return;
         }
+        recipients = values.split(QRegExp(tr("[;\\n]")), QString::SkipEmptyParts);
+        for(int i = 0; i < recipients.count(); i++){
+            recipients[i] = recipients[i].trimmed();
+        }
+        recipients.removeAll(tr(""));
+    }
+    else{
+        filterColumn.clear();
     }
 
+    source.close();
+    loadQuery(database, query, filterColumn, recipients);
+
+}
+
+bool MainWindow::loadQuery(const QString &database, const QString &query, const QString &filterColumn, const QStringList &recipients){
+
+    SqlSource source;
+    SheetSnapshot snapshot;
+    QString error;
+    if(!source.open(database, &error) || !source.load(query, &snapshot, &error, filterColumn, recipients)){
+        QMessageBox::warning(this, tr("Error:"), tr("The database ") + database + tr(" can not be loaded: ") + error);
+        return false;
+    }
+
+    /* Create a tableview for the result. */
+    QTableView *view = new QTableView(m_xlsxTab);
+    view->setToolTip(tr("This is the data (read-only) from the database query\n"
+                        "that will be used to generate the e-mail from."));
+    view->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    view->setModel(new SnapshotModel(snapshot, view));
+
+    /* Remember where it came from, e.g. for the batch journal. */
+    view->setProperty("workbook", database);
+    view->setProperty("query", query);
+    view->setProperty("filterColumn", filterColumn);
+    view->setProperty("recipients", recipients);
+
+    int tabIndex = m_xlsxTab->addTab(view, QFileInfo(database).completeBaseName());
+    m_xlsxTab->setCurrentIndex(tabIndex);
+
+    return true;
+
+}
+
+/* Load all sheets of an xlsx file, returns false if there are none. */
+bool MainWindow::loadWorkbook(QString filePath){
+
+    bool loaded = false;
+
+    /* CSV and TSV files have one sheet, read by CsvSource. */
+    if(CsvSource::handles(filePath)){
+        SheetSnapshot snapshot;
+        QString error;
+        if(!CsvSource::load(filePath, &snapshot, &error)){
+            QMessageBox::warning(this, tr("Error:"), error);
+            return false;
+        }
+
+        QTableView *view = new QTableView(m_xlsxTab);
+        view->setToolTip(tr("This is the data (read-only) from the selected file\n"
+                            "that will be used to generate the e-mail from."));
+        view->setEditTriggers(QAbstractItemView::NoEditTriggers);
+        view->setModel(new SnapshotModel(snapshot, view));
+        view->setProperty("workbook", filePath);
+
+        int tabIndex = m_xlsxTab->addTab(view, QFileInfo(filePath).completeBaseName());
+        m_xlsxTab->setCurrentIndex(tabIndex);
+
+        return true;
+    }
+
+    /* Open the workbook; the sheets are parsed in parallel and shown when ready. */
+    XlsxSource *source = new XlsxSource(filePath, this);
+    QString error;
+    if(!source->open(&error)){
+        QMessageBox::warning(this, tr("Error:"), error);
+        delete source;
+        return false;
+    }
+
+    /* Add all sheets (tabs) to the viewer, empty until parsed. */
+    QStringList sheetNames = source->sheetNames();
+    int tabIndex = 0;
+    for(int i = 0; i < sheetNames.count(); i++){
+
+        /* Create a tableview for this sheet. */
+        QTableView *view = new QTableView(m_xlsxTab);
+        view->setToolTip(tr("This is the data (read-only) from the selected sheet\n"
+                            "that will be used to generate the e-mail from."));
+
+        /* Set to read-only. */
+        view->setEditTriggers(QAbstractItemView::NoEditTriggers);
+        view->setModel(new SnapshotModel(SheetSnapshot(), view));
+
+        /* Remember where it came from, e.g. for the batch journal. */
+        view->setProperty("workbook", filePath);
+        view->setProperty("source", QVariant::fromValue((QObject *)source));
+        view->setProperty("sheet", i);
+        view->setProperty("loading", true);
+
+        /* Add sheet as a tab to viewer. */
+        tabIndex = m_xlsxTab->addTab(view, sheetNames.at(i));
+        loaded = true;
+    }
+
+    if(!loaded){
+        delete source;
+        return false;
+    }
+
+    /* The last sheet is the one shown, so it is parsed first. */
+    m_xlsxSources.append(source);
+    connect(source, SIGNAL(sheetReady(int)), this, SLOT(sheetLoaded(int)));
+    source->prioritize(sheetNames.count() - 1);
+    source->start();
+    m_xlsxTab->setCurrentIndex(tabIndex);
+
+    return loaded;
+
+}
+
+void MainWindow::sheetLoaded(int sheet){
+
+    /* A sheet of a workbook that is no longer loading, e.g. all its tabs were closed. */
+    XlsxSource *source = (XlsxSource *)sender();
+    if(!m_xlsxSources.contains(source)){
+        return;
+    }
+
+    for(int i = 1; i < m_xlsxTab->count(); i++){
+        QWidget *view = m_xlsxTab->widget(i);
+        if(view->property("source").value<QObject *>() == source && view->property("sheet").toInt() == sheet){
+            showSheet(view);
+            break;
+        }
+    }
+
+    releaseXlsxSources();
+
+}
+
+void MainWindow::showSheet(QWidget *view){
+
+    if(!view->property("loading").toBool()){
+        return;
+    }
+
+    XlsxSource *source = (XlsxSource *)view->property("source").value<QObject *>();
+    int sheet = view->property("sheet").toInt();
+
+    /* The data in place of the empty model. */
+    QTableView *table = (QTableView *)view;
+    QAbstractItemModel *empty = table->model();
+    table->setModel(new SnapshotModel(source->snapshot(sheet), table));
+    delete empty;
+    view->setProperty("loading", false);
+
+    /* Handle merged cells. */
+    foreach(QRect range, source->mergedCells(sheet)){
+        table->setSpan(range.y() - 1, range.x() - 1, range.height(), range.width());
+    }
+
+    if(!source->error(sheet).isEmpty()){
+        QMessageBox::warning(this, tr("Error:"), source->error(sheet));
+    }
+
+    /* The selection boxes follow the columns and rows of the shown sheet. */
+    if(view == m_xlsxTab->currentWidget()){
+        updateSheet();
+    }
+
+}
+
+/* A workbook without tabs that are still loading is done. */
+void MainWindow::releaseXlsxSources(){
+
+    for(int i = m_xlsxSources.count() - 1; i >= 0; i--){
+        bool loading = false;
+        for(int j = 1; j < m_xlsxTab->count() && !loading; j++){
+            QWidget *view = m_xlsxTab->widget(j);
+            loading = view->property("loading").toBool() && view->property("source").value<QObject *>() == m_xlsxSources.at(i);
+        }
+        if(!loading){
+            m_xlsxSources.takeAt(i)->deleteLater();
+        }
+    }
+
+}
+
+/* The selection of rows and columns, the preview and sending. */
+void MainWindow::setSelectionEnabled(bool enabled){
+
+    m_mailSelectWidget->setEnabled(enabled);
+    m_generateWidget->setEnabled(enabled);
+    m_attachmentWidget->setEnabled(enabled);
+    m_previewSelect->setEnabled(enabled);
+    m_sendMailsButton->setEnabled(enabled);
+
 }
 
 /* Slot called when selecting an onther sheet. */
@@ -1333,6 +1720,24 @@ void MainWindow::updateSheet(){
     /* Get a pointer to the data. */
     QTableView *d = (QTableView*)m_xlsxTab->currentWidget();
 
+    /* Another sheet or workbook ends a resume. */
+    if(m_skipSheet != m_xlsxTab->currentWidget()){
+        m_skipRows.clear();
+    }
+
+    /*
+     * A sheet that is still being parsed is parsed next. The selection
+     * boxes keep their values until it is shown, see showSheet(), but
+     * cannot be used or sent with: they belong to the previous sheet.
+     */
+    if(d != NULL && d->property("loading").toBool()){
+        ((XlsxSource *)d->property("source").value<QObject *>())->prioritize(d->property("sheet").toInt());
+        setSelectionEnabled(false);
+        m_previewText->setPlainText(tr("Loading sheet..."));
+        return;
+    }
+    setSelectionEnabled(true);
+
     /* Extract columns and rows. */
     QStringList columnNames;
     QStringList rowNames;
@@ -1405,16 +1810,41 @@ void MainWindow::updateInfo(){
         preview = m_previewSelect->currentText().toInt();
     }
 
+    /* History of this course and subject, when selecting changed mails only. */
+    bool changedOnly = m_changedOnly->isChecked() && max > 0;
+    if(changedOnly && !m_sendHistory.isLoaded(m_courseCode->text(), m_emailSubject->text())){
+        m_sendHistory.load(m_courseCode->text(), m_emailSubject->text());
+    }
+
     /* Remove items from selection boxes. */
     m_firstRowSelect->clear();
     m_lastRowSelect->clear();
     m_previewSelect->clear();
 
+    /* The mails are rendered from a snapshot of the sheet to compare them. */
+    SheetSnapshot sheet;
+    QByteArray mailText;
+    if(changedOnly){
+        QTableView *d = (QTableView*)m_xlsxTab->currentWidget();
+        sheet.load(d != NULL && m_xlsxTab->currentIndex() != 0 ? d->model() : NULL);
+    }
+
+    /* The delivered rows of a resumed batch only count on its own sheet. */
+    bool skipRows = !m_skipRows.isEmpty() && m_skipSheet == m_xlsxTab->currentWidget();
+
     /* Insert new items to selection boxes. */
     for(int i = 1; i <= max; i++){
         m_firstRowSelect->addItem(QString::number(i));
-        if(i >= start && i <= stop && !getData(m_emailColumnSelect->currentText(), i).isEmpty()){
-            m_previewSelect->addItem(QString::number(i));
+        if(i >= start && i <= stop && !(skipRows && m_skipRows.contains(i))){
+            QString address = getData(m_emailColumnSelect->currentText(), i);
+            bool inShard = !address.isEmpty() && m_shard.contains(address + m_emailAppendText->text());
+            if(changedOnly && inShard){
+                mailTemplate().render(sheet, i, &mailText);
+            }
+            if(inShard &&
+               !(changedOnly && m_sendHistory.unchanged(address + m_emailAppendText->text(), mailHash(i, mailText)))){
+                m_previewSelect->addItem(QString::number(i));
+            }
         }
         if(i >= start){
             m_lastRowSelect->addItem(QString::number(i));
@@ -1534,7 +1964,9 @@ void MainWindow::addNewTextTab(){
                            "Only values will be read from the spreadsheet, not the formatting,\n"
                            "so if you want to use rounded values use the ROUND() function\n"
                            "before loading the spreadsheet."));
+    connect(newText, SIGNAL(textChanged()), this, SLOT(invalidateMailTemplate()));
     connect(newText, SIGNAL(textChanged()), this, SLOT(updateText()));
+    connect(newText, SIGNAL(textChanged()), this, SLOT(invalidateChangedOnly()));
 
     int num = m_textTab->count() - 1;
     int newNum = 1;
@@ -1675,6 +2107,9 @@ void MainWindow::closeTab(int index){
     tw->removeTab(index);
     delete tab;
 
+    /* Stop parsing a workbook of which no tab is left. */
+    releaseXlsxSources();
+
 }
 
 /* Rename a tab in the editor. */
@@ -1704,10 +2139,25 @@ void MainWindow::renameTab(int index){
 
 /* Connect to SMTP server. */
 void MainWindow::SMTPconnect(){
-    bool ok;
 
-    /* Get servername. */
-    QString smtpServer = m_SMTPserver->text();
+    /* The handshake runs while the user types the credentials. */
+    SMTPstartConnect();
+
+    if(!SMTPaskCredentials()){
+        SMTPdisconnect();
+        return;
+    }
+
+    SMTPfinishConnect();
+
+}
+
+/* Connect, greet and STARTTLS on worker threads, one per relay; no credentials needed yet. */
+void MainWindow::SMTPstartConnect(){
+
+    if(m_SMTPConnection != NULL || m_relays.isConnecting()){
+        return;
+    }
 
     /* Get portnumber. */
     int smtpPort = m_SMTPport->text().toInt();
@@ -1715,93 +2165,301 @@ void MainWindow::SMTPconnect(){
     /* Get connection type. */
     SmtpClient::ConnectionType smtpType = static_cast<SmtpClient::ConnectionType>(m_SMTPtype->currentData().toInt());
 
-    /* Lib likes to throw exceptions... */
-    try {
-        /* Try to set values. */
-        m_SMTPConnection = new SmtpClient(smtpServer, smtpPort, smtpType);
+    /* The server, then the other relays; entries that can not be read are left out. */
+    m_relays.clear();
+    m_relays.addRelays(m_SMTPserver->text(), smtpPort, smtpType);
+    m_relays.addRelays(m_SMTPrelays->text(), smtpPort, smtpType);
+
+    m_relays.startConnect(m_batchTimer);
+
+}
+
+/* Ask for the login; it is used as soon as the handshake is done. */
+bool MainWindow::SMTPaskCredentials(){
+    bool ok;
+
+    if(!m_relays.isConnecting()){
+        if(m_relays.count() == 0){
+            QMessageBox::warning(this, tr("SMTP Connect"), tr("No SMTP server set!"));
+        }
+        return false;
     }
-    catch (...){
 
+    QString smtpServer = m_relays.name(0);
+    if(m_relays.count() > 1){
+        smtpServer += tr(" (+") + QString::number(m_relays.count() - 1) + tr(" relays)");
     }
 
+    /* Time the user input apart from the network phases. */
+    qint64 phaseStart = m_batchTimer != NULL ? m_batchTimer->elapsed() : 0;
+
     /*
      * Get login name for SMTP server.
      *
      * Default is the sender email address.
      */
     QString user = QInputDialog::getText(this, tr("Username:"),
-                                           tr("SMTP username for ") + smtpServer +
-                                           tr(":") + QString::number(smtpPort),
+                                           tr("SMTP username for ") + smtpServer,
                                            QLineEdit::Normal, m_senderEmail->text(),
                                          &ok);
 
     /* Value not empty and user dit not press close or cancel? */
     if(!ok || user.isEmpty()){
-        SMTPdisconnect();
-        return;
+        return false;
     }
 
     /* Ask for SMTP password. */
     QString password = QInputDialog::getText(this, tr("Password:"),
                                                tr("SMTP Password for <") + user +
-                                               tr(">@") + smtpServer +
-                                               tr(":") + QString::number(smtpPort),
+                                               tr(">@") + smtpServer,
                                                QLineEdit::Password, tr(""),
                                              &ok);
 
     /* Value not empty and user dit not press close or cancel? */
     if(!ok || password.isEmpty()){
-        SMTPdisconnect();
-        return;
+        return false;
     }
 
     /* Set username and password. */
-    m_SMTPConnection->setUser(user);
-    m_SMTPConnection->setPassword(password);
+    m_relays.setCredentials(user, password);
 
-    /* Lib throws exceptions... */
-    try {
-        /* Connect to SMTP server. */
-        if(!m_SMTPConnection->connectToHost()){
-            QMessageBox::warning(this, tr("SMTP Connect"), tr("Could not connect to SMTP server!"));
-            SMTPdisconnect();
-            return;
+    if(m_batchTimer != NULL){
+        m_batchTimer->lap("smtp.prompt", phaseStart);
+    }
+
+    return true;
+
+}
+
+/*
+ * Wait for the relays to log in. One relay is enough to start, the
+ * others are retried while sending.
+ */
+bool MainWindow::SMTPfinishConnect(){
+
+    if(!m_relays.isConnecting()){
+        if(m_SMTPConnection == NULL){
+            QMessageBox::warning(this, tr("SMTP Connect"), tr("No SMTP server set!"));
         }
+        return m_SMTPConnection != NULL;
+    }
+
+    SmtpConnector::Result result;
+    {
+        ScopedTimer t(m_batchTimer, "smtp.wait");
+        m_relays.finishConnect(&result);
+    }
+
+    m_SMTPConnection = m_relays.anySession();
 
-        /* Login. */
-        if(!m_SMTPConnection->login()){
+    if(m_SMTPConnection == NULL){
+        if(result == SmtpConnector::LoginFailed){
             QMessageBox::warning(this, tr("SMTP Connect"), tr("SMTP login failed! Wrong username/password."));
-            SMTPdisconnect();
-            return;
         }
-    }
-    catch (...){
+        else if(result == SmtpConnector::ConnectFailed){
+            QMessageBox::warning(this, tr("SMTP Connect"), tr("Could not connect to SMTP server!"));
+        }
 
+        /* Nothing to keep, ask again next time. */
+        m_relays.clear();
     }
 
+    return m_SMTPConnection != NULL;
+
 }
 
 /* Disconnect. */
 void MainWindow::SMTPdisconnect(){
-    if(m_SMTPConnection != NULL){
 
-        /* Should include this, but throws uncatchable exceptions. */
-        //m_smtp->quit();
-
-        delete m_SMTPConnection;
-    }
+    /* Closes the sessions, also the ones that are being set up. */
+    m_relays.clear();
 
     /* Set to NULL for next connect. */
     m_SMTPConnection = NULL;
 }
 
+/* Offer to resume the undelivered mails of an interrupted batch. */
+void MainWindow::resumeInterruptedBatch(){
+
+    OutboxJournal::prune(OUTBOX_KEEP_DAYS);
+
+    QStringList journals = OutboxJournal::interrupted();
+    if(journals.isEmpty()){
+        return;
+    }
+
+    /* Only the most recent one is offered, older ones are stale. */
+    QString fileName = journals.takeFirst();
+    foreach(QString old, journals){
+        OutboxJournal::abandon(old, tr("superseded"));
+    }
+
+    QVariantMap batch;
+    QMap<int, OutboxJournal::Status> status;
+    if(!OutboxJournal::load(fileName, &batch, &status)){
+        OutboxJournal::abandon(fileName, tr("unreadable"));
+        return;
+    }
+
+    /* Everything that is not known to be delivered is sent again. */
+    QSet<int> delivered;
+    QMap<int, OutboxJournal::Status>::const_iterator it;
+    for(it = status.constBegin(); it != status.constEnd(); ++it){
+        if(it.value() == OutboxJournal::Delivered){
+            delivered.insert(it.key());
+        }
+    }
+
+    QVariantList rows = batch.value(tr("rows")).toList();
+    int nOpen = rows.count() - delivered.count();
+    if(nOpen <= 0){
+        OutboxJournal::abandon(fileName, tr("complete"));
+        return;
+    }
+
+    QString subject = tr("[") + batch.value(tr("courseCode")).toString() + tr("] ") + batch.value(tr("subject")).toString();
+    QMessageBox::StandardButton answer = QMessageBox::question(this, tr("Resume interrupted batch?"),
+                                                               tr("The batch \"") + subject + tr("\" started at ") +
+                                                               batch.value(tr("started")).toString() + tr(" was interrupted.\n\n") +
+                                                               QString::number(delivered.count()) + tr(" of ") + QString::number(rows.count()) +
+                                                               tr(" emails were delivered.\n\n") +
+                                                               tr("Do you want to load this batch to send the remaining ") +
+                                                               QString::number(nOpen) + tr(" emails?\n\n") +
+                                                               tr("Press No to discard it, or Cancel to decide later."),
+                                                               QMessageBox::Cancel | QMessageBox::No | QMessageBox::Yes,
+                                                               QMessageBox::Yes);
+    if(answer == QMessageBox::Cancel){
+        return;
+    }
+    if(answer == QMessageBox::No){
+        OutboxJournal::abandon(fileName, tr("discarded"));
+        return;
+    }
+
+    /* Load the same workbook, or run the same query, and select the same sheet. */
+    QString workbook = batch.value(tr("workbook")).toString();
+    if(batch.contains(tr("query"))){
+        if(!loadQuery(workbook, batch.value(tr("query")).toString(),
+                      batch.value(tr("filterColumn")).toString(), batch.value(tr("recipients")).toStringList())){
+            return;
+        }
+    }
+    else if(!loadWorkbook(workbook)){
+        QMessageBox::warning(this, tr("Error:"), tr("The workbook ") + workbook + tr(" can not be loaded!"));
+        return;
+    }
+    for(int i = m_xlsxTab->count() - 1; i > 0; i--){
+        if(m_xlsxTab->tabText(i) == batch.value(tr("sheet")).toString() &&
+           m_xlsxTab->widget(i)->property("workbook").toString() == workbook){
+            m_xlsxTab->setCurrentIndex(i);
+            break;
+        }
+    }
+
+    /* Its columns are needed now, not when its turn comes. */
+    QWidget *view = m_xlsxTab->currentWidget();
+    if(view != NULL && view->property("loading").toBool()){
+        ((XlsxSource *)view->property("source").value<QObject *>())->wait(view->property("sheet").toInt());
+        showSheet(view);
+        releaseXlsxSources();
+    }
+
+    /* The same template in a new tab. */
+    addNewTextTab();
+    m_textTab->setTabText(m_textTab->currentIndex(), tr("Resume"));
+    ((QTextEdit*)m_textTab->currentWidget())->setPlainText(batch.value(tr("template")).toString());
+
+    /* The same parameters. */
+    m_emailSubject->setText(batch.value(tr("subject")).toString());
+    m_courseCode->setText(batch.value(tr("courseCode")).toString());
+    m_emailBcc->setText(batch.value(tr("emailBcc")).toString());
+    m_bccDigest->setChecked(batch.value(tr("bccDigest")).toBool());
+
+    /* The same shard, whatever this process was started with. */
+    Shard shard;
+    shard.parse(batch.value(tr("shard")).toString());
+    setShard(shard);
+    m_emailColumnSelect->setCurrentText(batch.value(tr("emailColumn")).toString());
+    m_emailAppendText->setText(batch.value(tr("emailAppend")).toString());
+    m_attachmentColSelect->setCurrentText(batch.value(tr("attachmentColumn")).toString());
+    m_attachmentDirectory = batch.value(tr("attachmentDirectory")).toString();
+    m_attachmentAppend->setText(batch.value(tr("attachmentAppend")).toString());
+
+    m_attachments->clear();
+    foreach(QString filePath, batch.value(tr("attachments")).toStringList()){
+        m_attachments->addItem(QFileInfo(filePath).fileName(), filePath);
+    }
+    m_attachments->setVisible(m_attachments->count() > 0);
+    m_deleteSelectedAttachment->setVisible(m_attachments->count() > 0);
+
+    /* Same range, without the rows that were delivered already. */
+    int first = rows.first().toInt();
+    int last = rows.last().toInt();
+    m_skipRows = delivered;
+    m_skipSheet = m_xlsxTab->currentWidget();
+    foreach(QVariant row, rows){
+        first = qMin(first, row.toInt());
+        last = qMax(last, row.toInt());
+    }
+    m_firstRowSelect->setCurrentText(QString::number(first));
+    m_lastRowSelect->setCurrentText(QString::number(last));
+    updateInfo();
+
+    OutboxJournal::abandon(fileName, tr("resumed"));
+
+    QMessageBox::information(this, tr("Resume batch"),
+                             tr("The batch is loaded. Check the preview and press \"Send mails\"\n"
+                                "to send the remaining ") + QString::number(m_previewSelect->count()) + tr(" emails."));
+
+}
+
+/* Send the mails and keep track of the time spent in every phase. */
+void MainWindow::sendMails(){
+
+    BatchTimer timer;
+    timer.start();
+
+    m_batchTimer = &timer;
+    sendBatch();
+
+    /*
+     * A batch that stopped early may have started a connection. Keep it
+     * for the next try when the login was given, it uses the timer.
+     */
+    if(m_relays.isConnecting()){
+        if(m_relays.hasCredentials()){
+            SMTPfinishConnect();
+        }
+        else{
+            SMTPdisconnect();
+        }
+    }
+
+    m_batchTimer = NULL;
+
+}
+
 /*
  * The main thing.. Sending emails.
  *
  * TODO: A bit long and not very well structured.
  *
  */
-void MainWindow::sendMails(){
+void MainWindow::sendBatch(){
+
+    /* Phases are timed from here. */
+    qint64 phaseStart = m_batchTimer->elapsed();
+
+    /* Start the SMTP handshake now, it runs while the mails are checked and rendered. */
+    if(DO_NOT_SEND_EMAILS == 0 && m_SMTPConnection == NULL){
+        SMTPstartConnect();
+    }
+
+    /* A "changed only" selection that is not up to date yet. */
+    if(m_changedOnly->isChecked() && m_changedOnlyTimer->isActive()){
+        m_changedOnlyTimer->stop();
+        updateInfo();
+    }
 
     /* Calculate number of mails. */
     int nMails = m_previewSelect->count();
@@ -1831,11 +2489,19 @@ void MainWindow::sendMails(){
     progress.setLayout(&progressLayout);
     progress.show();
 
-    /* Mail Objects */
-    MimeMessage messages[nMails];
-    MimeText texts[nMails];
+    /*
+     * Mail Objects: the recipient and the parts of every mail. The arena
+     * owns every MIME object of the batch and releases them together,
+     * whichever way this function returns.
+     */
+    MimeArena arena;
+    QVector<QString> addresses(nMails);
+    QVector<QList<MimePart*> > parts(nMails);
+    QVector<FastMimeText*> texts(nMails);
     EmailAddress sender(tr(""));
 
+    m_batchTimer->lap("ui.progress", phaseStart);
+
     /* Check parameters... */
     progressText.setText(tr("Checking parameters..."));
     qApp->processEvents();
@@ -1910,14 +2576,22 @@ void MainWindow::sendMails(){
         }
     }
 
+    /* The Bcc addresses get one digest instead of a copy of every mail. */
+    bool bccDigest = m_bccDigest->isChecked() && !bcc_addresses.isEmpty();
+    BccDigest digest;
+    if(bccDigest && !digest.open()){
+        QMessageBox::warning(this, tr("Error:"), tr("Cannot create a temporary file for the Bcc digest!"));
+        return;
+    }
+
+    m_batchTimer->lap("check.parameters", phaseStart);
+
     /* Read Attachments. */
-    QList<QFile*> attachmentFiles;
     QList<MimeAttachment*> attachments;
     for(int i = 0; i < m_attachments->count(); i++){
         QString fileName = m_attachments->itemData(i).toString();
-        QFile *f = new QFile(fileName);
-        if(f->exists()){
-            MimeAttachment *att = new MimeAttachment(f);
+        if(QFile::exists(fileName)){
+            MimeAttachment *att = arena.create<FastMimeAttachment>(arena.create<QFile>(fileName));
             attachments.append(att);
             nAttachments++;
         }
@@ -1931,17 +2605,36 @@ void MainWindow::sendMails(){
     }
 
 
+    m_batchTimer->lap("check.attachments", phaseStart);
+
+    /* The login is needed before rendering, so AUTH can run meanwhile. */
+    if(m_relays.isConnecting() && !m_relays.hasCredentials()){
+        if(!SMTPaskCredentials()){
+            SMTPdisconnect();
+            return;
+        }
+        phaseStart = m_batchTimer->elapsed();
+    }
+
+    /* The values of the sheet as UTF-8, converted once for all mails. */
+    SheetSnapshot sheet;
+    {
+        QTableView *d = (QTableView*)m_xlsxTab->currentWidget();
+        sheet.load(d != NULL && m_xlsxTab->currentIndex() != 0 ? d->model() : NULL);
+    }
+    QByteArray mailText;
+
+    m_batchTimer->lap("render.snapshot", phaseStart);
+
     /* Checking messages... */
     progressText.setText("Checking messages...");
     qApp->processEvents();
 
     /* Check and generate mails. */
     for(int i = 0; i < nMails; i++){
+        ScopedTimer t(m_batchTimer, "render.message");
         int rowIndex = m_previewSelect->itemText(i).toInt();
 
-        /* Set sender. */
-        messages[i].setSender(&sender);
-
         /* Recipient address OK? */
         QString recv_mail = getData(m_emailColumnSelect->currentText(), rowIndex) + m_emailAppendText->text();
         if(!isValidEmail(recv_mail)){
@@ -1960,10 +2653,13 @@ void MainWindow::sendMails(){
         }
 
         /* Add receiver. */
-        messages[i].addTo(new EmailAddress(recv_mail));
+        addresses[i] = recv_mail;
 
         /* Mailtext OK? */
-        QString mailText = getMailText(rowIndex);
+        {
+            ScopedTimer t(m_batchTimer, "render.text");
+            mailTemplate().render(sheet, rowIndex, &mailText);
+        }
         if(mailText.contains("[INV_REF!]")){
             QMessageBox::warning(this, tr("Error:"), tr("There are invalid references in the mailtext of email ") +
                                  QString::number(rowIndex) + tr("!"));
@@ -1971,29 +2667,22 @@ void MainWindow::sendMails(){
         }
 
         /* Add text to mail. */
-        texts[i].setText(mailText);
-        messages[i].addPart(&texts[i]);
-
-        /* Add subject. */
-        messages[i].setSubject(subject);
-
-        /* Add bcc's */
-        foreach(QString bcc, bcc_addresses){
-            messages[i].addBcc(new EmailAddress(bcc));
-        }
+        texts[i] = arena.create<FastMimeText>();
+        texts[i]->setBody(mailText);
+        parts[i].append(texts[i]);
 
         /* Add attachments. */
         foreach(MimeAttachment *att, attachments){
-            messages[i].addPart(att);
+            parts[i].append(att);
         }
 
         /* Add individual attachment. */
         if(m_attachmentColSelect->currentText() != tr("<none>")){
+            ScopedTimer t(m_batchTimer, "attachment.load");
             QString fileName = m_attachmentDirectory + QDir::separator() + getData(m_attachmentColSelect->currentText(), rowIndex) + m_attachmentAppend->text();
-            QFile *f = new QFile(fileName);
-            if(f->exists()){
-                MimeAttachment *att = new MimeAttachment(f);
-                messages[i].addPart(att);
+            if(QFile::exists(fileName)){
+                MimeAttachment *att = arena.create<FastMimeAttachment>(arena.create<QFile>(fileName));
+                parts[i].append(att);
             }
             else{
                 QMessageBox::warning(this, tr("Error:"), tr("Attachment ") + fileName + tr(" can not be loaded!"));
@@ -2002,18 +2691,66 @@ void MainWindow::sendMails(){
         }
     }
 
+    /*
+     * Identical mails (same text and attachments, e.g. a template without
+     * #A# fields) go out as one transaction with several recipients. The
+     * To header lists them all. An address is in a group only once: a
+     * second row for it starts a new group, so every row is still sent.
+     */
+    QVector<QByteArray> hashes(nMails);
+    QVector<QList<int> > groups;
+    {
+        int maxRecipients = qMax(1, m_SMTPmaxRecipients->text().toInt());
+        QHash<QByteArray, int> open;
+
+        for(int i = 0; i < nMails; i++){
+            hashes[i] = mailHash(m_previewSelect->itemText(i).toInt(), texts[i]->body());
+
+            QHash<QByteArray, int>::iterator it = open.find(hashes[i]);
+            if(it != open.end()){
+                bool twice = false;
+                foreach(int m, groups.at(it.value())){
+                    twice = twice || addresses[m].compare(addresses[i], Qt::CaseInsensitive) == 0;
+                }
+                if(!twice){
+                    groups[it.value()].append(i);
+                    if(groups[it.value()].count() >= maxRecipients){
+                        open.erase(it);
+                    }
+                    continue;
+                }
+            }
+
+            groups.append(QList<int>() << i);
+            if(maxRecipients > 1){
+                open.insert(hashes[i], groups.count() - 1);
+            }
+        }
+    }
+
+    /*
+     * From, Subject, MIME-Version and the boundary are the same for every
+     * mail: encoded once, only To, Date and Message-ID differ. The Bcc
+     * addresses are only in the envelope, unless they get a digest.
+     */
+    MailWriter writer;
+    writer.setCommon(sender, subject);
+    QStringList envelopeBcc = bccDigest ? QStringList() : bcc_addresses;
+    QByteArray payload;
+
+    m_batchTimer->lap("render.messages", phaseStart);
+
     /* Connect to SMTP */
     progressText.setText("Connect to SMTP server...");
     qApp->processEvents();
 
-    /* Do we already have a connection? If not, connect. */
-    if(DO_NOT_SEND_EMAILS == 0 && m_SMTPConnection == NULL){
-        SMTPconnect();
-        if(m_SMTPConnection == NULL){
-            return;
-        }
+    /* Wait for the connection started at the beginning, if still needed. */
+    if(DO_NOT_SEND_EMAILS == 0 && !SMTPfinishConnect()){
+        return;
     }
 
+    m_batchTimer->lap("smtp.session", phaseStart);
+
     /* Confirm mails. */
     progressText.setText("Confirm...");
     qApp->processEvents();
@@ -2025,60 +2762,393 @@ void MainWindow::sendMails(){
                                    tr(" emails with the subject: \"") + subject +
                                    tr("\" and ") + QString::number(nAttachments) + tr(" attachments now?")
                              ) != QMessageBox::Yes){
+
+        /* Not sending ends a resume: the rows delivered before are selectable again. */
+        if(!m_skipRows.isEmpty()){
+            m_skipRows.clear();
+            updateInfo();
+        }
         return;
     }
 
+    m_batchTimer->lap("confirm", phaseStart);
+
+    /*
+     * Journal the batch, so it can be resumed after a crash. It holds
+     * everything needed to render the same mails again.
+     */
+    OutboxJournal journal;
+    {
+        QVariantMap batch;
+        QTableView *sheetView = (QTableView*)m_xlsxTab->currentWidget();
+        QTextEdit *te = qobject_cast<QTextEdit*>(m_textTab->currentWidget());
+        QStringList globalAttachments;
+        QVariantList rows;
+
+        for(int i = 0; i < m_attachments->count(); i++){
+            globalAttachments.append(m_attachments->itemData(i).toString());
+        }
+        for(int i = 0; i < nMails; i++){
+            rows.append(m_previewSelect->itemText(i).toInt());
+        }
+
+        batch.insert(tr("workbook"), sheetView->property("workbook").toString());
+        if(!sheetView->property("query").toString().isEmpty()){
+            batch.insert(tr("query"), sheetView->property("query").toString());
+            batch.insert(tr("filterColumn"), sheetView->property("filterColumn").toString());
+            batch.insert(tr("recipients"), sheetView->property("recipients").toStringList());
+        }
+        batch.insert(tr("sheet"), m_xlsxTab->tabText(m_xlsxTab->currentIndex()));
+        batch.insert(tr("template"), te != NULL ? te->toPlainText() : tr(""));
+        batch.insert(tr("subject"), m_emailSubject->text());
+        batch.insert(tr("courseCode"), coursecode);
+        batch.insert(tr("emailBcc"), m_emailBcc->text());
+        batch.insert(tr("bccDigest"), m_bccDigest->isChecked());
+        batch.insert(tr("emailColumn"), m_emailColumnSelect->currentText());
+        batch.insert(tr("emailAppend"), m_emailAppendText->text());
+        batch.insert(tr("attachments"), globalAttachments);
+        batch.insert(tr("attachmentColumn"), m_attachmentColSelect->currentText());
+        batch.insert(tr("attachmentDirectory"), m_attachmentDirectory);
+        batch.insert(tr("attachmentAppend"), m_attachmentAppend->text());
+        batch.insert(tr("rows"), rows);
+        if(!m_shard.isAll()){
+            batch.insert(tr("shard"), m_shard.toString());
+        }
+
+        /* Sending works without a journal, only resuming does not. */
+        journal.begin(batch);
+    }
+    QVector<bool> delivered(nMails, false);
+
+    /* Send UTF-8 as is when all relays accept 8bit bodies; a relay that comes back must too. */
+    bool eightBit = m_SMTPConnection != NULL && m_relays.supports(tr("8BITMIME"));
+    m_relays.require(eightBit ? QStringList() << tr("8BITMIME") : QStringList());
+    for(int i = 0; i < nMails; i++){
+        texts[i]->setEightBitAllowed(eightBit);
+    }
+
     /* Set progressbar range. */
     progressBar.setRange(0, nMails);
 
+    /* Throughput and latencies are measured for this batch only. */
+    QElapsedTimer sendClock;
+    sendClock.start();
+    m_relays.resetStatistics();
+
     /* Statistics. */
     QString success;
     int nSuccess = 0;
+    QString deferred;
+    int nDeferred = 0;
     QString failed;
     int nFailed = 0;
-    QString allTexts;
+    bool connectionLost = false;
+    int nTransactions = 0;
+
+    /*
+     * Groups deferred with a 4xx reply wait in the retry queue until
+     * their backoff expired, while the other groups keep flowing.
+     */
+    QList<int> pending;
+    for(int g = 0; g < groups.count(); g++){
+        pending.append(g);
+    }
+    QList<int> retryQueue;
+    QVector<int> attempts(groups.count(), 0);
+    QVector<qint64> retryAt(groups.count(), 0);
+    int nDone = 0;
+
+    /* The generated mails, compressed, for the report. */
+    ReportWriter reportFile;
+    QString reportName = tr("report-") + QString(coursecode).replace(QRegExp("[^A-Za-z0-9_-]"), tr("_")) +
+                         tr("-") + QDateTime::currentDateTime().toString(tr("yyyyMMdd-hhmmss"));
+    reportFile.open(reportName);
+
+    /* Stay within the quota of the relay, and adapt when it pushes back. */
+    RateLimiter limiter;
+    limiter.configure(m_SMTPmaxMessages->text().toDouble(), m_SMTPmaxKBytes->text().toDouble() * 1024);
+    qint64 expectedSize = 0;
 
     /* Send messages. */
-    for(int i = 0; i < nMails; i++){
-        int rowIndex = m_previewSelect->itemText(i).toInt();
+    while(!pending.isEmpty() || !retryQueue.isEmpty()){
+        ScopedTimer t(m_batchTimer, "send.message");
+
+        /* A deferred group whose time has come goes first. */
+        int g = -1;
+        for(int q = 0; q < retryQueue.count(); q++){
+            if(retryAt[retryQueue.at(q)] <= sendClock.elapsed() || connectionLost){
+                g = retryQueue.takeAt(q);
+                break;
+            }
+        }
 
-        progressText.setText(tr("Sending message ") + QString::number(i+1) + tr(" / ") + QString::number(nMails) + tr("..."));
-        progressBar.setValue(i);
+        if(g < 0 && !pending.isEmpty()){
+            g = pending.takeFirst();
+        }
+
+        /* Only deferred groups left: wait for the first one. */
+        if(g < 0){
+            qint64 due = retryAt[retryQueue.first()];
+            foreach(int q, retryQueue){
+                due = qMin(due, retryAt[q]);
+            }
+            progressText.setText(tr("Waiting for ") + QString::number(retryQueue.count()) +
+                                 tr(" deferred message(s)..."));
+            waitFor((int)qMax((qint64)0, due - sendClock.elapsed()));
+            continue;
+        }
+
+        QList<int> group = groups.at(g);
+        int i = group.first();
+
+        progressText.setText(tr("Sending message ") + QString::number(nDone+1) + tr(" / ") + QString::number(nMails) +
+                             (group.count() > 1 ? tr(" (") + QString::number(group.count()) + tr(" recipients)") : tr("")) +
+                             (retryQueue.isEmpty() ? tr("") : tr(" (") + QString::number(retryQueue.count()) + tr(" deferred)")) +
+                             tr("...\n\n") + sendStatistics(nDone, nMails, sendClock.elapsed()));
+        progressBar.setValue(nDone);
         qApp->processEvents();
 
-        /* Add contents. */
-        allTexts.append(tr("\n\n============================== " ) + QString::number(rowIndex) + tr(" ==============================\n"));
-        allTexts.append(getMailHeader(rowIndex));
-        allTexts.append(texts[i].getText());
+        /* The session could not be restored, the rest will fail as well. */
+        if(connectionLost){
+            foreach(int m, group){
+                int rowIndex = m_previewSelect->itemText(m).toInt();
+                QString address = addresses[m];
+                journal.record(rowIndex, address, hashes[m], OutboxJournal::Failed);
+                reportFile.append(rowIndex, getMailHeader(rowIndex), texts[m]->body());
+                failed += tr("  ") + address + tr(" (not sent)\n");
+                nFailed++;
+                nDone++;
+            }
+            continue;
+        }
+
+        /* Wait for the rate limiter, the size of the previous message is a fair guess. */
+        int nRecipients = group.count() + envelopeBcc.count();
+        qint64 wait = limiter.delay(expectedSize, sendClock.elapsed(), nRecipients);
+        if(wait > 0){
+            ScopedTimer t(m_batchTimer, "send.ratelimit");
+            progressText.setText(progressText.text() + tr("\nRate limited to ") +
+                                 QString::number(limiter.messagesPerMinute(), 'f', 1) + tr(" mails/min..."));
+            waitFor((int)wait);
+        }
 
-        /* Try to send the mail. If failed, keep track of this. */
-        if(!sendMail(&messages[i])){
-            failed += tr("  ") + messages[i].getRecipients()[0]->getAddress() + tr("\n");
-            nFailed++;
+        /* Envelope of a group: the addresses of all its mails. */
+        QStringList envelope;
+        foreach(int m, group){
+            QString address = addresses[m];
+            journal.record(m_previewSelect->itemText(m).toInt(), address, hashes[m], OutboxJournal::Sending);
+            envelope.append(address);
+        }
+
+        /* The To of a group: all of its recipients. */
+        {
+            ScopedTimer t(m_batchTimer, "send.serialize");
+            writer.writeMail(MailWriter::addressList(envelope), parts[i], &payload);
+        }
+
+        /* Try to send the mail and keep track of the result, and of the relay that took it. */
+        int relay;
+        SmtpSession::SendResult result = sendData(sender.getAddress(), envelope + envelopeBcc, payload, &relay);
+        QString relayName = relay >= 0 ? m_relays.name(relay) : tr("");
+        attempts[g]++;
+        nTransactions++;
+
+        /* Feed the outcome back to the rate limiter. */
+        if(m_SMTPConnection != NULL){
+            if(result == SmtpSession::Delivered){
+                expectedSize = m_SMTPConnection->lastMessageSize();
+                limiter.consume(expectedSize, sendClock.elapsed(), nRecipients);
+                limiter.delivered(m_SMTPConnection->lastDataLatency(), sendClock.elapsed());
+            }
+            else if(result == SmtpSession::TransientFailure){
+                limiter.consume(0, sendClock.elapsed(), nRecipients);
+                limiter.throttled(sendClock.elapsed());
+            }
+            else{
+                limiter.consume(0, sendClock.elapsed(), nRecipients);
+            }
+        }
+
+        /*
+         * A group fails as a whole, e.g. on one rejected address or on too
+         * many recipients: send its mails one by one.
+         */
+        if((result == SmtpSession::TransientFailure || result == SmtpSession::PermanentFailure) && group.count() > 1){
+            for(int k = 0; k < group.count(); k++){
+                groups.append(QList<int>() << group.at(k));
+                if(result == SmtpSession::TransientFailure){
+                    journal.record(m_previewSelect->itemText(group.at(k)).toInt(), envelope.at(k), hashes[group.at(k)], OutboxJournal::Deferred);
+                    attempts.append(1);
+                    retryAt.append(sendClock.elapsed() + SMTP_RETRY_BACKOFF_MS + (SMTP_RETRY_BACKOFF_MS * ((qrand() % 51) - 25)) / 100);
+                    retryQueue.append(groups.count() - 1);
+                }
+                else{
+                    attempts.append(0);
+                    retryAt.append(0);
+                    pending.insert(k, groups.count() - 1);
+                }
+            }
             continue;
         }
 
-        success += tr("  ") + messages[i].getRecipients()[0]->getAddress() + tr("\n");
-        nSuccess++;
+        if(result == SmtpSession::TransientFailure && attempts[g] <= SMTP_RETRY_ATTEMPTS){
+            for(int k = 0; k < group.count(); k++){
+                journal.record(m_previewSelect->itemText(group.at(k)).toInt(), envelope.at(k), hashes[group.at(k)], OutboxJournal::Deferred);
+            }
+
+            /* Exponential backoff with jitter, so deferred messages do not retry in lockstep. */
+            qint64 backoff = (qint64)SMTP_RETRY_BACKOFF_MS << (attempts[g] - 1);
+            backoff += (backoff * ((qrand() % 51) - 25)) / 100;
+            retryAt[g] = sendClock.elapsed() + backoff;
+            retryQueue.append(g);
+            continue;
+        }
+
+        QString reply = m_SMTPConnection != NULL ? m_SMTPConnection->lastReplyText() : tr("");
+        QString via = relayName.isEmpty() ? tr("") : tr(" via ") + relayName;
+        connectionLost = result == SmtpSession::SessionLost;
+
+        for(int k = 0; k < group.count(); k++){
+            int m = group.at(k);
+            QString address = envelope.at(k);
+            int rowIndex = m_previewSelect->itemText(m).toInt();
+
+            nDone++;
+            journal.record(rowIndex, address, hashes[m], result == SmtpSession::Delivered ? OutboxJournal::Delivered : OutboxJournal::Failed, relayName);
+
+            /* Final status: into the report, and the digest when delivered. */
+            QString header = getMailHeader(rowIndex);
+            reportFile.append(rowIndex, header, texts[m]->body(), relayName);
+
+            if(result == SmtpSession::Delivered){
+                delivered[m] = true;
+                if(bccDigest){
+                    digest.append(rowIndex, header, texts[m]->body());
+                }
+                if(attempts[g] > 1){
+                    deferred += tr("  ") + address + tr(" (") + QString::number(attempts[g]) + tr(" attempts)") + via + tr("\n");
+                    nDeferred++;
+                }
+                else{
+                    success += tr("  ") + address + via + tr("\n");
+                }
+                nSuccess++;
+                continue;
+            }
+
+            failed += tr("  ") + address + (reply.isEmpty() ? tr("") : tr(" [") + reply + tr("]")) + via + tr("\n");
+            nFailed++;
+        }
+    }
+
+    m_batchTimer->lap("send.messages", phaseStart);
+
+    /* All messages have their final status. */
+    journal.finish(connectionLost ? tr("connection lost") : tr("done"));
+    m_skipRows.clear();
+
+    /* Remember what was delivered, for the next "changed only" selection. */
+    m_sendHistory.load(coursecode, m_emailSubject->text());
+    for(int i = 0; i < nMails; i++){
+        if(delivered[i]){
+            m_sendHistory.insert(addresses[i], hashes[i]);
+        }
+    }
+    m_sendHistory.save();
+
+    /* One digest per Bcc address. */
+    QString digestResult;
+    if(bccDigest && digest.count() > 0 && m_SMTPConnection != NULL){
+        QString digestSubject = tr("Bcc digest (") + QString::number(digest.count()) + tr(" mails): ") + subject;
+
+        foreach(QString bcc, bcc_addresses){
+            progressText.setText(tr("Sending Bcc digest to ") + bcc + tr("..."));
+            qApp->processEvents();
+
+            if(!m_SMTPConnection->isAlive() || m_SMTPConnection->sessionLost()){
+                m_SMTPConnection->reconnect();
+            }
+
+            if(digest.send(m_SMTPConnection, fromName, sender.getAddress(), bcc, digestSubject)){
+                digestResult += tr("  ") + bcc + tr("\n");
+            }
+            else{
+                digestResult += tr("  ") + bcc + tr(" [") + m_SMTPConnection->lastReplyText() + tr("] FAILED\n");
+            }
+        }
     }
 
+    m_batchTimer->lap("send.digest", phaseStart);
+
     /* Prepare report. */
     progressBar.setValue(nMails);
     progressText.setText(tr("Sending Report..."));
     qApp->processEvents();
 
-    QString res = tr("Number of mails: ") + QString::number(nMails) + tr("\n\n") +
-                  tr("Mails OK: ") + QString::number(nSuccess) + tr("\n\n") +
+    QString res = (m_shard.isAll() ? tr("") : tr("Shard ") + m_shard.toString() + tr(", merge the journals of all shards with --merge.\n\n")) +
+                  tr("Number of mails: ") + QString::number(nMails) + tr("\n\n") +
+                  tr("Mails OK: ") + QString::number(nSuccess) + tr("\n") +
+                  tr("  of which deferred, then delivered: ") + QString::number(nDeferred) + tr("\n") + deferred + tr("\n") +
                   tr("Mails Failed: ") + QString::number(nFailed) + tr("\n") + failed + tr("\n");
 
-    allTexts.prepend(tr("Beste ") + m_senderName->text() + tr(",\n\n") +
-                     tr("Hierbij het rapport van ") + subject + tr("\n\n") +
-                     res + tr("\nDe volgende berichten zijn gegenereerd:\n"));
-    allTexts.append(tr("\n============================== END ==============================\n"));
+    if(!digestResult.isEmpty()){
+        res += tr("Bcc digest with ") + QString::number(digest.count()) + tr(" mails sent to:\n") + digestResult + tr("\n");
+    }
+
+    if(nTransactions < nSuccess + nFailed){
+        res += tr("Identical mails grouped: ") + QString::number(nSuccess + nFailed) + tr(" mails in ") +
+               QString::number(nTransactions) + tr(" transactions\n");
+    }
+
+    res += limiter.summary() + tr("\n");
+
+    if(m_relays.reconnects() > 0){
+        res += tr("SMTP reconnects: ") + QString::number(m_relays.reconnects()) + tr("\n");
+    }
+    if(m_relays.count() > 1){
+        res += tr("\nSMTP relays:\n") + m_relays.summary();
+    }
+    if(connectionLost){
+        res += tr("The SMTP connection was lost and could not be restored!\n");
+    }
+
+    m_batchTimer->lap("report.build", phaseStart);
+
+    /* What the MIME objects of the mails cost. */
+    m_batchTimer->setCounter(tr("arena.objects"), arena.objects());
+    m_batchTimer->setCounter(tr("arena.blocks"), arena.blocks());
+    m_batchTimer->setCounter(tr("arena.kbytes"), arena.bytes() / 1024);
+
+    /* TLS handshakes of this run, resumed ones skip the certificate exchange. */
+    m_batchTimer->setCounter(tr("tls.full"), TlsSessionCache::instance()->fullHandshakes());
+    m_batchTimer->setCounter(tr("tls.resumed"), TlsSessionCache::instance()->resumedHandshakes());
+
+    /* Summary in the body, the generated mails in the attachment. */
+    bool haveReportFile = reportFile.finish();
+
+    /* A shard keeps its report next to its journal, for the merge. */
+    if(haveReportFile && !m_shard.isAll() && !journal.fileName().isEmpty()){
+        QFileInfo fi(journal.fileName());
+        QFile::copy(reportFile.fileName(), fi.path() + tr("/") + fi.completeBaseName() + tr(".txt.gz"));
+    }
+    QString reportText = tr("Beste ") + m_senderName->text() + tr(",\n\n") +
+                         tr("Hierbij het rapport van ") + subject + tr("\n\n") +
+                         res + tr("\nTijdsverdeling:\n") + m_batchTimer->summary() +
+                         (m_SMTPConnection != NULL ? tr("\nSMTP latenties (ms):\n") + m_relays.histogramReport() : tr(""));
+    if(haveReportFile){
+        reportText += tr("\nDe ") + QString::number(reportFile.count()) + tr(" gegenereerde berichten staan in de bijlage ") +
+                      QFileInfo(reportFile.fileName()).fileName() + tr(" (") +
+                      QString::number(reportFile.uncompressedSize() / 1024) + tr(" kB, gecomprimeerd ") +
+                      QString::number(reportFile.compressedSize() / 1024) + tr(" kB).\n");
+    }
+    else{
+        reportText += tr("\nDe gegenereerde berichten konden niet worden bewaard.\n");
+    }
 
     /* Message and content. */
     MimeMessage report;
-    MimeText text;
+    FastMimeText text;
+    text.setEightBitAllowed(eightBit);
 
     /* Set sender and receiver. */
     report.setSender(&sender);
@@ -2086,36 +3156,52 @@ void MainWindow::sendMails(){
 
     /* Add cc's */
     foreach(QString cc, report_cc_addresses){
-        report.addCc(new EmailAddress(cc));
+        report.addCc(arena.create<EmailAddress>(cc));
     }
 
     /* Add subject */
     report.setSubject(tr("Report: ") + subject);
 
     /* Add contents. */
-    text.setText(allTexts);
+    text.setText(reportText);
     report.addPart(&text);
 
+    /* The generated mails. */
+    QFile reportData(reportFile.fileName());
+    FastMimeAttachment reportAttachment(&reportData);
+    reportAttachment.setContentType(tr("application/gzip"));
+    if(haveReportFile){
+        report.addPart(&reportAttachment);
+    }
+
     /* Add attachments. */
     foreach(MimeAttachment *att, attachments){
         report.addPart(att);
     }
 
-    if(!sendMail(&report)){
+    if(sendMail(&report) != SmtpSession::Delivered){
         QMessageBox::warning(this, tr("Error:"), tr("Sending report failed!"));
     }
 
-    progressText.setText(res);
-    qApp->processEvents();
+    m_batchTimer->lap("report.send", phaseStart);
 
-    /* Cleanup attachments. */
-    foreach(QFile *f, attachmentFiles){
-        delete f;
-    }
-    foreach(MimeAttachment *att, attachments){
-        delete att;
+    /* Export the timings of all phases? */
+    if(m_exportTrace->isChecked()){
+        QString traceDir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + tr("/traces");
+        QString traceFile = traceDir + tr("/") + coursecode + tr("-") +
+                            QDateTime::currentDateTime().toString(tr("yyyyMMdd-hhmmss")) + tr(".json");
+
+        if(QDir().mkpath(traceDir) && m_batchTimer->exportChromeTrace(traceFile)){
+            res += tr("Timing trace: ") + traceFile + tr("\n");
+        }
+        else{
+            res += tr("Timing trace could not be written to ") + traceFile + tr("\n");
+        }
     }
 
+    progressText.setText(res);
+    qApp->processEvents();
+
     /* Give information. */
     QMessageBox::information(this, tr("Info:"), res);
 
@@ -2124,25 +3210,45 @@ void MainWindow::sendMails(){
 }
 
 /* Wrapper to send an email. */
-bool MainWindow::sendMail(MimeMessage *m){
+SmtpSession::SendResult MainWindow::sendMail(MimeMessage *m){
+
+    /* Envelope: To, Cc and Bcc. */
+    QStringList recipients;
+    foreach(EmailAddress *rcpt, m->getRecipients(MimeMessage::To) +
+                                m->getRecipients(MimeMessage::Cc) +
+                                m->getRecipients(MimeMessage::Bcc)){
+        recipients.append(rcpt->getAddress());
+    }
+
+    QByteArray data;
+    MailWriter::write(*m, &data);
+
+    return sendData(m->getSender().getAddress(), recipients, data);
+
+}
+
+/* Send a serialized mail, see MailWriter, through the next relay of the pool. */
+SmtpSession::SendResult MainWindow::sendData(const QString &sender, const QStringList &recipients, const QByteArray &data, int *relay){
 
-    bool ret = false;
+    if(relay != NULL){
+        *relay = -1;
+    }
 
     /* For debugging. */
     if(DO_NOT_SEND_EMAILS){
         this->thread()->sleep(1);
-        return false;
+        return SmtpSession::PermanentFailure;
     }
 
     if(m_SMTPConnection == NULL){
-        return false;
+        return SmtpSession::SessionLost;
     }
 
-    try {
-        ret = m_SMTPConnection->sendMail(*m);
-    }
-    catch (...){
-        ret = false;
+    SmtpSession::SendResult ret = m_relays.send(sender, recipients, data, relay, m_batchTimer);
+
+    /* The session of the last relay answers for the result. */
+    if(m_relays.lastSession() != NULL){
+        m_SMTPConnection = m_relays.lastSession();
     }
 
     return ret;
@@ -17,6 +17,29 @@
 
 #include <smtpclient.h>
 
+#include "batchtimer.h"
+#include "smtpsession.h"
+#include "smtpconnector.h"
+#include "relaypool.h"
+#include "shard.h"
+#include "tlssessioncache.h"
+#include "ratelimiter.h"
+#include "outboxjournal.h"
+#include "mailtemplate.h"
+#include "sheetsnapshot.h"
+#include "mailwriter.h"
+#include "mimearena.h"
+#include "sendhistory.h"
+#include "bccdigest.h"
+#include "reportwriter.h"
+#include "fastmimeattachment.h"
+#include "fastmimetext.h"
+#include "xlsxsource.h"
+
+#include <QSet>
+#include <QPointer>
+#include <QTimer>
+
 /* Compile-time constant values. */
 #define APPLICATION_VERSION       "0.2"
 #define APPLICATION_NAME          "Qt XLSX Email Generator"
@@ -32,15 +55,31 @@
 /* Debugging. */
 #define DO_NOT_SEND_EMAILS 0
 
+/* Retry 4xx (deferred) messages: attempts and first backoff (doubles, +-25% jitter). */
+#define SMTP_RETRY_ATTEMPTS       4
+#define SMTP_RETRY_BACKOFF_MS     5000
+
+/* Keep the journals of send batches this many days. */
+#define OUTBOX_KEEP_DAYS          30
+
+/* Select the "changed only" rows again this long after the last edit of the mail. */
+#define MAINWINDOW_CHANGED_ONLY_DELAY_MS 500
+
 /* MainWindow class. */
 class MainWindow : public QMainWindow
 {
     Q_OBJECT
 
+    /* The benchmarks use the private methods directly. */
+    friend class tst_Benchmarks;
+
 public:
     explicit MainWindow(QWidget *parent = 0);
     ~MainWindow();
 
+    /* Send only this slice of the selected mails (--shard i/N). */
+    void setShard(const Shard &shard);
+
 signals:
 
 /* Callback functions. */
@@ -74,15 +113,27 @@ private slots:
     /* Load sheet dialog */
     void loadSheet();
 
+    /* Load database dialog: a query instead of a sheet. */
+    void loadDatabase();
+
     /* Slot called when selecting an onther sheet. */
     void updateSheet();
 
+    /* A sheet of a workbook was parsed, see XlsxSource. */
+    void sheetLoaded(int sheet);
+
     /* When fields are updated. */
     void updateInfo();
 
     /* When preview should be updated. */
     void updateText();
 
+    /* The template text changed, compile it again when used. */
+    void invalidateMailTemplate();
+
+    /* The mails changed: select the "changed only" rows again, once typing stops. */
+    void invalidateChangedOnly();
+
     /* Update blocker when adding values to comboboxes. */
     void blockRowSignals(bool b);
 
@@ -104,9 +155,19 @@ private slots:
     void SMTPconnect();
     void SMTPdisconnect();
 
+    /* The steps of SMTPconnect(), so the handshake can run while rendering. */
+    void SMTPstartConnect();
+    bool SMTPaskCredentials();
+    bool SMTPfinishConnect();
+
     /* The main thing... Sending mails */
     void sendMails();
-    bool sendMail(MimeMessage *m);
+    void sendBatch();
+
+    /* Offer to resume a batch that was interrupted by a crash or close. */
+    void resumeInterruptedBatch();
+    SmtpSession::SendResult sendMail(MimeMessage *m);
+    SmtpSession::SendResult sendData(const QString &sender, const QStringList &recipients, const QByteArray &data, int *relay = NULL);
 
     /* [9] Show about dialog. */
     void about();
@@ -141,16 +202,42 @@ private:
      * [2] General methods.
      */
 
+    /* Load all sheets of a workbook into the viewer. */
+    bool loadWorkbook(QString filePath);
+
+    /* Show the parsed sheet of a tab that is still loading; delete the sources that are done. */
+    void showSheet(QWidget *view);
+    void releaseXlsxSources();
+
+    /* Disabled while the current sheet is loading. */
+    void setSelectionEnabled(bool enabled);
+
+    /* Load the result of a query on an SQLite database as a sheet, see SqlSource. */
+    bool loadQuery(const QString &database, const QString &query,
+                   const QString &filterColumn = QString(), const QStringList &recipients = QStringList());
+
     /* Generate mailtext or header from template */
     QString getMailHeader(int offset);
     QString getMailText(int offset);
 
+    /* The template of the current editor tab, compiled. */
+    const MailTemplate &mailTemplate();
+
+    /* Hash of everything that makes the mail of a row what it is. */
+    QByteArray mailHash(int offset, const QByteArray &mailText);
+
     /* Row and column parser */
     QString getData(QString cell, int offset);
 
     /* Extract data from spreadsheet. */
     QString getData(int row, int col);
 
+    /* Wait without blocking the UI. */
+    void waitFor(int msecs);
+
+    /* Live throughput and latency line for the progress view. */
+    QString sendStatistics(int sent, int total, qint64 elapsedMs);
+
     /* Valid email address? */
     bool isValidEmail(QString address);
     bool isValidHRStudentEmail(QString address);
@@ -166,8 +253,14 @@ private:
     QDockWidget *m_editorDW;
     QDockWidget *m_previewDW;
 
-    /* SMTP client */
-    SmtpClient *m_SMTPConnection;
+    /* SMTP client: the session of the relay used last, owned by m_relays. */
+    SmtpSession *m_SMTPConnection;
+
+    /* The relays and their sessions, also while they are being set up. */
+    RelayPool m_relays;
+
+    /* Phase timings of the running batch, NULL when not sending. */
+    BatchTimer *m_batchTimer;
 
     /* General Options fields */
     QLineEdit *m_emailSubject;
@@ -187,6 +280,8 @@ private:
     QCheckBox *m_runtimeValidate;
     QCheckBox *m_saveOnExitCheckBox;
     QCheckBox *m_validateHR;
+    QCheckBox *m_exportTrace;
+    QCheckBox *m_bccDigest;
 
     /* SMTP settings. */
     QFrame *m_SMTPWidget;
@@ -194,12 +289,20 @@ private:
     QPushButton *m_SMTPWidgetToggleButton;
     QLineEdit *m_SMTPserver;
     QLineEdit *m_SMTPport;
+    QLineEdit *m_SMTPrelays;
     QComboBox *m_SMTPtype;
+    QLineEdit *m_SMTPmaxMessages;
+    QLineEdit *m_SMTPmaxKBytes;
+    QLineEdit *m_SMTPmaxRecipients;
 
     /* XLSX viewer. */
     QToolButton *m_loadXlsxFileButton;
+    QToolButton *m_loadDatabaseButton;
     QTabWidget *m_xlsxTab;
 
+    /* Workbooks of which sheets are still being parsed. */
+    QList<XlsxSource*> m_xlsxSources;
+
     /* Editor/Composer. */
     QTabWidget *m_textTab;
     QFrame *m_generateWidget;
@@ -223,6 +326,9 @@ private:
     QComboBox *m_lastRowSelect;
     QComboBox *m_previewSelect;
     QLCDNumber *m_nMailsDisplay;
+    QCheckBox *m_changedOnly;
+    QTimer *m_changedOnlyTimer;
+    QPushButton *m_sendMailsButton;
 
     /* Attacment Widget */
     QFrame *m_attachmentWidget;
@@ -236,6 +342,20 @@ private:
     /* Toolbar */
     QToolBar *m_toolBar;
 
+    /* Rows already delivered by an interrupted batch that is being resumed, and its sheet. */
+    QSet<int> m_skipRows;
+    QPointer<QWidget> m_skipSheet;
+
+    /* The slice of the mails this process sends, all of them by default. */
+    Shard m_shard;
+
+    /* Compiled template of the current editor tab. */
+    MailTemplate m_mailTemplate;
+    bool m_mailTemplateDirty;
+
+    /* Mails delivered before, for the "changed only" selection. */
+    SendHistory m_sendHistory;
+
 };
 
 #endif // MAINWINDOW_H
@@ -0,0 +1,68 @@
+#include "mimearena.h"
+
+#include <cstdlib>
+
+/* Alignment of every object, enough for any member. */
+#define MIMEARENA_ALIGN 16
+
+MimeArena::MimeArena(){
+
+    m_used = MIMEARENA_BLOCK_SIZE;
+    m_objects = 0;
+    m_bytes = 0;
+
+}
+
+MimeArena::~MimeArena(){
+
+    clear();
+
+}
+
+/* Objects may refer to objects created before them, so destroy backwards. */
+void MimeArena::clear(){
+
+    for(int i = m_entries.count() - 1; i >= 0; i--){
+        m_entries.at(i).destroy(m_entries.at(i).object);
+    }
+    m_entries.clear();
+
+    foreach(char *block, m_blocks){
+        free(block);
+    }
+    m_blocks.clear();
+    m_used = MIMEARENA_BLOCK_SIZE;
+
+}
+
+void *MimeArena::allocate(size_t size){
+
+    size = (size + MIMEARENA_ALIGN - 1) & ~(size_t)(MIMEARENA_ALIGN - 1);
+    m_bytes += size;
+
+    /* An object larger than a block gets a block of its own. */
+    if(size > MIMEARENA_BLOCK_SIZE){
+        char *block = (char*)malloc(size);
+        if(block == NULL){
+            throw std::bad_alloc();
+        }
+        m_blocks.prepend(block);
+        return block;
+    }
+
+    /* The current block is the last one. */
+    if(m_used + size > MIMEARENA_BLOCK_SIZE){
+        char *block = (char*)malloc(MIMEARENA_BLOCK_SIZE);
+        if(block == NULL){
+            throw std::bad_alloc();
+        }
+        m_blocks.append(block);
+        m_used = 0;
+    }
+
+    void *p = m_blocks.last() + m_used;
+    m_used += size;
+
+    return p;
+
+}
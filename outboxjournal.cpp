@@ -0,0 +1,304 @@
+#include "outboxjournal.h"
+
+#include <QDir>
+#include <QDateTime>
+#include <QCoreApplication>
+#include <QFileInfo>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QStandardPaths>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/* fsync after this many records. */
+#define OUTBOX_SYNC_RECORDS 20
+
+/* Journals started in the same millisecond by one process, e.g. by the workers of the daemon. */
+#define OUTBOX_ID_TRIES 100
+
+OutboxJournal::OutboxJournal(){
+
+    m_lock = NULL;
+    m_unsynced = 0;
+
+}
+
+/* A journal that is not finished stays behind as interrupted. */
+OutboxJournal::~OutboxJournal(){
+
+    close();
+
+}
+
+/* Sync and close the file, then release the lock. */
+void OutboxJournal::close(){
+
+    if(m_file.isOpen()){
+        sync();
+        m_file.close();
+    }
+
+    delete m_lock;
+    m_lock = NULL;
+
+}
+
+/* Only the age of a lock is not enough, a batch can run for hours: a lock is stale when its process is gone. */
+bool OutboxJournal::isLocked(const QString &fileName){
+
+    QLockFile lock(fileName + QString(".lock"));
+    lock.setStaleLockTime(0);
+    if(!lock.tryLock(0)){
+        return true;
+    }
+    lock.unlock();
+
+    return false;
+
+}
+
+QString OutboxJournal::directory(){
+
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + QString("/outbox");
+
+}
+
+QString OutboxJournal::statusName(Status status){
+
+    switch(status){
+      case Queued:    return QString("queued");
+      case Sending:   return QString("sending");
+      case Delivered: return QString("delivered");
+      case Deferred:  return QString("deferred");
+      default:        return QString("failed");
+    }
+
+}
+
+OutboxJournal::Status OutboxJournal::statusFromName(const QString &name){
+
+    if(name == QString("queued"))    return Queued;
+    if(name == QString("sending"))   return Sending;
+    if(name == QString("delivered")) return Delivered;
+    if(name == QString("deferred"))  return Deferred;
+
+    return Failed;
+
+}
+
+bool OutboxJournal::begin(const QVariantMap &batch){
+
+    if(!QDir().mkpath(directory())){
+        return false;
+    }
+
+    /*
+     * The pid keeps the ids of processes apart, a counter those of the
+     * threads of one process. Taking the lock claims an id: it is created
+     * exclusively, and a journal that exists is never written again.
+     */
+    QString stamp = QDateTime::currentDateTime().toString(QString("yyyyMMdd-hhmmss-zzz")) +
+                    QString("-") + QString::number(QCoreApplication::applicationPid());
+    QString id;
+    for(int n = 0; m_lock == NULL; n++){
+        if(n == OUTBOX_ID_TRIES){
+            return false;
+        }
+
+        id = n == 0 ? stamp : stamp + QString("-") + QString::number(n);
+        m_file.setFileName(directory() + QString("/") + id + QString(".journal"));
+
+        QLockFile *lock = new QLockFile(m_file.fileName() + QString(".lock"));
+        lock->setStaleLockTime(0);
+        if(lock->tryLock(0) && !m_file.exists()){
+            m_lock = lock;
+        }
+        else{
+            delete lock;
+        }
+    }
+
+    if(!m_file.open(QIODevice::WriteOnly | QIODevice::Append)){
+        close();
+        return false;
+    }
+
+    QVariantMap record = batch;
+    record.insert(QString("type"), QString("batch"));
+    record.insert(QString("id"), id);
+    record.insert(QString("started"), QDateTime::currentDateTime().toString(Qt::ISODate));
+    append(record);
+    sync();
+
+    return true;
+
+}
+
+void OutboxJournal::record(int row, const QString &recipient, const QByteArray &hash, Status status, const QString &relay){
+
+    QVariantMap record;
+    record.insert(QString("type"), QString("message"));
+    record.insert(QString("row"), row);
+    record.insert(QString("to"), recipient);
+    record.insert(QString("hash"), QString::fromLatin1(hash.toHex()));
+    record.insert(QString("status"), statusName(status));
+    if(!relay.isEmpty()){
+        record.insert(QString("relay"), relay);
+    }
+    append(record);
+
+    if(m_unsynced >= OUTBOX_SYNC_RECORDS){
+        sync();
+    }
+
+}
+
+void OutboxJournal::finish(const QString &result){
+
+    if(!m_file.isOpen()){
+        return;
+    }
+
+    QVariantMap record;
+    record.insert(QString("type"), QString("end"));
+    record.insert(QString("result"), result);
+    record.insert(QString("finished"), QDateTime::currentDateTime().toString(Qt::ISODate));
+    append(record);
+
+    close();
+
+}
+
+void OutboxJournal::append(const QVariantMap &record){
+
+    if(!m_file.isOpen()){
+        return;
+    }
+
+    m_file.write(QJsonDocument(QJsonObject::fromVariantMap(record)).toJson(QJsonDocument::Compact));
+    m_file.write("\n");
+    m_unsynced++;
+
+}
+
+/* Get the records out of the Qt and OS buffers onto the disk. */
+void OutboxJournal::sync(){
+
+    if(!m_file.isOpen()){
+        return;
+    }
+
+    m_file.flush();
+#ifdef Q_OS_WIN
+    _commit(m_file.handle());
+#else
+    fsync(m_file.handle());
+#endif
+    m_unsynced = 0;
+
+}
+
+QStringList OutboxJournal::interrupted(){
+
+    QStringList res;
+
+    QDir dir(directory());
+    QStringList files = dir.entryList(QStringList() << QString("*.journal"), QDir::Files, QDir::Name | QDir::Reversed);
+    foreach(QString name, files){
+        QFile f(dir.filePath(name));
+        if(isLocked(f.fileName()) || !f.open(QIODevice::ReadOnly)){
+            continue;
+        }
+
+        /* Only the last complete line matters. */
+        QByteArray last;
+        while(!f.atEnd()){
+            QByteArray line = f.readLine().trimmed();
+            if(!line.isEmpty()){
+                last = line;
+            }
+        }
+
+        QJsonObject o = QJsonDocument::fromJson(last).object();
+        if(o.value(QString("type")).toString() != QString("end")){
+            res.append(f.fileName());
+        }
+    }
+
+    return res;
+
+}
+
+/* Read the batch record and the last status of every row. */
+bool OutboxJournal::load(const QString &fileName, QVariantMap *batch, QMap<int, Status> *rows, QMap<int, QString> *recipients){
+
+    QFile f(fileName);
+    if(!f.open(QIODevice::ReadOnly)){
+        return false;
+    }
+
+    bool haveBatch = false;
+    while(!f.atEnd()){
+        /* A line torn by a crash does not parse and is skipped. */
+        QJsonObject o = QJsonDocument::fromJson(f.readLine()).object();
+        QString type = o.value(QString("type")).toString();
+
+        if(type == QString("batch")){
+            *batch = o.toVariantMap();
+            haveBatch = true;
+        }
+        else if(type == QString("message")){
+            int row = o.value(QString("row")).toInt();
+            rows->insert(row, statusFromName(o.value(QString("status")).toString()));
+            if(recipients != 0){
+                recipients->insert(row, o.value(QString("to")).toString());
+            }
+        }
+    }
+
+    return haveBatch;
+
+}
+
+/* Close an interrupted journal so it is not offered again. */
+void OutboxJournal::abandon(const QString &fileName, const QString &reason){
+
+    QFile f(fileName);
+    if(!f.open(QIODevice::WriteOnly | QIODevice::Append)){
+        return;
+    }
+
+    QVariantMap record;
+    record.insert(QString("type"), QString("end"));
+    record.insert(QString("result"), reason);
+    record.insert(QString("finished"), QDateTime::currentDateTime().toString(Qt::ISODate));
+
+    /* Start on a new line in case the last record was torn. */
+    f.write("\n");
+    f.write(QJsonDocument(QJsonObject::fromVariantMap(record)).toJson(QJsonDocument::Compact));
+    f.write("\n");
+
+}
+
+/* Remove journals, and the reports of shards and stale locks next to them, older than `days`. */
+void OutboxJournal::prune(int days){
+
+    QDir dir(directory());
+    QDateTime limit = QDateTime::currentDateTime().addDays(-days);
+
+    QStringList filters = QStringList() << QString("*.journal") << QString("*.txt.gz") << QString("*.journal.lock");
+    foreach(QFileInfo fi, dir.entryInfoList(filters, QDir::Files)){
+        QString journal = fi.filePath();
+        if(journal.endsWith(QString(".lock"))){
+            journal.chop(5);
+        }
+        if(fi.lastModified() < limit && !isLocked(journal)){
+            QFile::remove(fi.filePath());
+        }
+    }
+
+}
@@ -0,0 +1,79 @@
+#ifndef OUTBOXJOURNAL_H
+#define OUTBOXJOURNAL_H
+
+#include <QFile>
+#include <QLockFile>
+#include <QMap>
+#include <QStringList>
+#include <QVariantMap>
+
+/*
+ * Append-only journal of a send batch.
+ *
+ * One file per batch in <AppDataLocation>/outbox, one JSON object per
+ * line: a "batch" record with everything needed to render the batch
+ * again, a "message" record for every status change of a message and an
+ * "end" record when the batch is finished. The last status of a row wins.
+ *
+ * Records are fsync'd in batches, so after a crash at most the last
+ * OUTBOX_SYNC_RECORDS status changes can be lost. A message that was
+ * being sent counts as undelivered.
+ *
+ * While a journal is written its <journal>.lock is held, so the batches
+ * still running in other processes (shards, the daemon) on this machine
+ * are not taken for interrupted ones.
+ */
+class OutboxJournal
+{
+public:
+    enum Status {
+        Queued,
+        Sending,
+        Delivered,
+        Deferred,
+        Failed
+    };
+
+    OutboxJournal();
+    ~OutboxJournal();
+
+    /* Start a new journal with a batch record. */
+    bool begin(const QVariantMap &batch);
+
+    /* Append a status change of a message, with the relay that took it. */
+    void record(int row, const QString &recipient, const QByteArray &hash, Status status, const QString &relay = QString());
+
+    /* Write the end record, sync and close. */
+    void finish(const QString &result);
+
+    /* Flush and fsync the records written so far. */
+    void sync();
+
+    bool isOpen() const { return m_file.isOpen(); }
+    QString fileName() const { return m_file.fileName(); }
+
+    /* Reading back. */
+    static QString directory();
+
+    /* Journals without an end record that no process is writing, newest first. */
+    static QStringList interrupted();
+    static bool load(const QString &fileName, QVariantMap *batch, QMap<int, Status> *rows, QMap<int, QString> *recipients = 0);
+    static void abandon(const QString &fileName, const QString &reason);
+    static void prune(int days);
+
+    static QString statusName(Status status);
+    static Status statusFromName(const QString &name);
+
+private:
+    void append(const QVariantMap &record);
+    void close();
+
+    /* Is the journal being written, in this or another process? */
+    static bool isLocked(const QString &fileName);
+
+    QFile m_file;
+    QLockFile *m_lock;
+    int m_unsynced;
+};
+
+#endif // OUTBOXJOURNAL_H
@@ -0,0 +1,215 @@
+#include "ratelimiter.h"
+
+#include <QtGlobal>
+
+/* Burst size, in seconds worth of the rate. */
+#define RATELIMITER_BURST_SECONDS   10.0
+
+/* Do not slow down twice for the same burst of throttling replies. */
+#define RATELIMITER_SLOWDOWN_MS     5000
+
+/* Speed up by 10% after this many good deliveries. */
+#define RATELIMITER_SPEEDUP_STREAK  20
+#define RATELIMITER_SPEEDUP_FACTOR  1.1
+
+/* DATA latency above twice the best seen (and 50 ms) counts as throttling. */
+#define RATELIMITER_LATENCY_FACTOR  2.0
+#define RATELIMITER_LATENCY_MIN_US  50000.0
+
+RateLimiter::RateLimiter(){
+
+    configure(0, 0);
+
+}
+
+void RateLimiter::configure(double messagesPerMinute, double bytesPerMinute){
+
+    m_maxMessageRate = qMax(0.0, messagesPerMinute);
+    m_maxByteRate = qMax(0.0, bytesPerMinute);
+    m_messageRate = m_maxMessageRate;
+    m_byteRate = m_maxByteRate;
+
+    m_messageTokens = qMax(1.0, m_messageRate / 60.0 * RATELIMITER_BURST_SECONDS);
+    m_byteTokens = m_byteRate / 60.0 * RATELIMITER_BURST_SECONDS;
+    m_lastRefill = -1;
+
+    m_windowStart = -1;
+    m_windowMessages = 0;
+    m_windowBytes = 0;
+
+    m_latencyAvg = 0;
+    m_latencyBase = 0;
+
+    m_goodStreak = 0;
+    m_lastSlowDown = -RATELIMITER_SLOWDOWN_MS;
+    m_throttled = 0;
+    m_waited = 0;
+
+}
+
+/* Add the tokens earned since the last refill. */
+void RateLimiter::refill(qint64 now){
+
+    if(m_lastRefill < 0){
+        m_lastRefill = now;
+    }
+
+    qint64 dt = now - m_lastRefill;
+    m_lastRefill = now;
+
+    if(m_messageRate > 0){
+        double capacity = qMax(1.0, m_messageRate / 60.0 * RATELIMITER_BURST_SECONDS);
+        m_messageTokens = qMin(capacity, m_messageTokens + m_messageRate / 60000.0 * dt);
+    }
+
+    if(m_byteRate > 0){
+        double capacity = m_byteRate / 60.0 * RATELIMITER_BURST_SECONDS;
+        m_byteTokens = qMin(capacity, m_byteTokens + m_byteRate / 60000.0 * dt);
+    }
+
+}
+
+qint64 RateLimiter::delay(qint64 bytes, qint64 now, int recipients){
+
+    refill(now);
+
+    double wait = 0;
+
+    if(m_messageRate > 0){
+        /* More recipients than the bucket holds wait for a full bucket and go into debt. */
+        double need = qMin((double)qMax(1, recipients), qMax(1.0, m_messageRate / 60.0 * RATELIMITER_BURST_SECONDS));
+        if(m_messageTokens < need){
+            wait = (need - m_messageTokens) / (m_messageRate / 60000.0);
+        }
+    }
+
+    if(m_byteRate > 0){
+        /* A message bigger than the bucket waits for a full bucket and goes into debt. */
+        double need = qMin((double)bytes, m_byteRate / 60.0 * RATELIMITER_BURST_SECONDS);
+        if(m_byteTokens < need){
+            wait = qMax(wait, (need - m_byteTokens) / (m_byteRate / 60000.0));
+        }
+    }
+
+    qint64 ms = (qint64)(wait + 0.5);
+    m_waited += ms;
+
+    return ms;
+
+}
+
+void RateLimiter::consume(qint64 bytes, qint64 now, int recipients){
+
+    refill(now);
+
+    /* Unlimited: nothing to take from, the bucket stays as it is. */
+    recipients = qMax(1, recipients);
+    if(m_messageRate > 0){
+        m_messageTokens -= recipients;
+    }
+    if(m_byteRate > 0){
+        m_byteTokens -= bytes;
+    }
+
+    /* Observed rate over (roughly) the last minute. */
+    if(m_windowStart < 0 || now - m_windowStart > 60000){
+        m_windowStart = now;
+        m_windowMessages = 0;
+        m_windowBytes = 0;
+    }
+    m_windowMessages += recipients;
+    m_windowBytes += bytes;
+
+}
+
+/* Lower the effective rate; an unlimited rate starts from the observed rate. */
+void RateLimiter::slowDown(double factor, qint64 now){
+
+    m_goodStreak = 0;
+
+    if(now - m_lastSlowDown < RATELIMITER_SLOWDOWN_MS){
+        return;
+    }
+    m_lastSlowDown = now;
+
+    double minutes = qMax((qint64)1000, now - m_windowStart) / 60000.0;
+
+    if(m_messageRate <= 0){
+        m_messageRate = m_windowMessages / minutes;
+        m_messageTokens = 0;
+    }
+    m_messageRate = qMax(1.0, m_messageRate * factor);
+    m_messageTokens = qMin(m_messageTokens, qMax(1.0, m_messageRate / 60.0 * RATELIMITER_BURST_SECONDS));
+
+    if(m_byteRate <= 0 && m_windowBytes > 0){
+        m_byteRate = m_windowBytes / minutes;
+        m_byteTokens = 0;
+    }
+    if(m_byteRate > 0){
+        m_byteRate = qMax(1024.0, m_byteRate * factor);
+        m_byteTokens = qMin(m_byteTokens, m_byteRate / 60.0 * RATELIMITER_BURST_SECONDS);
+    }
+
+}
+
+void RateLimiter::throttled(qint64 now){
+
+    m_throttled++;
+    slowDown(0.5, now);
+
+}
+
+void RateLimiter::delivered(qint64 dataLatencyUsecs, qint64 now){
+
+    /* Smoothed DATA latency and the best we have seen. */
+    if(m_latencyAvg <= 0){
+        m_latencyAvg = dataLatencyUsecs;
+    }
+    else{
+        m_latencyAvg = 0.8 * m_latencyAvg + 0.2 * dataLatencyUsecs;
+    }
+    if(m_latencyBase <= 0 || m_latencyAvg < m_latencyBase){
+        m_latencyBase = m_latencyAvg;
+    }
+
+    /* The relay is queueing: back off a bit before it starts refusing. */
+    if(m_latencyAvg > RATELIMITER_LATENCY_FACTOR * m_latencyBase && m_latencyAvg > RATELIMITER_LATENCY_MIN_US){
+        slowDown(0.8, now);
+        return;
+    }
+
+    /* Nothing to speed up when unlimited. */
+    if(m_messageRate <= 0 && m_byteRate <= 0){
+        return;
+    }
+
+    if(++m_goodStreak < RATELIMITER_SPEEDUP_STREAK){
+        return;
+    }
+    m_goodStreak = 0;
+
+    if(m_messageRate > 0){
+        m_messageRate *= RATELIMITER_SPEEDUP_FACTOR;
+        if(m_maxMessageRate > 0 && m_messageRate > m_maxMessageRate){
+            m_messageRate = m_maxMessageRate;
+        }
+    }
+
+    if(m_byteRate > 0){
+        m_byteRate *= RATELIMITER_SPEEDUP_FACTOR;
+        if(m_maxByteRate > 0 && m_byteRate > m_maxByteRate){
+            m_byteRate = m_maxByteRate;
+        }
+    }
+
+}
+
+QString RateLimiter::summary() const{
+
+    QString max = m_maxMessageRate > 0 ? QString::number(m_maxMessageRate, 'f', 0) : QString("unlimited");
+    QString now = m_messageRate > 0 ? QString::number(m_messageRate, 'f', 1) : QString("unlimited");
+
+    return QString("Rate limit: max %1 mails/min, ended at %2 mails/min, throttled %3 times, waited %4 s")
+               .arg(max).arg(now).arg(m_throttled).arg(m_waited / 1000.0, 0, 'f', 1);
+
+}
@@ -0,0 +1,80 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <QString>
+
+/*
+ * Adaptive token bucket for outbound mail.
+ *
+ * Limits the messages and bytes per minute to the configured maximum
+ * (0 is unlimited); a message to several recipients counts once per
+ * recipient, as the relay sees one RCPT TO each. The effective rate is lowered when the relay
+ * throttles (4xx replies) or when the DATA latency rises, and slowly
+ * raised again towards the maximum while delivery goes well.
+ *
+ * All times are in milliseconds on a clock of the caller's choice.
+ */
+class RateLimiter
+{
+public:
+    RateLimiter();
+
+    /* Maximum rate, 0 is unlimited. Resets the adaptation. */
+    void configure(double messagesPerMinute, double bytesPerMinute);
+
+    /*
+     * Milliseconds to wait before a message of `bytes` to `recipients`
+     * may be sent. Every recipient (RCPT TO) costs a message token.
+     */
+    qint64 delay(qint64 bytes, qint64 now, int recipients = 1);
+
+    /* A message of `bytes` to `recipients` was sent at `now`. */
+    void consume(qint64 bytes, qint64 now, int recipients = 1);
+
+    /* Feedback from the relay. */
+    void delivered(qint64 dataLatencyUsecs, qint64 now);
+    void throttled(qint64 now);
+
+    /* Current effective limit, 0 is unlimited. */
+    double messagesPerMinute() const { return m_messageRate; }
+    double bytesPerMinute() const { return m_byteRate; }
+
+    int throttleCount() const { return m_throttled; }
+    qint64 waited() const { return m_waited; }
+
+    /* One line for the report. */
+    QString summary() const;
+
+private:
+    void refill(qint64 now);
+    void slowDown(double factor, qint64 now);
+
+    /* Configured maximum, 0 is unlimited. */
+    double m_maxMessageRate;
+    double m_maxByteRate;
+
+    /* Effective rate, 0 is unlimited. */
+    double m_messageRate;
+    double m_byteRate;
+
+    /* Buckets. */
+    double m_messageTokens;
+    double m_byteTokens;
+    qint64 m_lastRefill;
+
+    /* Observed send rate, used when slowing down from unlimited. */
+    qint64 m_windowStart;
+    int m_windowMessages;
+    qint64 m_windowBytes;
+
+    /* DATA latency trend. */
+    double m_latencyAvg;
+    double m_latencyBase;
+
+    int m_goodStreak;
+    qint64 m_lastSlowDown;
+    int m_throttled;
+    qint64 m_waited;
+};
+
+#endif // RATELIMITER_H
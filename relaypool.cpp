@@ -0,0 +1,559 @@
+#include "relaypool.h"
+
+#include <QRegExp>
+#include <QEventLoop>
+#include <QTimer>
+
+/* Reconnect when a session drops: attempts and first backoff (doubles). */
+#define RELAYPOOL_RECONNECT_ATTEMPTS   5
+#define RELAYPOOL_RECONNECT_BACKOFF_MS 1000
+
+/* Deferred messages in a row before a relay is taken out. */
+#define RELAYPOOL_FAIL_LIMIT    3
+
+/* First outage of a relay, doubles on every next one up to the maximum. */
+#define RELAYPOOL_DOWN_MS       30000
+#define RELAYPOOL_DOWN_MAX_MS   600000
+
+/* A slow or failing relay keeps this share of its weight, to notice it recovered. */
+#define RELAYPOOL_MIN_SHARE     0.05
+
+RelayPool::RelayPool(){
+
+    m_haveCredentials = false;
+    m_last = NULL;
+    m_clock.start();
+
+}
+
+RelayPool::~RelayPool(){
+
+    clear();
+
+}
+
+bool RelayPool::addRelays(const QString &spec, int defaultPort, SmtpClient::ConnectionType defaultType){
+
+    QRegExp re(QString("^([^:/*]+)(?::(\\d+))?(?:/(ssl|tls|tcp))?(?:\\*(\\d+))?$"), Qt::CaseInsensitive);
+    bool ok = true;
+
+    foreach(QString entry, spec.split(QRegExp(QString("[,;\\s]+")), QString::SkipEmptyParts)){
+        if(!re.exactMatch(entry)){
+            ok = false;
+            continue;
+        }
+
+        int port = re.cap(2).isEmpty() ? defaultPort : re.cap(2).toInt();
+        if(port < 1 || port > 65535){
+            ok = false;
+            continue;
+        }
+
+        SmtpClient::ConnectionType type = defaultType;
+        QString t = re.cap(3).toLower();
+        if(t == QString("ssl")){
+            type = SmtpClient::SslConnection;
+        }
+        else if(t == QString("tls")){
+            type = SmtpClient::TlsConnection;
+        }
+        else if(t == QString("tcp")){
+            type = SmtpClient::TcpConnection;
+        }
+
+        addRelay(re.cap(1), port, type, re.cap(4).isEmpty() ? 1 : re.cap(4).toInt());
+    }
+
+    return ok;
+
+}
+
+void RelayPool::addRelay(const QString &host, int port, SmtpClient::ConnectionType type, int weight){
+
+    Relay r;
+    r.host = host;
+    r.port = port;
+    r.type = type;
+    r.weight = qMax(0, weight);
+    r.session = NULL;
+    r.connector = NULL;
+    r.latency = 0;
+    r.errors = 0;
+    r.failStreak = 0;
+    r.downUntil = 0;
+    r.downFor = 0;
+    r.current = 0;
+    r.delivered = 0;
+    r.deferred = 0;
+    r.failed = 0;
+    r.outages = 0;
+
+    m_relays.append(r);
+
+}
+
+void RelayPool::clear(){
+
+    for(int i = 0; i < m_relays.count(); i++){
+        /* Stops a connection that is being set up, closing its session. */
+        delete m_relays[i].connector;
+
+        /* Should quit() first, but that throws uncatchable exceptions. */
+        delete m_relays[i].session;
+    }
+
+    m_relays.clear();
+    m_last = NULL;
+    m_user.clear();
+    m_password.clear();
+    m_haveCredentials = false;
+    m_required.clear();
+
+}
+
+QString RelayPool::name(int i) const{
+
+    return m_relays.at(i).host + QString(":") + QString::number(m_relays.at(i).port);
+
+}
+
+void RelayPool::startConnect(BatchTimer *timer){
+
+    for(int i = 0; i < m_relays.count(); i++){
+        Relay &r = m_relays[i];
+        if(r.session != NULL || r.connector != NULL){
+            continue;
+        }
+
+        r.connector = new SmtpConnector(r.host, r.port, r.type, timer);
+        if(m_haveCredentials){
+            r.connector->setCredentials(m_user, m_password);
+        }
+        r.connector->start();
+    }
+
+}
+
+void RelayPool::setCredentials(const QString &user, const QString &password){
+
+    m_user = user;
+    m_password = password;
+    m_haveCredentials = true;
+
+    for(int i = 0; i < m_relays.count(); i++){
+        if(m_relays.at(i).connector != NULL){
+            m_relays.at(i).connector->setCredentials(user, password);
+        }
+    }
+
+}
+
+bool RelayPool::isConnecting() const{
+
+    foreach(const Relay &r, m_relays){
+        if(r.connector != NULL){
+            return true;
+        }
+    }
+
+    return false;
+
+}
+
+int RelayPool::finishConnect(SmtpConnector::Result *firstError){
+
+    *firstError = SmtpConnector::Connected;
+
+    /* They all connect at the same time, so this waits for the slowest one. */
+    for(int i = 0; i < m_relays.count(); i++){
+        Relay &r = m_relays[i];
+        if(r.connector == NULL){
+            continue;
+        }
+
+        SmtpConnector::Result result;
+        r.session = r.connector->take(&result);
+        delete r.connector;
+        r.connector = NULL;
+
+        if(r.session == NULL){
+            if(*firstError == SmtpConnector::Connected){
+                *firstError = result;
+            }
+            takeDown(i);
+        }
+    }
+
+    int n = 0;
+    foreach(const Relay &r, m_relays){
+        if(r.session != NULL){
+            n++;
+        }
+    }
+
+    return n;
+
+}
+
+bool RelayPool::connect(int i){
+
+    Relay &r = m_relays[i];
+    bool ok = false;
+
+    if(!m_haveCredentials){
+        return false;
+    }
+
+    /* Lib throws exceptions... */
+    try {
+        if(r.session == NULL){
+            r.session = new SmtpSession(r.host, r.port, r.type);
+            r.session->setUser(m_user);
+            r.session->setPassword(m_password);
+            ok = r.session->connectToHost() && r.session->login();
+        }
+        else{
+            ok = r.session->reconnect();
+        }
+    }
+    catch (...){
+        ok = false;
+    }
+
+    /* The mails may already be encoded for what the other relays accept. */
+    foreach(QString extension, m_required){
+        if(ok && !r.session->supports(extension)){
+            ok = false;
+        }
+    }
+
+    if(!ok){
+        takeDown(i);
+        return false;
+    }
+
+    r.downUntil = 0;
+    r.failStreak = 0;
+
+    return true;
+
+}
+
+SmtpSession *RelayPool::anySession() const{
+
+    foreach(const Relay &r, m_relays){
+        if(r.session != NULL){
+            return r.session;
+        }
+    }
+
+    return NULL;
+
+}
+
+bool RelayPool::isUp(int i) const{
+
+    return m_relays.at(i).downUntil <= m_clock.elapsed();
+
+}
+
+int RelayPool::pick(){
+
+    /* Standby relays (weight 0) only take over when no other relay is up. */
+    bool standbyOnly = true;
+    for(int i = 0; i < m_relays.count(); i++){
+        if(isUp(i) && m_relays.at(i).weight > 0){
+            standbyOnly = false;
+        }
+    }
+
+    /* The fastest relay sets the pace. */
+    double best = 0;
+    for(int i = 0; i < m_relays.count(); i++){
+        double latency = m_relays.at(i).latency;
+        if(isUp(i) && latency > 0 && (best <= 0 || latency < best)){
+            best = latency;
+        }
+    }
+
+    int chosen = -1;
+    double total = 0;
+    for(int i = 0; i < m_relays.count(); i++){
+        Relay &r = m_relays[i];
+        if(!isUp(i) || (r.weight == 0 && !standbyOnly)){
+            continue;
+        }
+
+        double share = 1.0 - r.errors;
+        if(best > 0 && r.latency > 0){
+            share *= best / r.latency;
+        }
+
+        double w = qMax(1, r.weight) * qMax(RELAYPOOL_MIN_SHARE, share);
+        r.current += w;
+        total += w;
+
+        if(chosen < 0 || r.current > m_relays.at(chosen).current){
+            chosen = i;
+        }
+    }
+
+    if(chosen >= 0){
+        m_relays[chosen].current -= total;
+    }
+
+    return chosen;
+
+}
+
+/*
+ * Retry the message on a new session when the connection dropped, e.g.
+ * after an idle timeout or a relay restart. A relay that drops out is
+ * taken out of the pool and the message goes to the next one right away;
+ * only when all relays are out, wait before the first one is tried again.
+ * The credentials are kept, so no need to ask again.
+ */
+SmtpSession::SendResult RelayPool::send(const QString &sender, const QStringList &recipients, const QByteArray &data, int *relay, BatchTimer *timer){
+
+    SmtpSession::SendResult ret = SmtpSession::SessionLost;
+
+    if(relay != NULL){
+        *relay = -1;
+    }
+
+    if(m_relays.isEmpty()){
+        return ret;
+    }
+
+    int backoff = RELAYPOOL_RECONNECT_BACKOFF_MS;
+    for(int attempt = 0; attempt <= RELAYPOOL_RECONNECT_ATTEMPTS; attempt++){
+
+        int r = pick();
+        if(r < 0){
+            /* Keeps the events of this thread running, e.g. the UI. */
+            QEventLoop loop;
+            QTimer::singleShot(backoff, &loop, SLOT(quit()));
+            loop.exec(QEventLoop::ExcludeUserInputEvents);
+
+            backoff *= 2;
+            r = standby();
+        }
+
+        SmtpSession *session = m_relays.at(r).session;
+        if(session == NULL || !session->isAlive() || session->sessionLost()){
+            ScopedTimer t(timer, "smtp.reconnect");
+            if(!connect(r)){
+                continue;
+            }
+            session = m_relays.at(r).session;
+        }
+
+        m_last = session;
+        if(relay != NULL){
+            *relay = r;
+        }
+
+        try {
+            ScopedTimer t(timer, "smtp.send");
+            session->sendData(sender, recipients, data);
+            ret = session->lastResult();
+        }
+        catch (...){
+            ret = SmtpSession::SessionLost;
+        }
+
+        result(r, ret, session->lastDataLatency());
+
+        /* Delivered, or answered by a working session: no use reconnecting. */
+        if(ret != SmtpSession::SessionLost){
+            break;
+        }
+    }
+
+    return ret;
+
+}
+
+int RelayPool::standby() const{
+
+    int first = -1;
+    for(int i = 0; i < m_relays.count(); i++){
+        if(first < 0 || m_relays.at(i).downUntil < m_relays.at(first).downUntil){
+            first = i;
+        }
+    }
+
+    return first;
+
+}
+
+void RelayPool::result(int i, SmtpSession::SendResult result, qint64 dataLatencyUsecs){
+
+    Relay &r = m_relays[i];
+
+    switch(result){
+      case SmtpSession::Delivered:
+        r.latency = r.latency <= 0 ? dataLatencyUsecs : 0.8 * r.latency + 0.2 * dataLatencyUsecs;
+        r.errors *= 0.9;
+        r.failStreak = 0;
+        r.downUntil = 0;
+        r.downFor = 0;
+        r.delivered++;
+        break;
+
+      case SmtpSession::TransientFailure:
+        r.errors = 0.9 * r.errors + 0.1;
+        r.deferred++;
+
+        /* With one relay there is nothing to fail over to, the retry queue waits. */
+        if(++r.failStreak >= RELAYPOOL_FAIL_LIMIT && m_relays.count() > 1){
+            takeDown(i);
+        }
+        break;
+
+      case SmtpSession::PermanentFailure:
+        /* Rejected recipient, says nothing about the relay. */
+        r.failed++;
+        break;
+
+      default:
+        r.errors = 0.9 * r.errors + 0.1;
+        takeDown(i);
+        break;
+    }
+
+}
+
+void RelayPool::takeDown(int i){
+
+    Relay &r = m_relays[i];
+
+    r.downFor = r.downFor > 0 ? qMin((qint64)RELAYPOOL_DOWN_MAX_MS, 2 * r.downFor) : RELAYPOOL_DOWN_MS;
+    r.downUntil = m_clock.elapsed() + r.downFor;
+    r.failStreak = 0;
+    r.current = 0;
+    r.outages++;
+
+}
+
+bool RelayPool::supports(const QString &extension) const{
+
+    if(m_relays.isEmpty()){
+        return false;
+    }
+
+    foreach(const Relay &r, m_relays){
+        if(r.session == NULL || !r.session->supports(extension)){
+            return false;
+        }
+    }
+
+    return true;
+
+}
+
+void RelayPool::resetStatistics(){
+
+    for(int i = 0; i < m_relays.count(); i++){
+        Relay &r = m_relays[i];
+        if(r.session != NULL){
+            r.session->resetStatistics();
+        }
+        r.delivered = 0;
+        r.deferred = 0;
+        r.failed = 0;
+        r.outages = 0;
+    }
+
+}
+
+qint64 RelayPool::bytesSent() const{
+
+    qint64 n = 0;
+    foreach(const Relay &r, m_relays){
+        if(r.session != NULL){
+            n += r.session->bytesSent();
+        }
+    }
+
+    return n;
+
+}
+
+int RelayPool::reconnects() const{
+
+    int n = 0;
+    foreach(const Relay &r, m_relays){
+        if(r.session != NULL){
+            n += r.session->reconnects();
+        }
+    }
+
+    return n;
+
+}
+
+QString RelayPool::summary() const{
+
+    QString txt = QString("%1 %2 %3 %4 %5 %6 %7 %8\n")
+                      .arg(QString("Relay"), -30)
+                      .arg(QString("Weight"), 6)
+                      .arg(QString("Sent"), 7)
+                      .arg(QString("Deferred"), 8)
+                      .arg(QString("Failed"), 7)
+                      .arg(QString("Outages"), 7)
+                      .arg(QString("DATA ms"), 8)
+                      .arg(QString("Errors"), 6);
+
+    for(int i = 0; i < m_relays.count(); i++){
+        const Relay &r = m_relays.at(i);
+        txt += QString("%1 %2 %3 %4 %5 %6 %7 %8%9\n")
+                   .arg(name(i), -30)
+                   .arg(r.weight, 6)
+                   .arg(r.delivered, 7)
+                   .arg(r.deferred, 8)
+                   .arg(r.failed, 7)
+                   .arg(r.outages, 7)
+                   .arg(r.latency / 1000.0, 8, 'f', 0)
+                   .arg(QString::number(r.errors * 100, 'f', 0) + QString("%"), 6)
+                   .arg(isUp(i) ? QString("") : QString(" (out)"));
+    }
+
+    return txt;
+
+}
+
+LatencyHistogram RelayPool::histogram(SmtpSession::Command c) const{
+
+    LatencyHistogram h;
+    foreach(const Relay &r, m_relays){
+        if(r.session != NULL){
+            h.merge(r.session->histogram(c));
+        }
+    }
+
+    return h;
+
+}
+
+QString RelayPool::histogramReport() const{
+
+    if(m_relays.count() == 1){
+        return m_relays.first().session != NULL ? m_relays.first().session->histogramReport() : QString("");
+    }
+
+    LatencyHistogram all[SmtpSession::NCommands];
+    for(int c = 0; c < SmtpSession::NCommands; c++){
+        all[c] = histogram((SmtpSession::Command)c);
+    }
+
+    QString txt = QString("All relays:\n") + SmtpSession::histogramReport(all) + QString("\n");
+    for(int i = 0; i < m_relays.count(); i++){
+        if(m_relays.at(i).session != NULL){
+            txt += name(i) + QString(":\n") + m_relays.at(i).session->histogramReport() + QString("\n");
+        }
+    }
+
+    return txt;
+
+}
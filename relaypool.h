@@ -0,0 +1,142 @@
+#ifndef RELAYPOOL_H
+#define RELAYPOOL_H
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QElapsedTimer>
+
+#include "smtpsession.h"
+#include "smtpconnector.h"
+#include "batchtimer.h"
+
+/*
+ * The SMTP relays of a batch, with their sessions.
+ *
+ * Relays are written as "host[:port][/ssl|tls|tcp][*weight]", separated
+ * by commas, semicolons or spaces; a weight of 0 makes a standby relay
+ * that is only used when all others are out. All relays share the login.
+ *
+ * Messages are spread by smooth weighted round robin. The weight of a
+ * relay is scaled by its DATA latency relative to the fastest relay and
+ * by its recent error rate, so a slow or failing relay gets less mail.
+ * A relay whose session is lost, or that defers RELAYPOOL_FAIL_LIMIT
+ * messages in a row, is taken out for a while (doubling on every
+ * outage) and the other relays take over its share.
+ */
+class RelayPool
+{
+public:
+    struct Relay {
+        QString host;
+        int port;
+        SmtpClient::ConnectionType type;
+        int weight;
+
+        SmtpSession *session;
+        SmtpConnector *connector;
+
+        /* Health: DATA latency (us) and error rate (0..1), smoothed. */
+        double latency;
+        double errors;
+        int failStreak;
+        qint64 downUntil;
+        qint64 downFor;
+
+        /* Smooth weighted round robin. */
+        double current;
+
+        /* Statistics of the batch. */
+        int delivered;
+        int deferred;
+        int failed;
+        int outages;
+    };
+
+    RelayPool();
+    ~RelayPool();
+
+    /* Add the relays of `spec`; false when an entry could not be read. */
+    bool addRelays(const QString &spec, int defaultPort, SmtpClient::ConnectionType defaultType);
+    void addRelay(const QString &host, int port, SmtpClient::ConnectionType type, int weight = 1);
+
+    /* Close all sessions and forget the relays. */
+    void clear();
+
+    int count() const { return m_relays.count(); }
+    const Relay &relay(int i) const { return m_relays.at(i); }
+    QString name(int i) const;
+
+    /*
+     * Connect to all relays on worker threads (see SmtpConnector); they
+     * log in as soon as the credentials are set. finishConnect() waits
+     * for all of them and returns the number of relays connected.
+     */
+    void startConnect(BatchTimer *timer = NULL);
+    void setCredentials(const QString &user, const QString &password);
+    bool hasCredentials() const { return m_haveCredentials; }
+    bool isConnecting() const;
+    int finishConnect(SmtpConnector::Result *firstError);
+
+    /* Connect (again) to relay i with the credentials set. */
+    bool connect(int i);
+
+    SmtpSession *session(int i) const { return m_relays.at(i).session; }
+
+    /* A connected session, the first relay that has one; NULL if none. */
+    SmtpSession *anySession() const;
+
+    /* The relay for the next message, -1 when all are out. */
+    int pick();
+
+    /* All relays are out: the one that is back first. */
+    int standby() const;
+
+    /*
+     * Send a serialized mail (see MailWriter) through the next relay,
+     * failing over and reconnecting as needed. `relay` is set to the
+     * relay that answered, -1 when none did.
+     */
+    SmtpSession::SendResult send(const QString &sender, const QStringList &recipients, const QByteArray &data,
+                                 int *relay = NULL, BatchTimer *timer = NULL);
+
+    /* The session of the last send(), NULL before the first one. */
+    SmtpSession *lastSession() const { return m_last; }
+
+    /* Outcome of a message sent through relay i. */
+    void result(int i, SmtpSession::SendResult result, qint64 dataLatencyUsecs);
+
+    bool isUp(int i) const;
+
+    /* Do the sessions of all relays support `extension`? */
+    bool supports(const QString &extension) const;
+
+    /* Connect only to relays that support these, e.g. "8BITMIME". */
+    void require(const QStringList &extensions) { m_required = extensions; }
+
+    /* Statistics of all sessions. */
+    void resetStatistics();
+    qint64 bytesSent() const;
+    int reconnects() const;
+
+    /* Latencies of a command over the sessions of all relays. */
+    LatencyHistogram histogram(SmtpSession::Command c) const;
+
+    /* Report: a line per relay, and the SMTP latencies of all relays and per relay. */
+    QString summary() const;
+    QString histogramReport() const;
+
+private:
+    void takeDown(int i);
+
+    QList<Relay> m_relays;
+    QElapsedTimer m_clock;
+    SmtpSession *m_last;
+
+    QString m_user;
+    QString m_password;
+    bool m_haveCredentials;
+    QStringList m_required;
+};
+
+#endif // RELAYPOOL_H
@@ -0,0 +1,110 @@
+#include "reportwriter.h"
+
+/* Output buffer of the compressor. */
+#define REPORTWRITER_BUFFER_SIZE (64 * 1024)
+
+ReportWriter::ReportWriter(){
+
+    m_open = false;
+    m_count = 0;
+    m_uncompressed = 0;
+    m_compressed = 0;
+
+}
+
+ReportWriter::~ReportWriter(){
+
+    if(m_open){
+        deflateEnd(&m_stream);
+    }
+
+}
+
+bool ReportWriter::open(const QString &name){
+
+    if(!m_dir.isValid()){
+        return false;
+    }
+
+    m_file.setFileName(m_dir.path() + QString("/") + name + QString(".txt.gz"));
+    if(!m_file.open(QIODevice::WriteOnly)){
+        return false;
+    }
+
+    /* 15 bits window, +16 for a gzip instead of a zlib header. */
+    m_stream.zalloc = Z_NULL;
+    m_stream.zfree = Z_NULL;
+    m_stream.opaque = Z_NULL;
+    if(deflateInit2(&m_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+        m_file.close();
+        return false;
+    }
+
+    m_open = true;
+
+    return true;
+
+}
+
+/* Compress and write what the compressor has ready. */
+bool ReportWriter::deflateData(const QByteArray &data, int flush){
+
+    char out[REPORTWRITER_BUFFER_SIZE];
+
+    m_stream.next_in = (Bytef*)data.constData();
+    m_stream.avail_in = data.size();
+
+    do {
+        m_stream.next_out = (Bytef*)out;
+        m_stream.avail_out = REPORTWRITER_BUFFER_SIZE;
+
+        if(deflate(&m_stream, flush) == Z_STREAM_ERROR){
+            return false;
+        }
+
+        qint64 n = REPORTWRITER_BUFFER_SIZE - m_stream.avail_out;
+        if(n > 0 && m_file.write(out, n) != n){
+            return false;
+        }
+        m_compressed += n;
+    } while(m_stream.avail_out == 0);
+
+    return true;
+
+}
+
+void ReportWriter::append(int row, const QString &header, const QByteArray &text, const QString &relay){
+
+    if(!m_open){
+        return;
+    }
+
+    QString title = QString::number(row) + (relay.isEmpty() ? QString("") : QString(" via ") + relay);
+    QByteArray data = QString("\n\n============================== " + title + " ==============================\n").toUtf8();
+    data += header.toUtf8();
+    data += text;
+
+    m_uncompressed += data.size();
+    deflateData(data, Z_NO_FLUSH);
+    m_count++;
+
+}
+
+bool ReportWriter::finish(){
+
+    if(!m_open){
+        return false;
+    }
+
+    QByteArray end = QString("\n============================== END ==============================\n").toUtf8();
+    m_uncompressed += end.size();
+
+    bool ok = deflateData(end, Z_FINISH);
+
+    deflateEnd(&m_stream);
+    m_open = false;
+    m_file.close();
+
+    return ok;
+
+}
@@ -0,0 +1,51 @@
+#ifndef REPORTWRITER_H
+#define REPORTWRITER_H
+
+#include <QFile>
+#include <QString>
+#include <QByteArray>
+#include <QTemporaryDir>
+
+#include <zlib.h>
+
+/*
+ * The generated mails of a batch, for the report.
+ *
+ * Every mail is gzip compressed into a file in a temporary directory
+ * as soon as its final status is known, so the report is never in
+ * memory as a whole. The file is attached to the report mail; the
+ * directory and file are removed with the writer.
+ */
+class ReportWriter
+{
+public:
+    ReportWriter();
+    ~ReportWriter();
+
+    /* Create <temporary directory>/<name>.txt.gz */
+    bool open(const QString &name);
+
+    /* A mail with its final status; `relay` is the SMTP server that took it. */
+    void append(int row, const QString &header, const QByteArray &text, const QString &relay = QString());
+    int count() const { return m_count; }
+
+    /* Flush the compressor and close the file. */
+    bool finish();
+
+    QString fileName() const { return m_file.fileName(); }
+    qint64 uncompressedSize() const { return m_uncompressed; }
+    qint64 compressedSize() const { return m_compressed; }
+
+private:
+    bool deflateData(const QByteArray &data, int flush);
+
+    QTemporaryDir m_dir;
+    QFile m_file;
+    z_stream m_stream;
+    bool m_open;
+    int m_count;
+    qint64 m_uncompressed;
+    qint64 m_compressed;
+};
+
+#endif // REPORTWRITER_H
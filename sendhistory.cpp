@@ -0,0 +1,132 @@
+#include "sendhistory.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QFile>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+
+/* File format: magic, version, course code, subject, hashes. */
+#define SENDHISTORY_MAGIC   0x53484953
+#define SENDHISTORY_VERSION 1
+
+SendHistory::SendHistory(){
+
+    m_loaded = false;
+
+}
+
+QString SendHistory::directory(){
+
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + QString("/history");
+
+}
+
+/* Course code and subject may contain anything, so name the file after a hash. */
+QString SendHistory::fileName() const{
+
+    QByteArray key = m_courseCode.toUtf8() + '\n' + m_subject.toUtf8();
+    QByteArray name = QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex();
+
+    return directory() + QString("/") + QString::fromLatin1(name) + QString(".history");
+
+}
+
+bool SendHistory::isLoaded(const QString &courseCode, const QString &subject) const{
+
+    return m_loaded && m_courseCode == courseCode && m_subject == subject;
+
+}
+
+bool SendHistory::load(const QString &courseCode, const QString &subject){
+
+    m_courseCode = courseCode;
+    m_subject = subject;
+    m_hashes.clear();
+    m_loaded = true;
+
+    QFile f(fileName());
+    if(!f.open(QIODevice::ReadOnly)){
+        return false;
+    }
+
+    QDataStream in(&f);
+    in.setVersion(QDataStream::Qt_5_0);
+
+    quint32 magic, version;
+    QString courseCodeIn, subjectIn;
+    in >> magic >> version;
+    if(magic != SENDHISTORY_MAGIC || version != SENDHISTORY_VERSION){
+        return false;
+    }
+
+    /* Guard against (unlikely) hash collisions of the file name. */
+    in >> courseCodeIn >> subjectIn;
+    if(courseCodeIn != courseCode || subjectIn != subject){
+        return false;
+    }
+
+    in >> m_hashes;
+    if(in.status() != QDataStream::Ok){
+        m_hashes.clear();
+        return false;
+    }
+
+    return true;
+
+}
+
+/* Write to a temporary file first, a crash never leaves half a history. */
+bool SendHistory::save() const{
+
+    if(!m_loaded || !QDir().mkpath(directory())){
+        return false;
+    }
+
+    QSaveFile f(fileName());
+    if(!f.open(QIODevice::WriteOnly)){
+        return false;
+    }
+
+    QDataStream out(&f);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << (quint32)SENDHISTORY_MAGIC << (quint32)SENDHISTORY_VERSION;
+    out << m_courseCode << m_subject << m_hashes;
+
+    return f.commit();
+
+}
+
+bool SendHistory::unchanged(const QString &recipient, const QByteArray &hash) const{
+
+    QHash<QString, QByteArray>::const_iterator it = m_hashes.constFind(recipient.toLower());
+
+    return it != m_hashes.constEnd() && it.value() == hash;
+
+}
+
+/* Addresses are compared case-insensitive. */
+void SendHistory::insert(const QString &recipient, const QByteArray &hash){
+
+    m_hashes.insert(recipient.toLower(), hash);
+
+}
+
+QByteArray SendHistory::mailHash(const QByteArray &mailText, const QStringList &attachments){
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(mailText);
+
+    foreach(QString file, attachments){
+        QFileInfo fInfo(file);
+        hash.addData(QByteArray(1, '\0'));
+        hash.addData(fInfo.fileName().toUtf8());
+        hash.addData(QByteArray::number(fInfo.size()));
+        hash.addData(QByteArray::number(fInfo.lastModified().toMSecsSinceEpoch()));
+    }
+
+    return hash.result();
+
+}
@@ -0,0 +1,47 @@
+#ifndef SENDHISTORY_H
+#define SENDHISTORY_H
+
+#include <QHash>
+#include <QString>
+#include <QByteArray>
+#include <QStringList>
+
+/*
+ * Content hashes of the mails sent before, per recipient.
+ *
+ * One file per course code and subject in <AppDataLocation>/history,
+ * so a second run of the same mail can skip everyone whose mail did not
+ * change. Only delivered mails are recorded.
+ */
+class SendHistory
+{
+public:
+    SendHistory();
+
+    /* Read the history of a course and subject; empty when there is none. */
+    bool load(const QString &courseCode, const QString &subject);
+    bool save() const;
+
+    bool isLoaded(const QString &courseCode, const QString &subject) const;
+
+    /* Was exactly this mail delivered to the recipient before? */
+    bool unchanged(const QString &recipient, const QByteArray &hash) const;
+    void insert(const QString &recipient, const QByteArray &hash);
+
+    int count() const { return m_hashes.count(); }
+
+    static QString directory();
+
+    /* Hash of a mail: its text and the name, size and date of its attachments. */
+    static QByteArray mailHash(const QByteArray &mailText, const QStringList &attachments);
+
+private:
+    QString fileName() const;
+
+    bool m_loaded;
+    QString m_courseCode;
+    QString m_subject;
+    QHash<QString, QByteArray> m_hashes;
+};
+
+#endif // SENDHISTORY_H
@@ -0,0 +1,65 @@
+#include "shard.h"
+
+#include <QRegExp>
+#include <QByteArray>
+
+/* 64-bit FNV-1a, the same on every machine and Qt version (unlike qHash). */
+#define SHARD_FNV_OFFSET 14695981039346656037ULL
+#define SHARD_FNV_PRIME  1099511628211ULL
+
+Shard::Shard(){
+
+    m_index = 1;
+    m_count = 1;
+
+}
+
+bool Shard::parse(const QString &spec){
+
+    QRegExp re(QString("^\\s*(\\d+)\\s*/\\s*(\\d+)\\s*$"));
+    if(!re.exactMatch(spec)){
+        return false;
+    }
+
+    int index = re.cap(1).toInt();
+    int count = re.cap(2).toInt();
+    if(count < 1 || index < 1 || index > count){
+        return false;
+    }
+
+    m_index = index;
+    m_count = count;
+
+    return true;
+
+}
+
+bool Shard::contains(const QString &address) const{
+
+    return m_count == 1 || of(address, m_count) == m_index;
+
+}
+
+QString Shard::toString() const{
+
+    if(m_count == 1){
+        return QString("");
+    }
+
+    return QString::number(m_index) + QString("/") + QString::number(m_count);
+
+}
+
+int Shard::of(const QString &address, int count){
+
+    QByteArray key = address.trimmed().toLower().toUtf8();
+
+    quint64 h = SHARD_FNV_OFFSET;
+    for(int i = 0; i < key.size(); i++){
+        h ^= (uchar)key.at(i);
+        h *= SHARD_FNV_PRIME;
+    }
+
+    return (int)(h % (quint64)count) + 1;
+
+}
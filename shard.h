@@ -0,0 +1,41 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <QString>
+
+/*
+ * One slice of a batch that is sent by several processes or machines.
+ *
+ * Written as "i/N", 1 <= i <= N. A recipient belongs to exactly one
+ * shard, chosen by a hash of the lower-case address. So every process
+ * that loads the same workbook gets the same, disjoint slices, whatever
+ * row range or changes in row order. The default shard "1/1" is the
+ * whole batch.
+ */
+class Shard
+{
+public:
+    Shard();
+
+    /* Parse "i/N"; false (and the shard unchanged) when it is not valid. */
+    bool parse(const QString &spec);
+
+    bool isAll() const { return m_count == 1; }
+    int index() const { return m_index; }
+    int count() const { return m_count; }
+
+    /* Does the mail to `address` belong to this shard? */
+    bool contains(const QString &address) const;
+
+    /* "i/N", empty for the whole batch. */
+    QString toString() const;
+
+    /* The shard of an address, 1..count. */
+    static int of(const QString &address, int count);
+
+private:
+    int m_index;
+    int m_count;
+};
+
+#endif // SHARD_H
@@ -0,0 +1,233 @@
+#include "shardmerge.h"
+#include "outboxjournal.h"
+#include "shard.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QVariantMap>
+#include <QMap>
+#include <QSet>
+
+/* Copy the reports in blocks of this size. */
+#define SHARDMERGE_BUFFER_SIZE (64 * 1024)
+
+/* Batch fields that must be the same in all shards. */
+static const char *shardMergeSame[] = { "workbook", "sheet", "template", "subject", "courseCode", 0 };
+
+bool ShardMerge::merge(const QStringList &journals, const QString &output, QString *summary){
+
+    bool ok = true;
+    QString warnings;
+
+    QFile report(output + QString(".txt.gz"));
+    if(!report.open(QIODevice::WriteOnly | QIODevice::Truncate)){
+        *summary = QString("Can not write ") + report.fileName() + QString("\n");
+        return false;
+    }
+
+    QVariantMap first;
+    bool haveFirst = false;
+    QByteArray messages;
+    QSet<int> rows;
+    QMap<int, QString> rowShard;
+    QMap<QString, QString> shards;
+    QVariantList ids;
+    int shardCount = 0;
+    int overlap = 0;
+    int total[5] = { 0, 0, 0, 0, 0 };
+
+    QString table = QString("%1 %2 %3 %4 %5 %6 %7  %8\n")
+                        .arg(QString("Shard"), -6)
+                        .arg(QString("Journal"), -28)
+                        .arg(QString("Mails"), 7)
+                        .arg(QString("Delivered"), 9)
+                        .arg(QString("Deferred"), 8)
+                        .arg(QString("Failed"), 7)
+                        .arg(QString("Open"), 6)
+                        .arg(QString("Result"));
+
+    foreach(QString fileName, journals){
+        QFile f(fileName);
+        if(!f.open(QIODevice::ReadOnly)){
+            warnings += QString("Can not read ") + fileName + QString("\n");
+            ok = false;
+            continue;
+        }
+
+        /* Same rules as OutboxJournal::load(), keeping the records as they are. */
+        QVariantMap batch;
+        bool haveBatch = false;
+        QString result = QString("interrupted");
+        QMap<int, OutboxJournal::Status> status;
+        QByteArray records;
+
+        while(!f.atEnd()){
+            QByteArray line = f.readLine().trimmed();
+            QJsonObject o = QJsonDocument::fromJson(line).object();
+            QString type = o.value(QString("type")).toString();
+
+            if(type == QString("batch")){
+                batch = o.toVariantMap();
+                haveBatch = true;
+            }
+            else if(type == QString("message")){
+                status.insert(o.value(QString("row")).toInt(), OutboxJournal::statusFromName(o.value(QString("status")).toString()));
+                records += line;
+                records += '\n';
+            }
+            else if(type == QString("end")){
+                result = o.value(QString("result")).toString();
+            }
+        }
+
+        if(!haveBatch){
+            warnings += QString("No batch record in ") + fileName + QString("\n");
+            ok = false;
+            continue;
+        }
+
+        /* A journal without a shard is the whole batch. */
+        Shard shard;
+        shard.parse(batch.value(QString("shard")).toString());
+        QString label = QString::number(shard.index()) + QString("/") + QString::number(shard.count());
+
+        if(shardCount == 0){
+            shardCount = shard.count();
+        }
+        else if(shard.count() != shardCount){
+            warnings += QString("Shard ") + label + QString(" of ") + fileName + QString(" is not one of ") + QString::number(shardCount) + QString("\n");
+        }
+        if(shards.contains(label)){
+            warnings += QString("Shard ") + label + QString(" twice: ") + shards.value(label) + QString(" and ") + fileName + QString("\n");
+        }
+        shards.insert(label, fileName);
+
+        if(!haveFirst){
+            first = batch;
+            haveFirst = true;
+        }
+        for(int i = 0; shardMergeSame[i] != 0; i++){
+            QString key = QString(shardMergeSame[i]);
+            if(batch.value(key) != first.value(key)){
+                warnings += QString("Different ") + key + QString(" in ") + fileName + QString("\n");
+            }
+        }
+
+        foreach(QVariant row, batch.value(QString("rows")).toList()){
+            rows.insert(row.toInt());
+        }
+        ids.append(batch.value(QString("id")));
+
+        /* The last status of every row, and rows that another shard has as well. */
+        int count[5] = { 0, 0, 0, 0, 0 };
+        QMap<int, OutboxJournal::Status>::const_iterator it;
+        for(it = status.constBegin(); it != status.constEnd(); ++it){
+            count[it.value()]++;
+            total[it.value()]++;
+            if(rowShard.contains(it.key())){
+                overlap++;
+            }
+            else{
+                rowShard.insert(it.key(), label);
+            }
+        }
+
+        table += QString("%1 %2 %3 %4 %5 %6 %7  %8\n")
+                     .arg(label, -6)
+                     .arg(QFileInfo(fileName).fileName(), -28)
+                     .arg(status.count(), 7)
+                     .arg(count[OutboxJournal::Delivered], 9)
+                     .arg(count[OutboxJournal::Deferred], 8)
+                     .arg(count[OutboxJournal::Failed], 7)
+                     .arg(count[OutboxJournal::Queued] + count[OutboxJournal::Sending], 6)
+                     .arg(result);
+
+        messages += records;
+
+        /* The report copy next to the journal. */
+        QFileInfo fi(fileName);
+        QFile part(fi.path() + QString("/") + fi.completeBaseName() + QString(".txt.gz"));
+        if(!part.open(QIODevice::ReadOnly)){
+            warnings += QString("No report for ") + fileName + QString("\n");
+            continue;
+        }
+        while(!part.atEnd()){
+            QByteArray data = part.read(SHARDMERGE_BUFFER_SIZE);
+            if(report.write(data) != data.size()){
+                ok = false;
+            }
+        }
+    }
+
+    report.close();
+
+    for(int i = 1; i <= shardCount; i++){
+        QString label = QString::number(i) + QString("/") + QString::number(shardCount);
+        if(!shards.contains(label)){
+            warnings += QString("Shard ") + label + QString(" is missing\n");
+        }
+    }
+    if(overlap > 0){
+        warnings += QString::number(overlap) + QString(" rows are in more than one shard\n");
+    }
+
+    int mails = total[OutboxJournal::Queued] + total[OutboxJournal::Sending] + total[OutboxJournal::Delivered] +
+                total[OutboxJournal::Deferred] + total[OutboxJournal::Failed];
+    table += QString("%1 %2 %3 %4 %5 %6 %7\n")
+                 .arg(QString("Total"), -6)
+                 .arg(QString(""), -28)
+                 .arg(mails, 7)
+                 .arg(total[OutboxJournal::Delivered], 9)
+                 .arg(total[OutboxJournal::Deferred], 8)
+                 .arg(total[OutboxJournal::Failed], 7)
+                 .arg(total[OutboxJournal::Queued] + total[OutboxJournal::Sending], 6);
+
+    *summary = QString("Batch: [") + first.value(QString("courseCode")).toString() + QString("] ") +
+               first.value(QString("subject")).toString() + QString("\n") +
+               QString("Workbook: ") + first.value(QString("workbook")).toString() +
+               QString(" (") + first.value(QString("sheet")).toString() + QString(")\n\n") +
+               table + (warnings.isEmpty() ? QString("") : QString("\n") + warnings);
+
+    /* The merged journal: it reads like the journal of one batch. */
+    QFile journal(output + QString(".journal"));
+    if(!haveFirst || !journal.open(QIODevice::WriteOnly | QIODevice::Truncate)){
+        return false;
+    }
+
+    QList<int> sorted = rows.toList();
+    qSort(sorted);
+    QVariantList allRows;
+    foreach(int row, sorted){
+        allRows.append(row);
+    }
+
+    QVariantMap batch = first;
+    batch.remove(QString("shard"));
+    batch.insert(QString("id"), QFileInfo(output).fileName());
+    batch.insert(QString("shards"), ids);
+    batch.insert(QString("rows"), allRows);
+
+    QVariantMap end;
+    end.insert(QString("type"), QString("end"));
+    end.insert(QString("result"), QString("merged"));
+    end.insert(QString("finished"), QDateTime::currentDateTime().toString(Qt::ISODate));
+
+    journal.write(QJsonDocument(QJsonObject::fromVariantMap(batch)).toJson(QJsonDocument::Compact));
+    journal.write("\n");
+    journal.write(messages);
+    journal.write(QJsonDocument(QJsonObject::fromVariantMap(end)).toJson(QJsonDocument::Compact));
+    journal.write("\n");
+    journal.close();
+
+    QFile text(output + QString(".txt"));
+    if(!text.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)){
+        return false;
+    }
+    text.write(summary->toUtf8());
+
+    return ok && journal.error() == QFile::NoError;
+
+}
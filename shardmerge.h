@@ -0,0 +1,30 @@
+#ifndef SHARDMERGE_H
+#define SHARDMERGE_H
+
+#include <QString>
+#include <QStringList>
+
+/*
+ * Combine the shards of one batch into one journal and one report.
+ *
+ * Every shard leaves a journal in the outbox (see OutboxJournal) and,
+ * next to it, a copy of its report with the same name and ".txt.gz".
+ * merge() writes:
+ *
+ *   <output>.journal  the batch record of the first shard, the message
+ *                     records of all shards and an end record
+ *   <output>.txt.gz   the reports of all shards; gzip files may simply
+ *                     be concatenated
+ *   <output>.txt      the summary: mails per status and shard, and what
+ *                     does not add up (missing or double shards, rows
+ *                     in more than one shard, a different workbook,
+ *                     sheet, template or subject)
+ */
+class ShardMerge
+{
+public:
+    /* False when a journal could not be read or an output not written. */
+    static bool merge(const QStringList &journals, const QString &output, QString *summary);
+};
+
+#endif // SHARDMERGE_H
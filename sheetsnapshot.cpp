@@ -0,0 +1,151 @@
+#include "sheetsnapshot.h"
+#include "snapshotmodel.h"
+
+static const QByteArray invalidReference("[INV_REF!]");
+static const QByteArray emptyValue;
+
+SheetSnapshot::SheetSnapshot(){
+
+    m_rows = 0;
+    m_cols = 0;
+
+}
+
+SheetSnapshot::SheetSnapshot(const QAbstractItemModel *model){
+
+    m_rows = 0;
+    m_cols = 0;
+    load(model);
+
+}
+
+void SheetSnapshot::clear(){
+
+    m_cells.clear();
+    m_data.clear();
+    m_offsets.clear();
+    m_rows = 0;
+    m_cols = 0;
+
+}
+
+/* Row by row, the values are stored in the same order. */
+void SheetSnapshot::load(const QAbstractItemModel *model){
+
+    clear();
+    if(model == NULL){
+        return;
+    }
+
+    /* Already a snapshot, e.g. from a database: shared, not copied. */
+    if(const SnapshotModel *snapshotModel = qobject_cast<const SnapshotModel *>(model)){
+        *this = snapshotModel->snapshot();
+        return;
+    }
+
+    m_rows = model->rowCount();
+    m_cols = model->columnCount();
+    m_cells.resize(m_rows * m_cols);
+
+    QByteArray *c = m_cells.data();
+    for(int row = 0; row < m_rows; row++){
+        for(int col = 0; col < m_cols; col++){
+            *c++ = model->data(model->index(row, col)).toString().toUtf8();
+        }
+    }
+
+}
+
+void SheetSnapshot::reset(int columns){
+
+    clear();
+    m_cols = columns;
+
+}
+
+void SheetSnapshot::reserve(int rows){
+
+    m_cells.reserve(rows * m_cols);
+
+}
+
+/* The cells of a new last row, to be filled in. */
+QByteArray *SheetSnapshot::appendRow(){
+
+    m_rows++;
+    m_cells.resize(m_rows * m_cols);
+
+    return m_cells.data() + (m_rows - 1) * m_cols;
+
+}
+
+void SheetSnapshot::resize(int rows){
+
+    m_rows = rows;
+    m_cells.resize(m_rows * m_cols);
+
+}
+
+QByteArray *SheetSnapshot::row(int row){
+
+    return m_cells.data() + (row - 1) * m_cols;
+
+}
+
+/* The offsets of the cells, and the end of the last one. */
+void SheetSnapshot::resizePacked(int rows, int bytes){
+
+    m_cells.clear();
+    m_rows = rows;
+    m_data.resize(bytes);
+    m_offsets.resize(m_rows * m_cols > 0 ? m_rows * m_cols + 1 : 0);
+    if(!m_offsets.isEmpty()){
+        m_offsets.last() = bytes;
+    }
+
+}
+
+/* Same ranges as MainWindow::getData(). */
+int SheetSnapshot::index(int row, int col) const{
+
+    if(row < 0 || col < 0 || row > m_rows || col > m_cols || m_rows * m_cols == 0){
+        return -2;
+    }
+
+    if(row == 0 || col == 0){
+        return -1;
+    }
+
+    return (row - 1) * m_cols + (col - 1);
+
+}
+
+QByteArray SheetSnapshot::cell(int row, int col) const{
+
+    int i = index(row, col);
+    if(i < 0){
+        return i == -1 ? emptyValue : invalidReference;
+    }
+
+    if(!m_offsets.isEmpty()){
+        return QByteArray(m_data.constData() + m_offsets.at(i), m_offsets.at(i + 1) - m_offsets.at(i));
+    }
+
+    return m_cells.at(i);
+
+}
+
+void SheetSnapshot::appendCell(int row, int col, QByteArray *out) const{
+
+    int i = index(row, col);
+    if(i < 0){
+        out->append(i == -1 ? emptyValue : invalidReference);
+    }
+    else if(!m_offsets.isEmpty()){
+        out->append(m_data.constData() + m_offsets.at(i), m_offsets.at(i + 1) - m_offsets.at(i));
+    }
+    else{
+        out->append(m_cells.at(i));
+    }
+
+}
@@ -0,0 +1,62 @@
+#ifndef SHEETSNAPSHOT_H
+#define SHEETSNAPSHOT_H
+
+#include <QVector>
+#include <QByteArray>
+#include <QAbstractItemModel>
+
+/*
+ * The values of a sheet, as UTF-8.
+ *
+ * Every cell is read from the model and converted once. Rendering a
+ * batch then only copies bytes, instead of a model lookup, a QVariant
+ * and a conversion for every field of every mail.
+ *
+ * A large source can store its values packed instead: all of them in
+ * one array, cell i from offset i up to offset i + 1, so there is no
+ * allocation per cell.
+ */
+class SheetSnapshot
+{
+public:
+    SheetSnapshot();
+    SheetSnapshot(const QAbstractItemModel *model);
+
+    void load(const QAbstractItemModel *model);
+    void clear();
+
+    /* Build a snapshot row by row from another source, see SqlSource. */
+    void reset(int columns);
+    void reserve(int rows);
+    QByteArray *appendRow();
+
+    /* Or all rows at once, empty, and then filled in per row (1-based). */
+    void resize(int rows);
+    QByteArray *row(int row);
+
+    /* Or packed: all rows at once with `bytes` bytes of values, filled in by the source, see CsvSource. */
+    void resizePacked(int rows, int bytes);
+    char *packedData() { return m_data.data(); }
+    int *packedOffsets() { return m_offsets.data(); }
+
+    int rowCount() const { return m_rows; }
+    int columnCount() const { return m_cols; }
+
+    /* Value at row, col (1-based), "[INV_REF!]" when out of range. */
+    QByteArray cell(int row, int col) const;
+
+    /* The same, appended to `out` without a copy in between. */
+    void appendCell(int row, int col, QByteArray *out) const;
+
+private:
+    /* Index of a cell, -1 for row or column 0 (empty), -2 when out of range. */
+    int index(int row, int col) const;
+
+    QVector<QByteArray> m_cells;
+    QByteArray m_data;
+    QVector<int> m_offsets;
+    int m_rows;
+    int m_cols;
+};
+
+#endif // SHEETSNAPSHOT_H
@@ -0,0 +1,139 @@
+#include "smtpconnector.h"
+
+#include <QCoreApplication>
+
+/* How often the event loop runs while waiting for the connection. */
+#define SMTPCONNECTOR_POLL_MS 20
+
+SmtpConnector::SmtpConnector(const QString &host, int port, SmtpClient::ConnectionType ct, BatchTimer *timer) :
+    m_host(host), m_port(port), m_type(ct), m_timer(timer)
+{
+    m_target = QThread::currentThread();
+    m_haveCredentials = false;
+    m_cancelled = false;
+    m_connecting = NULL;
+    m_session = NULL;
+    m_result = ConnectFailed;
+}
+
+/* A session that was not taken is closed with the connector, without waiting for a timeout. */
+SmtpConnector::~SmtpConnector(){
+
+    cancel();
+    wait();
+
+    delete m_session;
+
+}
+
+void SmtpConnector::setCredentials(const QString &user, const QString &password){
+
+    QMutexLocker lock(&m_mutex);
+    m_user = user;
+    m_password = password;
+    m_haveCredentials = true;
+    m_ready.wakeAll();
+
+}
+
+bool SmtpConnector::hasCredentials(){
+
+    QMutexLocker lock(&m_mutex);
+    return m_haveCredentials;
+
+}
+
+void SmtpConnector::cancel(){
+
+    QMutexLocker lock(&m_mutex);
+    m_cancelled = true;
+    if(m_connecting != NULL){
+        m_connecting->abort();
+    }
+    m_ready.wakeAll();
+
+}
+
+SmtpSession *SmtpConnector::take(Result *result){
+
+    while(!wait(SMTPCONNECTOR_POLL_MS)){
+        QCoreApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
+    }
+
+    SmtpSession *session = m_session;
+    m_session = NULL;
+    *result = m_result;
+
+    return session;
+
+}
+
+void SmtpConnector::run(){
+
+    SmtpSession *session = NULL;
+    m_result = ConnectFailed;
+
+    /* Lib throws exceptions... */
+    try {
+        /* Created here, so its socket belongs to this thread. */
+        session = new SmtpSession(m_host, m_port, m_type);
+        {
+            QMutexLocker lock(&m_mutex);
+            m_connecting = session;
+            if(m_cancelled){
+                session->abort();
+            }
+        }
+
+        bool connected;
+        {
+            ScopedTimer t(m_timer, "smtp.connect");
+            connected = session->connectToHost();
+        }
+
+        /* Wait for the credentials, or for the user to give up. */
+        QString user, password;
+        bool cancelled;
+        {
+            QMutexLocker lock(&m_mutex);
+            while(connected && !m_haveCredentials && !m_cancelled){
+                m_ready.wait(&m_mutex);
+            }
+            user = m_user;
+            password = m_password;
+            cancelled = m_cancelled;
+        }
+
+        if(!connected){
+            m_result = ConnectFailed;
+        }
+        else if(cancelled){
+            m_result = Cancelled;
+        }
+        else{
+            session->setUser(user);
+            session->setPassword(password);
+
+            ScopedTimer t(m_timer, "smtp.login");
+            m_result = session->login() ? Connected : LoginFailed;
+        }
+    }
+    catch (...){
+        m_result = ConnectFailed;
+    }
+
+    {
+        QMutexLocker lock(&m_mutex);
+        m_connecting = NULL;
+    }
+
+    if(m_result != Connected){
+        delete session;
+        return;
+    }
+
+    /* Hand the session, with its socket, over to the waiting thread. */
+    session->moveToThread(m_target);
+    m_session = session;
+
+}
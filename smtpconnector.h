@@ -0,0 +1,72 @@
+#ifndef SMTPCONNECTOR_H
+#define SMTPCONNECTOR_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include "smtpsession.h"
+#include "batchtimer.h"
+
+/*
+ * Connects and logs in to the SMTP server on a worker thread.
+ *
+ * The TCP connect, greeting, EHLO and STARTTLS start right away, while
+ * the user is asked for the credentials and the mails are rendered.
+ * AUTH follows as soon as both the handshake is done and the
+ * credentials are set. The finished session is moved to the thread
+ * that created the connector and handed over by take().
+ */
+class SmtpConnector : public QThread
+{
+    Q_OBJECT
+
+public:
+    enum Result {
+        Connected,
+        ConnectFailed,
+        LoginFailed,
+        Cancelled
+    };
+
+    SmtpConnector(const QString &host, int port, SmtpClient::ConnectionType ct, BatchTimer *timer = NULL);
+    ~SmtpConnector();
+
+    /* Log in with these, once the handshake is done. */
+    void setCredentials(const QString &user, const QString &password);
+    bool hasCredentials();
+
+    /* Give up: no login, a connect in progress is aborted and the session closed. */
+    void cancel();
+
+    /*
+     * Wait until connected and logged in, keeping the event loop
+     * running. The caller owns the session; NULL when it failed.
+     */
+    SmtpSession *take(Result *result);
+
+protected:
+    void run();
+
+private:
+    QString m_host;
+    int m_port;
+    SmtpClient::ConnectionType m_type;
+    BatchTimer *m_timer;
+    QThread *m_target;
+
+    QMutex m_mutex;
+    QWaitCondition m_ready;
+    QString m_user;
+    QString m_password;
+    bool m_haveCredentials;
+    bool m_cancelled;
+
+    /* The session while it connects and logs in, to abort it. */
+    SmtpSession *m_connecting;
+
+    SmtpSession *m_session;
+    Result m_result;
+};
+
+#endif // SMTPCONNECTOR_H
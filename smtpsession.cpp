@@ -0,0 +1,616 @@
+#include "smtpsession.h"
+#include "mailwriter.h"
+#include "tlssessioncache.h"
+
+#include <QSslSocket>
+#include <QElapsedTimer>
+
+/* Send streamed messages in chunks of this size. */
+#define SMTPSESSION_CHUNK_SIZE (64 * 1024)
+
+/* Longest wait on the socket before abort() is looked at. */
+#define SMTPSESSION_ABORT_POLL_MS 100
+
+SmtpSession::SmtpSession(const QString &host, int port, ConnectionType ct) :
+    SmtpClient(host, port, ct)
+{
+    resetStatistics();
+
+    /* Direct, to see the session before tickets that follow the handshake replace it. */
+    if(ct != TcpConnection){
+        connect(socket, SIGNAL(encrypted()), this, SLOT(tlsEncrypted()), Qt::DirectConnection);
+    }
+}
+
+void SmtpSession::resetStatistics(){
+
+    for(int i = 0; i < NCommands; i++){
+        m_histograms[i].clear();
+    }
+    m_bytesSent = 0;
+    m_messagesSent = 0;
+    m_reconnects = 0;
+    m_sessionLost = false;
+    m_lastResult = Delivered;
+    m_lastReplyCode = 0;
+    m_lastMessageSize = 0;
+    m_lastDataLatency = 0;
+
+}
+
+bool SmtpSession::isAlive() const{
+
+    if(socket->state() != QAbstractSocket::ConnectedState){
+        return false;
+    }
+
+    if(connectionType != TcpConnection && !((QSslSocket*)socket)->isEncrypted()){
+        return false;
+    }
+
+    return true;
+
+}
+
+/* Drop whatever is left of the old connection and start over. */
+bool SmtpSession::reconnect(){
+
+    m_reconnects++;
+
+    /* Stays lost until we are logged in again. */
+    m_sessionLost = true;
+
+    socket->abort();
+
+    if(!connectToHost() || !login()){
+        return false;
+    }
+
+    m_sessionLost = false;
+
+    return true;
+
+}
+
+QString SmtpSession::commandName(Command c){
+
+    switch(c){
+      case Greeting:  return QString("CONNECT");
+      case Ehlo:      return QString("EHLO");
+      case StartTls:  return QString("STARTTLS");
+      case Auth:      return QString("AUTH");
+      case MailFrom:  return QString("MAIL");
+      case RcptTo:    return QString("RCPT");
+      case Data:      return QString("DATA");
+      case EndOfData: return QString("END-OF-DATA");
+      case Rset:      return QString("RSET");
+      case TlsFull:   return QString("TLS-FULL");
+      case TlsResumed: return QString("TLS-RESUMED");
+      default:        return QString("?");
+    }
+
+}
+
+QString SmtpSession::histogramReport() const{
+
+    return histogramReport(m_histograms);
+
+}
+
+/* `histograms` holds one histogram per Command. */
+QString SmtpSession::histogramReport(const LatencyHistogram *histograms){
+
+    QString txt = QString("%1 %2 %3 %4 %5 %6 %7 %8\n")
+                      .arg(QString("Command"), -12)
+                      .arg(QString("Count"), 7)
+                      .arg(QString("Min"), 9)
+                      .arg(QString("Mean"), 9)
+                      .arg(QString("p50"), 9)
+                      .arg(QString("p90"), 9)
+                      .arg(QString("p99"), 9)
+                      .arg(QString("Max"), 9);
+
+    for(int i = 0; i < NCommands; i++){
+        if(histograms[i].count() > 0){
+            txt += QString("%1 %2\n").arg(commandName((Command)i), -12).arg(histograms[i].summary());
+        }
+    }
+
+    return txt;
+
+}
+
+void SmtpSession::abort(){
+
+    m_aborted.store(1);
+
+}
+
+/* The socket is only touched on its own thread; a timeout goes on until `msecs`. */
+bool SmtpSession::waitForSocket(SocketWait what, int msecs){
+
+    QElapsedTimer t;
+    t.start();
+
+    for(;;){
+        if(m_aborted.load()){
+            socket->abort();
+            return false;
+        }
+
+        int slice = qMin((qint64)SMTPSESSION_ABORT_POLL_MS, msecs - t.elapsed());
+        if(slice <= 0){
+            return false;
+        }
+
+        bool ok = false;
+        switch(what){
+          case WaitConnected: ok = socket->waitForConnected(slice); break;
+          case WaitReadyRead: ok = socket->waitForReadyRead(slice); break;
+          case WaitEncrypted: ok = ((QSslSocket*)socket)->waitForEncrypted(slice); break;
+        }
+
+        if(ok){
+            return true;
+        }
+        if(socket->error() != QAbstractSocket::SocketTimeoutError || socket->state() == QAbstractSocket::UnconnectedState){
+            return false;
+        }
+    }
+
+}
+
+/* Read a complete (multi-line) reply. */
+void SmtpSession::waitForReply(){
+
+    m_replyLines.clear();
+
+    do {
+        if(!socket->canReadLine() && !waitForSocket(WaitReadyRead, responseTimeout)){
+            emit smtpError(ResponseTimeoutError);
+            throw ResponseTimeoutException();
+        }
+
+        while(socket->canReadLine()){
+            responseText = QString::fromUtf8(socket->readLine()).trimmed();
+            responseCode = responseText.left(3).toInt();
+            m_replyLines.append(responseText.mid(4));
+
+            if(responseCode / 100 == 4){
+                emit smtpError(ServerError);
+            }
+            if(responseCode / 100 == 5){
+                emit smtpError(ClientError);
+            }
+
+            /* "250 " ends a reply, "250-" continues it. */
+            if(responseText.length() < 4 || responseText[3] == QChar(' ')){
+                return;
+            }
+        }
+    } while(true);
+
+}
+
+int SmtpSession::command(Command c, const QString &text){
+
+    QElapsedTimer t;
+    t.start();
+
+    sendMessage(text);
+    waitForReply();
+
+    m_histograms[c].add(t.nsecsElapsed() / 1000);
+
+    return responseCode;
+
+}
+
+/* Say hello and remember the extensions of the server. */
+bool SmtpSession::ehlo(){
+
+    if(command(Ehlo, QString("EHLO ") + name) != 250){
+        emit smtpError(ServerError);
+        return false;
+    }
+
+    /* First line is the greeting of the server. */
+    m_extensions.clear();
+    for(int i = 1; i < m_replyLines.count(); i++){
+        m_extensions.append(m_replyLines.at(i).section(QChar(' '), 0, 0).toUpper());
+    }
+
+    return true;
+
+}
+
+bool SmtpSession::connectToHost(){
+
+    QElapsedTimer t;
+    t.start();
+
+    switch(connectionType){
+      case TlsConnection:
+      case TcpConnection:
+        socket->connectToHost(host, port);
+        break;
+      case SslConnection:
+        offerTlsSession();
+        ((QSslSocket*)socket)->connectToHostEncrypted(host, port);
+        break;
+    }
+
+    if(!waitForSocket(WaitConnected, connectionTimeout)){
+        emit smtpError(ConnectionTimeoutError);
+        return false;
+    }
+
+    bool ok = false;
+    try {
+        /* Greeting, including the TCP (and SSL) connect. */
+        waitForReply();
+        m_histograms[Greeting].add(t.nsecsElapsed() / 1000);
+        if(responseCode != 220){
+            emit smtpError(ServerError);
+            return false;
+        }
+
+        if(!ehlo()){
+            return false;
+        }
+
+        if(connectionType == TlsConnection){
+            t.restart();
+
+            sendMessage(QString("STARTTLS"));
+            waitForReply();
+            if(responseCode != 220){
+                emit smtpError(ServerError);
+                return false;
+            }
+
+            offerTlsSession();
+            ((QSslSocket*)socket)->startClientEncryption();
+            if(!waitForSocket(WaitEncrypted, connectionTimeout)){
+                emit smtpError(ConnectionTimeoutError);
+                return false;
+            }
+
+            m_histograms[StartTls].add(t.nsecsElapsed() / 1000);
+
+            /* Extensions may differ after STARTTLS. */
+            if(!ehlo()){
+                return false;
+            }
+        }
+
+        ok = true;
+    }
+    catch(ResponseTimeoutException){
+    }
+    catch(SendMessageTimeoutException){
+    }
+
+    if(connectionType != TcpConnection){
+        QSslConfiguration c = ((QSslSocket*)socket)->sslConfiguration();
+
+        /* Keep the latest session, e.g. a TLS 1.3 ticket sent after the handshake. */
+        if(ok){
+            TlsSessionCache::instance()->insert(host, port, c.sessionTicket(), c.sessionTicketLifeTimeHint());
+        }
+
+        /* A session the server chokes on is not offered again. */
+        else if(!m_tlsOffered.isEmpty() && !((QSslSocket*)socket)->isEncrypted()){
+            TlsSessionCache::instance()->remove(host, port);
+        }
+    }
+
+    return ok;
+
+}
+
+void SmtpSession::offerTlsSession(){
+
+    m_tlsOffered = TlsSessionCache::instance()->session(host, port);
+
+    QSslConfiguration c = ((QSslSocket*)socket)->sslConfiguration();
+    c.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    c.setSessionTicket(m_tlsOffered);
+    ((QSslSocket*)socket)->setSslConfiguration(c);
+
+    m_tlsClock.start();
+
+}
+
+/* A resumed session keeps the master key of the offered session, a new one never does. */
+void SmtpSession::tlsEncrypted(){
+
+    QByteArray offered = TlsSessionCache::masterKey(m_tlsOffered);
+    QByteArray key = TlsSessionCache::masterKey(((QSslSocket*)socket)->sslConfiguration().sessionTicket());
+    bool resumed = !offered.isEmpty() && offered == key;
+
+    m_histograms[resumed ? TlsResumed : TlsFull].add(m_tlsClock.nsecsElapsed() / 1000);
+    TlsSessionCache::instance()->countHandshake(resumed);
+
+}
+
+bool SmtpSession::login(){
+
+    QElapsedTimer t;
+    t.start();
+
+    try {
+        if(authMethod == AuthPlain){
+            /* AUTH PLAIN base64(\0user\0password) */
+            QByteArray auth;
+            auth.append((char)0).append(user.toUtf8()).append((char)0).append(password.toUtf8());
+            sendMessage(QString("AUTH PLAIN ") + QString::fromLatin1(auth.toBase64()));
+            waitForReply();
+        }
+        else{
+            sendMessage(QString("AUTH LOGIN"));
+            waitForReply();
+            if(responseCode != 334){
+                emit smtpError(AuthenticationFailedError);
+                return false;
+            }
+
+            sendMessage(QString::fromLatin1(user.toUtf8().toBase64()));
+            waitForReply();
+            if(responseCode != 334){
+                emit smtpError(AuthenticationFailedError);
+                return false;
+            }
+
+            sendMessage(QString::fromLatin1(password.toUtf8().toBase64()));
+            waitForReply();
+        }
+
+        m_histograms[Auth].add(t.nsecsElapsed() / 1000);
+
+        if(responseCode != 235){
+            emit smtpError(AuthenticationFailedError);
+            return false;
+        }
+    }
+    catch(ResponseTimeoutException){
+        emit smtpError(AuthenticationFailedError);
+        return false;
+    }
+    catch(SendMessageTimeoutException){
+        emit smtpError(AuthenticationFailedError);
+        return false;
+    }
+
+    return true;
+
+}
+
+/*
+ * A timeout or 421 leaves the session out of step: a reply that is still
+ * on its way would be read as the answer to the next command. Close the
+ * socket, so the session is not used again before reconnect().
+ */
+void SmtpSession::dropSession(){
+
+    m_sessionLost = true;
+    socket->abort();
+
+}
+
+/* Abort a failed transaction so the session can be used for the next message. */
+bool SmtpSession::abortTransaction(){
+
+    /* Keep the reply that failed the transaction. */
+    m_lastReplyCode = responseCode;
+    m_lastReplyText = responseText;
+
+    /* 421: the server is closing the connection. */
+    if(responseCode == 421 || !isAlive()){
+        dropSession();
+        m_lastResult = SessionLost;
+        return false;
+    }
+
+    /* 4xx is temporary (e.g. 451/452 throttling), everything else is final. */
+    m_lastResult = responseCode / 100 == 4 ? TransientFailure : PermanentFailure;
+
+    /* The message failed either way, a lost session only matters for the next one. */
+    try {
+        command(Rset, QString("RSET"));
+    }
+    catch(ResponseTimeoutException){
+        dropSession();
+    }
+    catch(SendMessageTimeoutException){
+        dropSession();
+    }
+
+    return false;
+
+}
+
+bool SmtpSession::beginData(const QString &sender, const QStringList &recipients){
+
+    /* Declaring 8bit is allowed for 7bit messages too (RFC 6152). */
+    QString body = supports(QString("8BITMIME")) ? QString(" BODY=8BITMIME") : QString("");
+
+    if(command(MailFrom, QString("MAIL FROM: <") + sender + QString(">") + body) != 250){
+        return abortTransaction();
+    }
+
+    foreach(QString rcpt, recipients){
+        if(command(RcptTo, QString("RCPT TO: <") + rcpt + QString(">")) != 250){
+            return abortTransaction();
+        }
+    }
+
+    if(command(Data, QString("DATA")) != 354){
+        return abortTransaction();
+    }
+
+    return true;
+
+}
+
+bool SmtpSession::endData(const QElapsedTimer &t, qint64 size){
+
+    waitForReply();
+
+    m_lastDataLatency = t.nsecsElapsed() / 1000;
+    m_histograms[EndOfData].add(m_lastDataLatency);
+
+    if(responseCode != 250){
+        return abortTransaction();
+    }
+
+    m_lastMessageSize = size;
+    m_bytesSent += m_lastMessageSize;
+    m_messagesSent++;
+    m_lastResult = Delivered;
+    m_lastReplyCode = responseCode;
+    m_lastReplyText = responseText;
+
+    return true;
+
+}
+
+void SmtpSession::writeData(const QByteArray &data){
+
+    socket->write(data);
+
+    if(!socket->waitForBytesWritten(sendMessageTimeout)){
+        emit smtpError(SendDataTimeoutError);
+        throw SendMessageTimeoutException();
+    }
+
+}
+
+bool SmtpSession::sendMail(MimeMessage &email){
+
+    /* Envelope: To, Cc and Bcc. */
+    QStringList recipients;
+    foreach(EmailAddress *rcpt, email.getRecipients(MimeMessage::To) +
+                                email.getRecipients(MimeMessage::Cc) +
+                                email.getRecipients(MimeMessage::Bcc)){
+        recipients.append(rcpt->getAddress());
+    }
+
+    MailWriter::write(email, &m_payload);
+
+    return sendData(email.getSender().getAddress(), recipients, m_payload);
+
+}
+
+bool SmtpSession::sendData(const QString &sender, const QStringList &recipients, const QByteArray &data){
+
+    m_sessionLost = false;
+    m_lastResult = SessionLost;
+
+    try {
+        if(!beginData(sender, recipients)){
+            return false;
+        }
+
+        /* Message and terminating dot, timed until the server accepted it. */
+        QElapsedTimer t;
+        t.start();
+
+        /* A line starting with a dot gets an extra dot (RFC 5321, 4.5.2). */
+        qint64 size;
+        if(data.startsWith('.') || data.contains("\r\n.")){
+            QByteArray stuffed = data;
+            if(stuffed.startsWith('.')){
+                stuffed.prepend('.');
+            }
+            stuffed.replace("\r\n.", "\r\n..");
+            writeData(stuffed);
+            size = stuffed.size();
+        }
+        else{
+            writeData(data);
+            size = data.size();
+        }
+
+        QByteArray end = data.endsWith("\r\n") ? QByteArray(".\r\n") : QByteArray("\r\n.\r\n");
+        writeData(end);
+
+        return endData(t, size + end.size());
+    }
+    catch(ResponseTimeoutException){
+        dropSession();
+        m_lastResult = SessionLost;
+        m_lastReplyText = QString("Response timeout");
+        return false;
+    }
+    catch(SendMessageTimeoutException){
+        dropSession();
+        m_lastResult = SessionLost;
+        m_lastReplyText = QString("Send timeout");
+        return false;
+    }
+
+}
+
+bool SmtpSession::sendStream(const QString &sender, const QStringList &recipients, const QByteArray &header, QIODevice *body){
+
+    m_sessionLost = false;
+    m_lastResult = SessionLost;
+
+    try {
+        if(!beginData(sender, recipients)){
+            return false;
+        }
+
+        /* Timed until the server accepted it, like sendMail(). */
+        QElapsedTimer t;
+        t.start();
+        qint64 size = 0;
+
+        /* Send in chunks, only one chunk is in memory. */
+        QByteArray chunk = header;
+        chunk.reserve(SMTPSESSION_CHUNK_SIZE + 1024);
+
+        while(!body->atEnd()){
+            QByteArray line = body->readLine();
+
+            /* A line starting with a dot gets an extra dot (RFC 5321, 4.5.2). */
+            if(line.startsWith('.')){
+                chunk.append('.');
+            }
+
+            if(line.endsWith("\r\n")){
+                chunk.append(line);
+            }
+            else{
+                chunk.append(line.constData(), line.endsWith('\n') ? line.size() - 1 : line.size());
+                chunk.append("\r\n");
+            }
+
+            if(chunk.size() >= SMTPSESSION_CHUNK_SIZE){
+                size += chunk.size();
+                writeData(chunk);
+                chunk.clear();
+            }
+        }
+
+        chunk.append(".\r\n");
+        size += chunk.size();
+        writeData(chunk);
+
+        return endData(t, size);
+    }
+    catch(ResponseTimeoutException){
+        dropSession();
+        m_lastResult = SessionLost;
+        m_lastReplyText = QString("Response timeout");
+        return false;
+    }
+    catch(SendMessageTimeoutException){
+        dropSession();
+        m_lastResult = SessionLost;
+        m_lastReplyText = QString("Send timeout");
+        return false;
+    }
+
+}
@@ -0,0 +1,173 @@
+#ifndef SMTPSESSION_H
+#define SMTPSESSION_H
+
+#include <QStringList>
+#include <QIODevice>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+
+#include <smtpclient.h>
+
+#include "latencyhistogram.h"
+
+/*
+ * SMTP client that measures every command.
+ *
+ * Re-implements the protocol part of SmtpClient (connect, login and
+ * send) so the round trip of every SMTP command can be recorded in a
+ * histogram. The functions of SmtpClient are not virtual, so always use
+ * this class through an SmtpSession pointer.
+ */
+class SmtpSession : public SmtpClient
+{
+    Q_OBJECT
+
+public:
+    /* Commands with their own latency histogram. */
+    enum Command {
+        Greeting,
+        Ehlo,
+        StartTls,
+        Auth,
+        MailFrom,
+        RcptTo,
+        Data,
+        EndOfData,
+        Rset,
+        TlsFull,            /* TLS handshake, new session. */
+        TlsResumed,         /* TLS handshake, resumed session. */
+        NCommands
+    };
+
+    /* Outcome of sendMail(), from the reply that ended the transaction. */
+    enum SendResult {
+        Delivered,
+        TransientFailure,   /* 4xx: try again later. */
+        PermanentFailure,   /* 5xx: rejected. */
+        SessionLost         /* Timeout, closed connection or 421. */
+    };
+
+    SmtpSession(const QString &host, int port, ConnectionType ct);
+
+    /* Same contract as SmtpClient. */
+    bool connectToHost();
+    bool login();
+    bool sendMail(MimeMessage &email);
+
+    /*
+     * Send a serialized message (see MailWriter) as the DATA payload.
+     * Dot-stuffing is done here, on a copy only when a line starts
+     * with a dot.
+     */
+    bool sendData(const QString &sender, const QStringList &recipients, const QByteArray &data);
+
+    /*
+     * Send a message that does not fit in memory. The header must end
+     * with an empty line; the body is read line by line, dot-stuffed and
+     * sent with CRLF line endings.
+     */
+    bool sendStream(const QString &sender, const QStringList &recipients, const QByteArray &header, QIODevice *body);
+
+    /* Is the connection still usable? */
+    bool isAlive() const;
+
+    /* Did the last sendMail() fail because the session was lost? */
+    bool sessionLost() const { return m_sessionLost; }
+
+    /* Result and reply of the last sendMail(). */
+    SendResult lastResult() const { return m_lastResult; }
+    int lastReplyCode() const { return m_lastReplyCode; }
+    const QString &lastReplyText() const { return m_lastReplyText; }
+
+    /* Size and end-of-data latency (us) of the last delivered message. */
+    qint64 lastMessageSize() const { return m_lastMessageSize; }
+    qint64 lastDataLatency() const { return m_lastDataLatency; }
+
+    /* Connect and login again with the credentials already set. */
+    bool reconnect();
+    int reconnects() const { return m_reconnects; }
+
+    /* Extensions advertised in the last EHLO reply, e.g. "8BITMIME". */
+    const QStringList &extensions() const { return m_extensions; }
+    bool supports(const QString &extension) const { return m_extensions.contains(extension); }
+
+    /* Statistics. */
+    static QString commandName(Command c);
+    const LatencyHistogram &histogram(Command c) const { return m_histograms[c]; }
+    qint64 bytesSent() const { return m_bytesSent; }
+    int messagesSent() const { return m_messagesSent; }
+    void resetStatistics();
+
+    /* Histogram table of all commands, times in ms. */
+    QString histogramReport() const;
+    static QString histogramReport(const LatencyHistogram *histograms);
+
+    /*
+     * Give up, also from another thread: a connect, handshake or reply
+     * that is being waited for fails within SMTPSESSION_ABORT_POLL_MS.
+     */
+    void abort();
+
+protected:
+    enum SocketWait {
+        WaitConnected,
+        WaitReadyRead,
+        WaitEncrypted
+    };
+
+    /* Wait on the socket in short slices, so abort() is noticed. */
+    bool waitForSocket(SocketWait what, int msecs);
+
+    /* Like waitForResponse(), but keeps all lines of a multi-line reply. */
+    void waitForReply();
+
+    /* Send a command line and wait for the reply. Returns the reply code. */
+    int command(Command c, const QString &text);
+
+    bool ehlo();
+    bool abortTransaction();
+
+    /* The session is lost: close the socket. */
+    void dropSession();
+
+    /* Offer the cached TLS session of this relay, before the handshake. */
+    void offerTlsSession();
+
+    /* MAIL FROM, RCPT TO for all recipients and DATA. */
+    bool beginData(const QString &sender, const QStringList &recipients);
+
+    /* Reply to the end of data; `size` bytes were sent, timed by `t`. */
+    bool endData(const QElapsedTimer &t, qint64 size);
+
+    /* Write raw data, waiting until it is sent. */
+    void writeData(const QByteArray &data);
+
+    QStringList m_replyLines;
+    QStringList m_extensions;
+
+private slots:
+    /* Handshake done: resumed or full? Called before any data is read. */
+    void tlsEncrypted();
+
+private:
+    LatencyHistogram m_histograms[NCommands];
+    qint64 m_bytesSent;
+    int m_messagesSent;
+    int m_reconnects;
+    bool m_sessionLost;
+    SendResult m_lastResult;
+    int m_lastReplyCode;
+    QString m_lastReplyText;
+    qint64 m_lastMessageSize;
+    qint64 m_lastDataLatency;
+
+    QElapsedTimer m_tlsClock;
+    QByteArray m_tlsOffered;
+
+    /* The message being sent; its memory is reused for the next one. */
+    QByteArray m_payload;
+
+    QAtomicInt m_aborted;
+};
+
+#endif // SMTPSESSION_H
@@ -0,0 +1,51 @@
+#include "snapshotmodel.h"
+
+SnapshotModel::SnapshotModel(const SheetSnapshot &snapshot, QObject *parent) :
+    QAbstractTableModel(parent), m_snapshot(snapshot)
+{
+}
+
+int SnapshotModel::rowCount(const QModelIndex &parent) const{
+
+    return parent.isValid() ? 0 : m_snapshot.rowCount();
+
+}
+
+int SnapshotModel::columnCount(const QModelIndex &parent) const{
+
+    return parent.isValid() ? 0 : m_snapshot.columnCount();
+
+}
+
+QVariant SnapshotModel::data(const QModelIndex &index, int role) const{
+
+    if(!index.isValid() || (role != Qt::DisplayRole && role != Qt::EditRole)){
+        return QVariant();
+    }
+
+    return QString::fromUtf8(m_snapshot.cell(index.row() + 1, index.column() + 1));
+
+}
+
+QVariant SnapshotModel::headerData(int section, Qt::Orientation orientation, int role) const{
+
+    if(role != Qt::DisplayRole){
+        return QVariant();
+    }
+
+    return orientation == Qt::Horizontal ? columnName(section + 1) : QString::number(section + 1);
+
+}
+
+QString SnapshotModel::columnName(int col){
+
+    QString name;
+    while(col > 0){
+        int c = (col - 1) % 26;
+        name.prepend(QChar('A' + c));
+        col = (col - 1) / 26;
+    }
+
+    return name;
+
+}
@@ -0,0 +1,37 @@
+#ifndef SNAPSHOTMODEL_H
+#define SNAPSHOTMODEL_H
+
+#include <QAbstractTableModel>
+
+#include "sheetsnapshot.h"
+
+/*
+ * A SheetSnapshot as a read-only table, with the column letters and
+ * row numbers of a sheet as headers.
+ *
+ * Data that is not read from a workbook (see SqlSource) is shown and
+ * used through this model like any sheet; SheetSnapshot::load() shares
+ * the snapshot instead of converting every cell again.
+ */
+class SnapshotModel : public QAbstractTableModel
+{
+    Q_OBJECT
+
+public:
+    SnapshotModel(const SheetSnapshot &snapshot, QObject *parent = 0);
+
+    const SheetSnapshot &snapshot() const { return m_snapshot; }
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const;
+
+    /* "A", "B", ..., "Z", "AA", ... for column 1, 2, ... */
+    static QString columnName(int col);
+
+private:
+    SheetSnapshot m_snapshot;
+};
+
+#endif // SNAPSHOTMODEL_H
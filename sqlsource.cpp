@@ -0,0 +1,164 @@
+#include "sqlsource.h"
+
+#include <QAtomicInt>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QSqlError>
+
+/* Every source has a connection of its own, also on other threads. */
+static QAtomicInt connections;
+
+SqlSource::SqlSource(){
+
+    m_connection = QString("sqlsource-") + QString::number(connections.fetchAndAddRelaxed(1));
+
+}
+
+SqlSource::~SqlSource(){
+
+    close();
+
+}
+
+bool SqlSource::open(const QString &database, QString *error){
+
+    close();
+
+    m_db = QSqlDatabase::addDatabase(QString("QSQLITE"), m_connection);
+    m_db.setDatabaseName(database);
+    m_db.setConnectOptions(QString("QSQLITE_OPEN_READONLY"));
+
+    if(!m_db.open()){
+        *error = QString("Cannot open the database ") + database + QString(": ") + m_db.lastError().text();
+        close();
+        return false;
+    }
+
+    return true;
+
+}
+
+void SqlSource::close(){
+
+    if(!m_db.isValid()){
+        return;
+    }
+
+    m_db.close();
+    m_db = QSqlDatabase();
+    QSqlDatabase::removeDatabase(m_connection);
+
+}
+
+QStringList SqlSource::tables() const{
+
+    return m_db.tables();
+
+}
+
+QStringList SqlSource::columns(const QString &query, QString *error){
+
+    QStringList res;
+
+    /* Run it, but without rows. */
+    QSqlQuery q(m_db);
+    if(!q.exec(QString("SELECT * FROM (") + subquery(query) + QString(") LIMIT 0"))){
+        *error = q.lastError().text();
+        return res;
+    }
+
+    QSqlRecord record = q.record();
+    for(int i = 0; i < record.count(); i++){
+        res.append(record.fieldName(i));
+    }
+
+    return res;
+
+}
+
+/* Without a trailing ';' the query can be used as a subquery. */
+QString SqlSource::subquery(const QString &query){
+
+    QString inner = query.trimmed();
+    while(inner.endsWith(QChar(';'))){
+        inner.chop(1);
+        inner = inner.trimmed();
+    }
+
+    return inner;
+
+}
+
+QString SqlSource::filterQuery(const QString &query, const QString &column, int count){
+
+    QStringList parameters;
+    for(int i = 0; i < count; i++){
+        parameters.append(QString("?"));
+    }
+
+    return QString("SELECT * FROM (") + subquery(query) + QString(") WHERE \"") + QString(column).replace(QString("\""), QString("\"\"")) +
+           QString("\" IN (") + parameters.join(QString(", ")) + QString(")");
+
+}
+
+bool SqlSource::load(const QString &query, SheetSnapshot *out, QString *error, const QString &filterColumn, const QStringList &recipients){
+
+    out->clear();
+
+    if(!m_db.isOpen()){
+        *error = QString("No database.");
+        return false;
+    }
+
+    /* Without a filter one query, with one a query per SQLSOURCE_MAX_FILTER recipients. */
+    bool filtered = !filterColumn.isEmpty() && !recipients.isEmpty();
+    int pass = 0;
+
+    do {
+        QStringList values = recipients.mid(pass * SQLSOURCE_MAX_FILTER, SQLSOURCE_MAX_FILTER);
+
+        QSqlQuery q(m_db);
+        q.setForwardOnly(true);
+        if(!q.prepare(filtered ? filterQuery(query, filterColumn, values.count()) : query)){
+            *error = q.lastError().text();
+            out->clear();
+            return false;
+        }
+        foreach(QString value, values){
+            q.addBindValue(value);
+        }
+        if(!q.exec()){
+            *error = q.lastError().text();
+            out->clear();
+            return false;
+        }
+
+        /* The names of the columns are the first row. */
+        int cols = q.record().count();
+        if(pass == 0){
+            out->reset(cols);
+            out->reserve(SQLSOURCE_CHUNK_ROWS);
+
+            QByteArray *c = out->appendRow();
+            for(int i = 0; i < cols; i++){
+                c[i] = q.record().fieldName(i).toUtf8();
+            }
+        }
+
+        while(q.next()){
+            if(out->rowCount() % SQLSOURCE_CHUNK_ROWS == 0){
+                out->reserve(out->rowCount() + SQLSOURCE_CHUNK_ROWS);
+            }
+
+            QByteArray *c = out->appendRow();
+            for(int i = 0; i < cols; i++){
+                c[i] = q.value(i).toString().toUtf8();
+            }
+        }
+
+        pass++;
+    } while(filtered && pass * SQLSOURCE_MAX_FILTER < recipients.count());
+
+    return true;
+
+}
@@ -0,0 +1,63 @@
+#ifndef SQLSOURCE_H
+#define SQLSOURCE_H
+
+#include <QString>
+#include <QStringList>
+#include <QSqlDatabase>
+
+#include "sheetsnapshot.h"
+
+/* Rows the snapshot grows by while a query is read. */
+#define SQLSOURCE_CHUNK_ROWS  8192
+
+/* Recipients bound per query; SQLite allows 999 parameters. */
+#define SQLSOURCE_MAX_FILTER  500
+
+/*
+ * Reads the result of a query on an SQLite database into a snapshot,
+ * as an alternative to a sheet of a workbook.
+ *
+ * Row 1 holds the names of the columns, like the header row of a sheet,
+ * the rows of the result follow. The rows are read with a forward-only
+ * cursor straight into the snapshot, which grows SQLSOURCE_CHUNK_ROWS
+ * rows at a time; no model and no QVariant per cell stay around.
+ *
+ * When only some recipients are wanted, the filter is not applied to the
+ * rows afterwards but pushed down into the query:
+ *
+ *   SELECT * FROM (<query>) WHERE "<column>" IN (?, ?, ...)
+ *
+ * so SQLite only returns (and can use an index for) those rows.
+ */
+class SqlSource
+{
+public:
+    SqlSource();
+    ~SqlSource();
+
+    bool open(const QString &database, QString *error);
+    void close();
+
+    QStringList tables() const;
+
+    /* The columns of the result of `query`, without reading any rows. */
+    QStringList columns(const QString &query, QString *error);
+
+    /*
+     * Read the result of `query` into `out`. With `recipients`, only the
+     * rows whose `filterColumn` is one of them.
+     */
+    bool load(const QString &query, SheetSnapshot *out, QString *error,
+              const QString &filterColumn = QString(), const QStringList &recipients = QStringList());
+
+    /* `query` restricted to `count` values of `column`, as bound parameters. */
+    static QString filterQuery(const QString &query, const QString &column, int count);
+
+private:
+    static QString subquery(const QString &query);
+
+    QSqlDatabase m_db;
+    QString m_connection;
+};
+
+#endif // SQLSOURCE_H
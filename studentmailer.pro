@@ -4,20 +4,85 @@
 #
 #-------------------------------------------------
 
-QT       += core gui xlsx
+QT       += core gui network sql xlsx
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
+# QZipReader, to read the parts of a workbook in XlsxSource.
+QT += gui-private
+
 TARGET = studentmailer
 TEMPLATE = app
 
 SOURCES += main.cpp\
         mainwindow.cpp \
-    xlsxsheetmodel.cpp
+    xlsxsheetmodel.cpp \
+    batchtimer.cpp \
+    latencyhistogram.cpp \
+    smtpsession.cpp \
+    ratelimiter.cpp \
+    outboxjournal.cpp \
+    mailtemplate.cpp \
+    sendhistory.cpp \
+    bccdigest.cpp \
+    reportwriter.cpp \
+    base64.cpp \
+    fastmimeattachment.cpp \
+    bodyencoder.cpp \
+    fastmimetext.cpp \
+    sheetsnapshot.cpp \
+    mailwriter.cpp \
+    mimearena.cpp \
+    smtpconnector.cpp \
+    tlssessioncache.cpp \
+    relaypool.cpp \
+    shard.cpp \
+    shardmerge.cpp \
+    mailjob.cpp \
+    maildaemon.cpp \
+    maildaemonworker.cpp \
+    hotfolder.cpp \
+    snapshotmodel.cpp \
+    sqlsource.cpp \
+    csvsource.cpp \
+    xlsxsource.cpp
 
 HEADERS  += mainwindow.h \
     xlsxsheetmodel.h \
-    xlsxsheetmodel_p.h
+    xlsxsheetmodel_p.h \
+    batchtimer.h \
+    latencyhistogram.h \
+    smtpsession.h \
+    ratelimiter.h \
+    outboxjournal.h \
+    mailtemplate.h \
+    sendhistory.h \
+    bccdigest.h \
+    reportwriter.h \
+    base64.h \
+    fastmimeattachment.h \
+    bodyencoder.h \
+    fastmimetext.h \
+    sheetsnapshot.h \
+    mailwriter.h \
+    mimearena.h \
+    smtpconnector.h \
+    tlssessioncache.h \
+    relaypool.h \
+    shard.h \
+    shardmerge.h \
+    mailjob.h \
+    maildaemon.h \
+    maildaemonworker.h \
+    hotfolder.h \
+    snapshotmodel.h \
+    sqlsource.h \
+    csvsource.h \
+    xlsxsource.h
+
+# zlib for the compressed report.
+unix: LIBS += -lz
+win32: LIBS += -lzlib
 
 win32:CONFIG(release, debug|release): LIBS += -L$$PWD/../SmtpClient-for-Qt/release/ -lSMTPEmail
 else:win32:CONFIG(debug, debug|release): LIBS += -L$$PWD/../SmtpClient-for-Qt/debug/ -lSMTPEmail
@@ -0,0 +1,223 @@
+#include "tlssessioncache.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QDataStream>
+#include <QStandardPaths>
+
+/* File format: magic, version, then host:port, session and expiry per relay. */
+#define TLSSESSIONCACHE_MAGIC   0x544c5353
+#define TLSSESSIONCACHE_VERSION 1
+
+/* Lifetime of a session when the server gave no hint, in seconds. */
+#define TLSSESSIONCACHE_DEFAULT_LIFETIME 7200
+
+TlsSessionCache::TlsSessionCache(){
+
+    m_full = 0;
+    m_resumed = 0;
+    load();
+
+}
+
+TlsSessionCache *TlsSessionCache::instance(){
+
+    static TlsSessionCache cache;
+    return &cache;
+
+}
+
+QString TlsSessionCache::fileName(){
+
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + QString("/tls-sessions");
+
+}
+
+QByteArray TlsSessionCache::session(const QString &host, int port){
+
+    QMutexLocker lock(&m_mutex);
+
+    QHash<QString, Entry>::iterator it = m_sessions.find(host.toLower() + QString(":") + QString::number(port));
+    if(it == m_sessions.end()){
+        return QByteArray();
+    }
+
+    if(it.value().expires < QDateTime::currentMSecsSinceEpoch()){
+        m_sessions.erase(it);
+        return QByteArray();
+    }
+
+    return it.value().session;
+
+}
+
+void TlsSessionCache::insert(const QString &host, int port, const QByteArray &session, int lifetime){
+
+    if(session.isEmpty()){
+        return;
+    }
+
+    Entry e;
+    e.session = session;
+    e.expires = QDateTime::currentMSecsSinceEpoch() + 1000LL * (lifetime > 0 ? lifetime : TLSSESSIONCACHE_DEFAULT_LIFETIME);
+
+    QMutexLocker lock(&m_mutex);
+    m_sessions.insert(host.toLower() + QString(":") + QString::number(port), e);
+    save();
+
+}
+
+void TlsSessionCache::remove(const QString &host, int port){
+
+    QMutexLocker lock(&m_mutex);
+    if(m_sessions.remove(host.toLower() + QString(":") + QString::number(port)) > 0){
+        save();
+    }
+
+}
+
+void TlsSessionCache::countHandshake(bool resumed){
+
+    QMutexLocker lock(&m_mutex);
+    if(resumed){
+        m_resumed++;
+    }
+    else{
+        m_full++;
+    }
+
+}
+
+int TlsSessionCache::fullHandshakes(){
+
+    QMutexLocker lock(&m_mutex);
+    return m_full;
+
+}
+
+int TlsSessionCache::resumedHandshakes(){
+
+    QMutexLocker lock(&m_mutex);
+    return m_resumed;
+
+}
+
+/* One DER element: tag, and the value from `p` on. Returns false when truncated. */
+static bool readDer(const uchar **p, const uchar *end, int *tag, const uchar **value, int *length){
+
+    if(end - *p < 2){
+        return false;
+    }
+
+    *tag = *(*p)++;
+    int len = *(*p)++;
+
+    /* Long form: the number of length bytes follows. */
+    if(len & 0x80){
+        int n = len & 0x7f;
+        if(n < 1 || n > 3 || end - *p < n){
+            return false;
+        }
+        len = 0;
+        while(n-- > 0){
+            len = (len << 8) | *(*p)++;
+        }
+    }
+
+    if(end - *p < len){
+        return false;
+    }
+
+    *value = *p;
+    *length = len;
+
+    return true;
+
+}
+
+/*
+ * SSL_SESSION ::= SEQUENCE { version INTEGER, sslVersion INTEGER,
+ * cipher OCTET STRING, sessionID OCTET STRING, masterKey OCTET STRING, ... }
+ */
+QByteArray TlsSessionCache::masterKey(const QByteArray &session){
+
+    const uchar *p = (const uchar*)session.constData();
+    const uchar *end = p + session.size();
+    const uchar *value;
+    int tag, length;
+
+    if(!readDer(&p, end, &tag, &value, &length) || tag != 0x30){
+        return QByteArray();
+    }
+
+    p = value;
+    end = value + length;
+    for(int i = 0; i < 5; i++){
+        if(!readDer(&p, end, &tag, &value, &length)){
+            return QByteArray();
+        }
+        if(i == 4){
+            return tag == 0x04 ? QByteArray((const char*)value, length) : QByteArray();
+        }
+        p = value + length;
+    }
+
+    return QByteArray();
+
+}
+
+void TlsSessionCache::load(){
+
+    QFile f(fileName());
+    if(!f.open(QIODevice::ReadOnly)){
+        return;
+    }
+
+    QDataStream in(&f);
+    in.setVersion(QDataStream::Qt_5_0);
+
+    quint32 magic, version, n;
+    in >> magic >> version >> n;
+    if(magic != TLSSESSIONCACHE_MAGIC || version != TLSSESSIONCACHE_VERSION){
+        return;
+    }
+
+    for(quint32 i = 0; i < n && in.status() == QDataStream::Ok; i++){
+        QString key;
+        Entry e;
+        in >> key >> e.session >> e.expires;
+        if(in.status() == QDataStream::Ok && e.expires > QDateTime::currentMSecsSinceEpoch()){
+            m_sessions.insert(key, e);
+        }
+    }
+
+}
+
+/* Called with the mutex locked. */
+bool TlsSessionCache::save(){
+
+    if(!QDir().mkpath(QFileInfo(fileName()).path())){
+        return false;
+    }
+
+    QSaveFile f(fileName());
+    if(!f.open(QIODevice::WriteOnly)){
+        return false;
+    }
+    f.setPermissions(QFileDevice::ReadOwner | QFileDevice::WriteOwner);
+
+    QDataStream out(&f);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << (quint32)TLSSESSIONCACHE_MAGIC << (quint32)TLSSESSIONCACHE_VERSION << (quint32)m_sessions.count();
+
+    QHash<QString, Entry>::const_iterator it;
+    for(it = m_sessions.constBegin(); it != m_sessions.constEnd(); ++it){
+        out << it.key() << it.value().session << it.value().expires;
+    }
+
+    return f.commit();
+
+}
@@ -0,0 +1,60 @@
+#ifndef TLSSESSIONCACHE_H
+#define TLSSESSIONCACHE_H
+
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QByteArray>
+
+/*
+ * TLS sessions of the relays, to resume instead of a full handshake.
+ *
+ * Every connection to a relay offers the session of the previous one,
+ * within a run and across runs: the sessions are kept in
+ * <AppDataLocation>/tls-sessions, readable by the owner only, since a
+ * session holds its master key. Shared by all threads.
+ *
+ * Also counts full and resumed handshakes for the report.
+ */
+class TlsSessionCache
+{
+public:
+    static TlsSessionCache *instance();
+
+    /* The session to offer to host:port, empty when none or expired. */
+    QByteArray session(const QString &host, int port);
+
+    /* Keep the session of a connection; `lifetime` in seconds, 0 when unknown. */
+    void insert(const QString &host, int port, const QByteArray &session, int lifetime);
+    void remove(const QString &host, int port);
+
+    void countHandshake(bool resumed);
+    int fullHandshakes();
+    int resumedHandshakes();
+
+    /*
+     * The master key of a serialized (DER) OpenSSL session. A resumed
+     * connection still has the master key of the session it offered.
+     */
+    static QByteArray masterKey(const QByteArray &session);
+
+    static QString fileName();
+
+private:
+    TlsSessionCache();
+
+    struct Entry {
+        QByteArray session;
+        qint64 expires;
+    };
+
+    void load();
+    bool save();
+
+    QMutex m_mutex;
+    QHash<QString, Entry> m_sessions;
+    int m_full;
+    int m_resumed;
+};
+
+#endif // TLSSESSIONCACHE_H
@@ -0,0 +1,671 @@
+#include "xlsxsource.h"
+
+#include <cmath>
+
+#include <QDir>
+#include <QDateTime>
+#include <QVariant>
+#include <QXmlStreamReader>
+#include <private/qzipreader_p.h>
+
+/* The size of a worksheet in Excel; references beyond it are invalid. */
+#define XLSXSOURCE_MAX_ROWS    1048576
+#define XLSXSOURCE_MAX_COLUMNS 16384
+
+/* Cells of a snapshot (rows times columns) up to which a sheet is read. */
+#define XLSXSOURCE_MAX_CELLS   (64 * 1024 * 1024)
+
+/* A cell as it is read, before the size of the sheet is known. */
+struct XlsxCell {
+    int row;
+    int col;
+    QByteArray value;
+};
+
+/* Whole numbers are shown as they are written, no need for a double. */
+static inline bool isWholeNumber(const QString &value){
+
+    int n = value.size();
+    int i = (n > 0 && value.at(0) == QChar('-')) ? 1 : 0;
+    if(n == i || n - i > 15 || (value.at(i) == QChar('0') && n - i > 1)){
+        return false;
+    }
+
+    for(; i < n; i++){
+        if(value.at(i) < QChar('0') || value.at(i) > QChar('9')){
+            return false;
+        }
+    }
+
+    return true;
+
+}
+
+XlsxSource::XlsxSource(const QString &fileName, QObject *parent) :
+    QObject(parent)
+{
+
+    m_fileName = fileName;
+    m_date1904 = false;
+
+}
+
+/* Sheets that were not started are dropped, the running ones cancelled. */
+XlsxSource::~XlsxSource(){
+
+    m_cancelled.store(1);
+
+    m_mutex.lock();
+    m_queue.clear();
+    m_mutex.unlock();
+
+    foreach(Parser *p, m_parsers){
+        p->wait();
+    }
+    qDeleteAll(m_parsers);
+
+}
+
+bool XlsxSource::open(QString *error){
+
+    QZipReader zip(m_fileName);
+    if(!zip.isReadable()){
+        *error = QString("Cannot open ") + m_fileName + QString(".");
+        return false;
+    }
+
+    /* The workbook part, xl/workbook.xml unless the package says otherwise. */
+    QString workbook = QString("xl/workbook.xml");
+    foreach(Relationship r, relationships(&zip, QString(""))){
+        if(r.type.endsWith(QString("/officeDocument"))){
+            workbook = r.target;
+        }
+    }
+
+    QByteArray data = zip.fileData(workbook);
+    if(data.isEmpty()){
+        *error = m_fileName + QString(" is not an xlsx workbook.");
+        return false;
+    }
+
+    QHash<QString, Relationship> parts = relationships(&zip, workbook);
+
+    /* The worksheets in the order of the tabs; chart sheets have no cells. */
+    m_sheets.clear();
+    QXmlStreamReader xml(data);
+    while(!xml.atEnd()){
+        xml.readNext();
+        if(!xml.isStartElement()){
+            continue;
+        }
+
+        if(xml.name() == QLatin1String("workbookPr")){
+            QString date1904 = xml.attributes().value(QLatin1String("date1904")).toString();
+            m_date1904 = date1904 == QString("1") || date1904 == QString("true");
+        }
+        else if(xml.name() == QLatin1String("sheet")){
+            Relationship r = parts.value(xml.attributes().value(QLatin1String("r:id")).toString());
+            if(r.type.endsWith(QString("/worksheet"))){
+                Sheet sheet;
+                sheet.name = xml.attributes().value(QLatin1String("name")).toString();
+                sheet.part = r.target;
+                sheet.ready = false;
+                m_sheets.append(sheet);
+            }
+        }
+    }
+    if(xml.hasError()){
+        *error = m_fileName + QString(": ") + xml.errorString();
+        m_sheets.clear();
+        return false;
+    }
+
+    /* Read once, for all sheets. */
+    foreach(Relationship r, parts){
+        if(r.type.endsWith(QString("/sharedStrings"))){
+            readSharedStrings(zip.fileData(r.target));
+        }
+        else if(r.type.endsWith(QString("/styles"))){
+            readStyles(zip.fileData(r.target));
+        }
+    }
+
+    m_queue.clear();
+    for(int i = 0; i < m_sheets.count(); i++){
+        m_queue.append(i);
+    }
+
+    return true;
+
+}
+
+QStringList XlsxSource::sheetNames() const{
+
+    QMutexLocker lock(&m_mutex);
+
+    QStringList names;
+    foreach(const Sheet &sheet, m_sheets){
+        names.append(sheet.name);
+    }
+
+    return names;
+
+}
+
+void XlsxSource::start(int threads){
+
+    QMutexLocker lock(&m_mutex);
+
+    if(threads <= 0){
+        threads = QThread::idealThreadCount();
+    }
+    threads = qMin(threads, m_queue.count() - m_parsers.count());
+
+    for(int i = 0; i < threads; i++){
+        Parser *p = new Parser(this);
+        m_parsers.append(p);
+        p->start();
+    }
+
+}
+
+/* Parsed next, by the first thread that is free. */
+void XlsxSource::prioritize(int sheet){
+
+    QMutexLocker lock(&m_mutex);
+
+    if(m_queue.removeOne(sheet)){
+        m_queue.prepend(sheet);
+    }
+
+}
+
+/* A sheet that no thread has yet is parsed on this thread. */
+void XlsxSource::wait(int sheet){
+
+    if(sheet < 0 || sheet >= m_sheets.count()){
+        return;
+    }
+
+    m_mutex.lock();
+    bool here = m_queue.removeOne(sheet);
+    m_mutex.unlock();
+
+    if(here){
+        QZipReader zip(m_fileName);
+        parse(&zip, sheet);
+        return;
+    }
+
+    QMutexLocker lock(&m_mutex);
+    while(!m_sheets.at(sheet).ready){
+        m_readyCondition.wait(&m_mutex);
+    }
+
+}
+
+bool XlsxSource::isReady(int sheet) const{
+
+    QMutexLocker lock(&m_mutex);
+
+    return sheet >= 0 && sheet < m_sheets.count() && m_sheets.at(sheet).ready;
+
+}
+
+SheetSnapshot XlsxSource::snapshot(int sheet) const{
+
+    QMutexLocker lock(&m_mutex);
+
+    return m_sheets.value(sheet).snapshot;
+
+}
+
+QString XlsxSource::error(int sheet) const{
+
+    QMutexLocker lock(&m_mutex);
+
+    return m_sheets.value(sheet).error;
+
+}
+
+QList<QRect> XlsxSource::mergedCells(int sheet) const{
+
+    QMutexLocker lock(&m_mutex);
+
+    return m_sheets.value(sheet).merged;
+
+}
+
+bool XlsxSource::load(const QString &fileName, const QString &sheetName, SheetSnapshot *out, QString *error){
+
+    out->clear();
+
+    XlsxSource source(fileName);
+    if(!source.open(error)){
+        return false;
+    }
+
+    int sheet = sheetName.isEmpty() ? 0 : source.sheetNames().indexOf(sheetName);
+    if(sheet < 0 || sheet >= source.sheetNames().count()){
+        *error = QString("The workbook ") + fileName + QString(" has no sheet \"") + sheetName + QString("\".");
+        return false;
+    }
+
+    source.wait(sheet);
+    if(!source.error(sheet).isEmpty()){
+        *error = source.error(sheet);
+        return false;
+    }
+
+    *out = source.snapshot(sheet);
+
+    return true;
+
+}
+
+int XlsxSource::take(){
+
+    QMutexLocker lock(&m_mutex);
+
+    return m_queue.isEmpty() ? -1 : m_queue.takeFirst();
+
+}
+
+void XlsxSource::parse(QZipReader *zip, int sheet){
+
+    m_mutex.lock();
+    QString name = m_sheets.at(sheet).name;
+    QString part = m_sheets.at(sheet).part;
+    m_mutex.unlock();
+
+    SheetSnapshot snapshot;
+    QList<QRect> merged;
+    QString error;
+
+    QByteArray data = zip->fileData(part);
+    if(data.isEmpty()){
+        error = QString("The sheet \"") + name + QString("\" cannot be read.");
+    }
+    else if(!parseSheet(data, &snapshot, &merged, &error)){
+        error = QString("The sheet \"") + name + QString("\" cannot be read: ") + error;
+    }
+
+    /* Nobody waits for it any more. */
+    if(m_cancelled.load()){
+        return;
+    }
+
+    m_mutex.lock();
+    Sheet &s = m_sheets[sheet];
+    s.snapshot = snapshot;
+    s.merged = merged;
+    s.error = error;
+    s.ready = true;
+    m_readyCondition.wakeAll();
+    m_mutex.unlock();
+
+    emit sheetReady(sheet);
+
+}
+
+/*
+ * The cells of a sheet, rows and columns from 1 up to the last cell with
+ * a value. The dimension of the sheet is not used: formatting a whole
+ * sheet makes it A1:XFD1048576, and empty formatted cells do not count
+ * for the same reason.
+ */
+bool XlsxSource::parseSheet(const QByteArray &data, SheetSnapshot *out, QList<QRect> *merged, QString *error) const{
+
+    QVector<XlsxCell> cells;
+    int rows = 0;
+    int cols = 0;
+    int row = 0;
+    int col = 0;
+
+    QXmlStreamReader xml(data);
+    while(!xml.atEnd()){
+        xml.readNext();
+        if(!xml.isStartElement()){
+            continue;
+        }
+
+        QStringRef name = xml.name();
+        if(name == QLatin1String("c")){
+            QXmlStreamAttributes attributes = xml.attributes();
+
+            /* Without a reference, the cell after the previous one. */
+            QStringRef ref = attributes.value(QLatin1String("r"));
+            if(ref.isEmpty()){
+                row = qMax(row, 1);
+                col++;
+            }
+            else if(!cellPosition(ref, &row, &col)){
+                xml.skipCurrentElement();
+                continue;
+            }
+            QString type = attributes.value(QLatin1String("t")).toString();
+            int style = attributes.value(QLatin1String("s")).toInt();
+
+            QString value;
+            while(xml.readNextStartElement()){
+                if(xml.name() == QLatin1String("v")){
+                    value = xml.readElementText();
+                }
+                else if(xml.name() == QLatin1String("is")){
+                    value = inlineText(&xml);
+                }
+                else{
+                    xml.skipCurrentElement();
+                }
+            }
+
+            if(!value.isEmpty() && row <= XLSXSOURCE_MAX_ROWS && col <= XLSXSOURCE_MAX_COLUMNS){
+                rows = qMax(rows, row);
+                cols = qMax(cols, col);
+
+                XlsxCell cell;
+                cell.row = row;
+                cell.col = col;
+                cell.value = cellValue(type, style, value);
+                cells.append(cell);
+            }
+        }
+        else if(name == QLatin1String("row")){
+            if(m_cancelled.load()){
+                return false;
+            }
+            int r = xml.attributes().value(QLatin1String("r")).toInt();
+            row = r > 0 ? r : row + 1;
+            col = 0;
+        }
+        else if(name == QLatin1String("mergeCell")){
+            QXmlStreamAttributes attributes = xml.attributes();
+            QStringRef ref = attributes.value(QLatin1String("ref"));
+            int colon = ref.indexOf(QChar(':'));
+            int r1, c1, r2, c2;
+            if(colon > 0 && cellPosition(ref.left(colon), &r1, &c1) && cellPosition(ref.mid(colon + 1), &r2, &c2)){
+                merged->append(QRect(c1, r1, c2 - c1 + 1, r2 - r1 + 1));
+            }
+        }
+    }
+    if(xml.hasError()){
+        *error = xml.errorString() + QString(" (line ") + QString::number(xml.lineNumber()) + QString(")");
+        return false;
+    }
+
+    if((qint64)rows * cols > XLSXSOURCE_MAX_CELLS){
+        *error = QString("The sheet is too large: ") + QString::number(rows) + QString(" rows of ") +
+                 QString::number(cols) + QString(" columns.");
+        return false;
+    }
+
+    out->reset(cols);
+    out->resize(rows);
+    foreach(const XlsxCell &cell, cells){
+        out->row(cell.row)[cell.col - 1] = cell.value;
+    }
+
+    return true;
+
+}
+
+/* A value as SheetModel shows it, see QXlsx::Worksheet::read(). */
+QByteArray XlsxSource::cellValue(const QString &type, int style, const QString &value) const{
+
+    if(type == QLatin1String("s")){
+        return m_strings.value(value.toInt());
+    }
+    if(type == QLatin1String("b")){
+        return value.toInt() != 0 ? QByteArray("true") : QByteArray("false");
+    }
+    if(!type.isEmpty() && type != QLatin1String("n")){
+        return value.toUtf8();
+    }
+
+    bool ok;
+    double number = value.toDouble(&ok);
+    if(!ok){
+        return value.toUtf8();
+    }
+
+    /* Days since 1900 (with its 29th of February) or 1904: a date, a time or both. */
+    if(style >= 0 && style < m_dateStyles.count() && m_dateStyles.at(style)){
+        double days = (!m_date1904 && number > 60) ? number - 1 : number;
+        QDateTime epoch(m_date1904 ? QDate(1904, 1, 1) : QDate(1899, 12, 31), QTime(0, 0));
+        QDateTime dateTime = epoch.addMSecs((qint64)(days * 86400000.0 + 0.5));
+
+        if(number < 1){
+            return QVariant(dateTime.time()).toString().toUtf8();
+        }
+        if(std::fmod(number, 1.0) < 1.0 / 86400000.0){
+            return QVariant(dateTime.date()).toString().toUtf8();
+        }
+        return QVariant(dateTime).toString().toUtf8();
+    }
+
+    if(isWholeNumber(value)){
+        return value.toUtf8();
+    }
+
+    return QVariant(number).toString().toUtf8();
+
+}
+
+/* xl/sharedStrings.xml: the strings that cells of type "s" refer to by index. */
+void XlsxSource::readSharedStrings(const QByteArray &data){
+
+    m_strings.clear();
+
+    QXmlStreamReader xml(data);
+    while(!xml.atEnd()){
+        xml.readNext();
+        if(!xml.isStartElement()){
+            continue;
+        }
+
+        if(xml.name() == QLatin1String("sst")){
+            m_strings.reserve(xml.attributes().value(QLatin1String("uniqueCount")).toInt());
+        }
+        else if(xml.name() == QLatin1String("si")){
+            m_strings.append(inlineText(&xml).toUtf8());
+        }
+    }
+
+}
+
+/* xl/styles.xml: which cell formats (the "s" of a cell) show a date. */
+void XlsxSource::readStyles(const QByteArray &data){
+
+    QHash<int, QString> formats;
+    bool cellFormats = false;
+
+    m_dateStyles.clear();
+
+    QXmlStreamReader xml(data);
+    while(!xml.atEnd()){
+        xml.readNext();
+
+        if(xml.isStartElement()){
+            if(xml.name() == QLatin1String("numFmt")){
+                formats.insert(xml.attributes().value(QLatin1String("numFmtId")).toInt(),
+                               xml.attributes().value(QLatin1String("formatCode")).toString());
+            }
+            else if(xml.name() == QLatin1String("cellXfs")){
+                cellFormats = true;
+            }
+            else if(xml.name() == QLatin1String("xf") && cellFormats){
+                int id = xml.attributes().value(QLatin1String("numFmtId")).toInt();
+                m_dateStyles.append(isDateFormat(id, formats.value(id)));
+            }
+        }
+        else if(xml.isEndElement() && xml.name() == QLatin1String("cellXfs")){
+            cellFormats = false;
+        }
+    }
+
+}
+
+/* The relationships of a part, by id, with the targets as paths in the package. */
+QHash<QString, XlsxSource::Relationship> XlsxSource::relationships(QZipReader *zip, const QString &part){
+
+    QHash<QString, Relationship> res;
+
+    int slash = part.lastIndexOf(QChar('/'));
+    QString folder = part.left(slash + 1);
+
+    QXmlStreamReader xml(zip->fileData(folder + QString("_rels/") + part.mid(slash + 1) + QString(".rels")));
+    while(!xml.atEnd()){
+        xml.readNext();
+        if(!xml.isStartElement() || xml.name() != QLatin1String("Relationship")){
+            continue;
+        }
+
+        QXmlStreamAttributes attributes = xml.attributes();
+        Relationship r;
+        r.type = attributes.value(QLatin1String("Type")).toString();
+        r.target = attributes.value(QLatin1String("Target")).toString();
+        if(r.target.startsWith(QChar('/'))){
+            r.target = r.target.mid(1);
+        }
+        else{
+            r.target = QDir::cleanPath(folder + r.target);
+        }
+        res.insert(attributes.value(QLatin1String("Id")).toString(), r);
+    }
+
+    return res;
+
+}
+
+/*
+ * The text of an <si> or <is> element: one <t>, or the <t> of every
+ * run of rich text, without the phonetic hints (<rPh>).
+ */
+QString XlsxSource::inlineText(QXmlStreamReader *xml){
+
+    QString text;
+
+    while(xml->readNextStartElement()){
+        if(xml->name() == QLatin1String("t")){
+            text += xml->readElementText();
+        }
+        else if(xml->name() == QLatin1String("r")){
+            while(xml->readNextStartElement()){
+                if(xml->name() == QLatin1String("t")){
+                    text += xml->readElementText();
+                }
+                else{
+                    xml->skipCurrentElement();
+                }
+            }
+        }
+        else{
+            xml->skipCurrentElement();
+        }
+    }
+
+    return text;
+
+}
+
+/* Same rules as QXlsx::Format::isDateTimeFormat(). */
+bool XlsxSource::isDateFormat(int id, const QString &code){
+
+    if(code.isEmpty()){
+        return (id >= 14 && id <= 22) || (id >= 45 && id <= 47) ||
+               (id >= 27 && id <= 36) || (id >= 50 && id <= 58);
+    }
+
+    for(int i = 0; i < code.length(); i++){
+        switch(code.at(i).unicode()){
+          case '[':
+            /* [h], [m] and [s] are elapsed time, anything else a color or condition. */
+            if(i + 2 < code.length() && code.at(i + 2) == QChar(']')){
+                QChar c = code.at(i + 1).toLower();
+                if(c == QChar('h') || c == QChar('m') || c == QChar('s')){
+                    return true;
+                }
+                i += 2;
+            }
+            else{
+                while(i < code.length() && code.at(i) != QChar(']')){
+                    i++;
+                }
+            }
+            break;
+          case '"':
+            while(i < code.length() - 1 && code.at(++i) != QChar('"'));
+            break;
+          case '\\':
+            i++;
+            break;
+          case 'D': case 'd': case 'M': case 'm': case 'H': case 'h':
+          case 'S': case 's': case 'Y': case 'y':
+            return true;
+          default:
+            break;
+        }
+    }
+
+    return false;
+
+}
+
+/* "B12" is row 12, column 2. */
+bool XlsxSource::cellPosition(const QStringRef &ref, int *row, int *col){
+
+    const QChar *p = ref.unicode();
+    int n = ref.size();
+    int i = 0;
+    int c = 0;
+    int r = 0;
+
+    for(; i < n; i++){
+        ushort u = p[i].unicode();
+        if(u >= 'A' && u <= 'Z'){
+            c = c * 26 + (u - 'A' + 1);
+        }
+        else if(u >= 'a' && u <= 'z'){
+            c = c * 26 + (u - 'a' + 1);
+        }
+        else{
+            break;
+        }
+        if(c > XLSXSOURCE_MAX_COLUMNS){
+            return false;
+        }
+    }
+    for(; i < n && p[i].isDigit(); i++){
+        r = r * 10 + p[i].digitValue();
+        if(r > XLSXSOURCE_MAX_ROWS){
+            return false;
+        }
+    }
+
+    if(c == 0 || r == 0 || i != n){
+        return false;
+    }
+
+    *row = r;
+    *col = c;
+
+    return true;
+
+}
+
+XlsxSource::Parser::Parser(XlsxSource *source) :
+    QThread(), m_source(source)
+{
+}
+
+/* A reader of its own: QZipReader is not shared between threads. */
+void XlsxSource::Parser::run(){
+
+    QZipReader zip(m_source->m_fileName);
+
+    int sheet;
+    while((sheet = m_source->take()) >= 0){
+        m_source->parse(&zip, sheet);
+    }
+
+}
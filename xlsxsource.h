@@ -0,0 +1,133 @@
+#ifndef XLSXSOURCE_H
+#define XLSXSOURCE_H
+
+#include <QObject>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <QStringList>
+#include <QVector>
+#include <QList>
+#include <QHash>
+#include <QRect>
+
+#include "sheetsnapshot.h"
+
+QT_BEGIN_NAMESPACE
+class QZipReader;
+class QXmlStreamReader;
+QT_END_NAMESPACE
+
+/*
+ * Reads the worksheets of an xlsx workbook into snapshots, the sheets in
+ * parallel, as an alternative to QXlsx::Document, which parses every
+ * sheet one after another before the first one can be shown.
+ *
+ * open() reads what all sheets need: the list of sheets, the shared
+ * strings and which cell formats are dates. That is read once and only
+ * read by the threads afterwards. start() parses the sheets on a thread
+ * per core; every thread takes the next sheet from a queue, and
+ * sheetReady() is emitted as soon as a sheet is done. prioritize() moves
+ * a sheet to the front of the queue, e.g. the one that is shown; wait()
+ * parses a sheet right away, or waits for the thread that has it.
+ * Deleting the source cancels the sheets that are still being parsed.
+ *
+ * The cells hold what QXlsx::SheetModel shows: the text, the number, true
+ * or false, or for a date format the date and time.
+ */
+class XlsxSource : public QObject
+{
+    Q_OBJECT
+
+public:
+    XlsxSource(const QString &fileName, QObject *parent = 0);
+    ~XlsxSource();
+
+    bool open(QString *error);
+
+    QString fileName() const { return m_fileName; }
+    QStringList sheetNames() const;
+
+    /* Parse all sheets on `threads` threads, 0 for one per core. */
+    void start(int threads = 0);
+
+    void prioritize(int sheet);
+    void wait(int sheet);
+    bool isReady(int sheet) const;
+
+    /* Once the sheet is ready. */
+    SheetSnapshot snapshot(int sheet) const;
+    QString error(int sheet) const;
+
+    /* Merged cells: column, row (1-based), columns and rows. */
+    QList<QRect> mergedCells(int sheet) const;
+
+    /* One sheet, the first when `sheetName` is empty, on this thread; see MailDaemon. */
+    static bool load(const QString &fileName, const QString &sheetName, SheetSnapshot *out, QString *error);
+
+signals:
+    void sheetReady(int sheet);
+
+private:
+    /* Takes sheets from the queue until it is empty. */
+    class Parser : public QThread
+    {
+    public:
+        Parser(XlsxSource *source);
+
+    protected:
+        void run();
+
+    private:
+        XlsxSource *m_source;
+    };
+
+    struct Sheet {
+        QString name;
+        QString part;
+        bool ready;
+        SheetSnapshot snapshot;
+        QList<QRect> merged;
+        QString error;
+    };
+
+    struct Relationship {
+        QString type;
+        QString target;
+    };
+
+    /* Next sheet from the queue, -1 when empty. */
+    int take();
+
+    /* Parse a sheet and store it. */
+    void parse(QZipReader *zip, int sheet);
+    bool parseSheet(const QByteArray &xml, SheetSnapshot *out, QList<QRect> *merged, QString *error) const;
+    QByteArray cellValue(const QString &type, int style, const QString &value) const;
+
+    void readSharedStrings(const QByteArray &xml);
+    void readStyles(const QByteArray &xml);
+
+    static QHash<QString, Relationship> relationships(QZipReader *zip, const QString &part);
+    static QString inlineText(QXmlStreamReader *xml);
+    static bool isDateFormat(int id, const QString &code);
+    static bool cellPosition(const QStringRef &ref, int *row, int *col);
+
+    QString m_fileName;
+
+    /* Read by open(), shared read-only by the threads. */
+    QVector<QByteArray> m_strings;
+    QVector<bool> m_dateStyles;
+    bool m_date1904;
+
+    /* Set by the destructor: the threads stop at the next row. */
+    QAtomicInt m_cancelled;
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_readyCondition;
+    QVector<Sheet> m_sheets;
+    QList<int> m_queue;
+    QList<Parser*> m_parsers;
+};
+
+#endif // XLSXSOURCE_H